@@ -0,0 +1,147 @@
+/* Copyright (C) 2006-2016 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+#include "libupnpp/config.h"
+
+#include "libupnpp/control/actionstats.hxx"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace UPnPClient {
+
+const int ActionStats::bucketLimitsMs[ActionStats::NBUCKETS] =
+{1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+
+static std::atomic<bool> o_enabled(false);
+static std::atomic<bool> o_hasHook(false);
+static ActionStats::TraceHook o_hook;
+static std::mutex o_hooklock;
+// Entries are indexed by deviceId\0serviceType\0actionName
+static std::unordered_map<string, ActionStats::Entry> o_stats;
+static std::mutex o_statslock;
+
+int ActionStats::Entry::percentileMs(int percent) const
+{
+    if (count == 0) {
+        return -1;
+    }
+    uint64_t target = (uint64_t(count) * percent + 99) / 100;
+    uint64_t cumul = 0;
+    for (int i = 0; i < NBUCKETS; i++) {
+        cumul += histogram[i];
+        if (cumul >= target) {
+            return bucketLimitsMs[i];
+        }
+    }
+    return -1;
+}
+
+void ActionStats::setEnabled(bool onoff)
+{
+    o_enabled = onoff;
+}
+
+bool ActionStats::isEnabled()
+{
+    return o_enabled;
+}
+
+bool ActionStats::active()
+{
+    return o_enabled || o_hasHook;
+}
+
+void ActionStats::getStats(vector<Entry>& out)
+{
+    std::unique_lock<std::mutex> lock(o_statslock);
+    out.clear();
+    out.reserve(o_stats.size());
+    for (const auto& ent : o_stats) {
+        out.push_back(ent.second);
+    }
+}
+
+void ActionStats::reset()
+{
+    std::unique_lock<std::mutex> lock(o_statslock);
+    o_stats.clear();
+}
+
+void ActionStats::setTraceHook(TraceHook hook)
+{
+    std::unique_lock<std::mutex> lock(o_hooklock);
+    o_hook = hook;
+    o_hasHook = bool(o_hook);
+}
+
+void ActionStats::record(const ActionTrace& trace)
+{
+    if (o_enabled) {
+        int64_t us = trace.buildUs + trace.networkUs + trace.decodeUs;
+        int bucket = 0;
+        while (bucket < NBUCKETS && us > bucketLimitsMs[bucket] * 1000LL) {
+            bucket++;
+        }
+        string key(trace.deviceId);
+        key += '\0';
+        key += trace.serviceType;
+        key += '\0';
+        key += trace.actionName;
+
+        std::unique_lock<std::mutex> lock(o_statslock);
+        auto it = o_stats.find(key);
+        if (it == o_stats.end()) {
+            Entry ent;
+            ent.deviceId = trace.deviceId;
+            ent.serviceType = trace.serviceType;
+            ent.actionName = trace.actionName;
+            it = o_stats.insert(make_pair(key, ent)).first;
+        }
+        Entry& ent = it->second;
+        ent.count++;
+        if (trace.errcode) {
+            ent.errors++;
+        }
+        ent.totalUs += us;
+        if (us > ent.maxUs) {
+            ent.maxUs = us;
+        }
+        ent.totalNetworkUs += trace.networkUs;
+        ent.totalRequestSize += trace.requestSize;
+        ent.totalResponseSize += trace.responseSize;
+        ent.histogram[bucket]++;
+    }
+
+    if (o_hasHook) {
+        TraceHook hook;
+        {
+            std::unique_lock<std::mutex> lock(o_hooklock);
+            hook = o_hook;
+        }
+        if (hook) {
+            hook(trace);
+        }
+    }
+}
+
+} // namespace UPnPClient
@@ -0,0 +1,120 @@
+/* Copyright (C) 2006-2016 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+#ifndef _ACTIONSTATS_HXX_INCLUDED_
+#define _ACTIONSTATS_HXX_INCLUDED_
+
+#include "libupnpp/config.h"
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace UPnPClient {
+
+/** Data recorded for one action call performed by Service::runAction().
+ *
+ * The request and response sizes are the sums of the argument names and
+ * values sizes, not the HTTP message sizes, which libupnp does not
+ * report.
+ */
+struct ActionTrace {
+    std::string serviceType;
+    std::string actionName;
+    /// Device UDN
+    std::string deviceId;
+    size_t requestSize{0};
+    size_t responseSize{0};
+    /// UPNP_E_SUCCESS, negative libupnp error, or positive UPnP error
+    /// code returned by the device.
+    int errcode{0};
+    /// Building the SOAP document (microseconds)
+    int64_t buildUs{0};
+    /// Network exchange, including the libupnp XML parsing (microseconds)
+    int64_t networkUs{0};
+    /// Decoding the response document (microseconds)
+    int64_t decodeUs{0};
+};
+
+/** Client-side action call statistics.
+ *
+ * When enabled, each action call updates a latency histogram for its
+ * (device, service, action) triplet. The data can be retrieved at any
+ * time with getStats(). Independently, a trace hook can be set to
+ * receive every ActionTrace record, e.g. for forwarding to an external
+ * tracing system. The hook is called in the thread which performed
+ * the call, and should return quickly.
+ *
+ * Nothing is recorded (and the cost is one flag test per call) if
+ * statistics are disabled and no hook is set, which is the default.
+ */
+class ActionStats {
+public:
+    /** Histogram bucket upper limits in milliseconds. The last
+     * histogram slot counts the calls slower than the last limit. */
+    static const int bucketLimitsMs[];
+    static const int NBUCKETS = 12;
+
+    /** Statistics for one (device, service, action) triplet */
+    struct Entry {
+        std::string deviceId;
+        std::string serviceType;
+        std::string actionName;
+        unsigned int count{0};
+        /// Calls which returned an error
+        unsigned int errors{0};
+        /// Total and max wall time (build + network + decode)
+        int64_t totalUs{0};
+        int64_t maxUs{0};
+        int64_t totalNetworkUs{0};
+        uint64_t totalRequestSize{0};
+        uint64_t totalResponseSize{0};
+        unsigned int histogram[NBUCKETS+1]{};
+
+        /** Approximate percentile (0-100) in milliseconds, computed
+         * from the histogram: returns the limit of the bucket holding
+         * the value, or -1 if it is beyond the last limit or there is
+         * no data */
+        int percentileMs(int percent) const;
+    };
+
+    /** Enable or disable the statistics aggregation */
+    static void setEnabled(bool onoff);
+    static bool isEnabled();
+
+    /** Retrieve the current statistics */
+    static void getStats(std::vector<Entry>& out);
+
+    /** Reset the statistics */
+    static void reset();
+
+    /** Set function to be called with each trace record. Use an empty
+     * function to disable. */
+    typedef std::function<void (const ActionTrace&)> TraceHook;
+    static void setTraceHook(TraceHook hook);
+
+    /** Private: should we build trace records at all ? */
+    static bool active();
+    /** Private: called by Service::runAction() */
+    static void record(const ActionTrace& trace);
+};
+
+} // namespace UPnPClient
+
+#endif /* _ACTIONSTATS_HXX_INCLUDED_ */
@@ -17,47 +17,249 @@
  */
 #include "libupnpp/config.h"
 
+#include <expat.h>
+#include <stdlib.h>                     // for atoi
 #include <string.h>                     // for strcmp
 
+#include <algorithm>
+#include <vector>
+
 #include "libupnpp/control/avlastchg.hxx"
-#include "libupnpp/expatmm.hxx"         // for inputRefXMLParser
+#include "libupnpp/soaphelp.hxx"        // for xmlQuote, i2s
 
 using namespace std;
 using namespace UPnPP;
 
 namespace UPnPClient {
 
+// The state variable names which can appear in AVTransport and
+// RenderingControl LastChange data, and the RenderingControl channel
+// names. These are stored as pointers into the table, so that the
+// common case needs neither allocation nor a shared lock. The table
+// is sorted for binary search.
+static const vector<string>& knownNames()
+{
+    static const vector<string> names = [] {
+        vector<string> v{
+            "", "AVTransportURI", "AVTransportURIMetaData",
+            "AbsoluteCounterPosition", "AbsoluteTimePosition",
+            "AllowedDefaultTransformSettings", "AllowedTransformSettings",
+            "B", "BlueVideoBlackLevel", "BlueVideoGain", "Brightness", "CF",
+            "ColorTemperature", "Contrast", "CurrentMediaCategory",
+            "CurrentMediaDuration", "CurrentPlayMode",
+            "CurrentRecordQualityMode", "CurrentTrack",
+            "CurrentTrackDuration", "CurrentTrackMetaData",
+            "CurrentTrackURI", "CurrentTransportActions", "DRMState",
+            "DefaultTransformSettings", "GreenVideoBlackLevel",
+            "GreenVideoGain", "HorizontalKeystone", "LF", "LFC", "LFE",
+            "LS", "Loudness", "Master", "Mute", "NextAVTransportURI",
+            "NextAVTransportURIMetaData", "NumberOfTracks",
+            "PlaybackStorageMedium", "PossiblePlaybackStorageMedia",
+            "PossibleRecordQualityModes", "PossibleRecordStorageMedia",
+            "PresetNameList", "RF", "RFC", "RS", "RecordMediumWriteStatus",
+            "RecordStorageMedium", "RedVideoBlackLevel", "RedVideoGain",
+            "RelativeCounterPosition", "RelativeTimePosition", "SD", "SL",
+            "SR", "Sharpness", "SyncOffset", "T", "TransformSettings",
+            "TransportPlaySpeed", "TransportState", "TransportStatus",
+            "VerticalKeystone", "Volume", "VolumeDB",
+        };
+        std::sort(v.begin(), v.end());
+        return v;
+    }();
+    return names;
+}
+
+// Return the table entry for s, or null.
+static const string *knownName(const char *s)
+{
+    const vector<string>& names = knownNames();
+    auto it = std::lower_bound(
+        names.begin(), names.end(), s,
+        [](const string& nm, const char *s) {
+            return strcmp(nm.c_str(), s) < 0;
+        });
+    if (it == names.end() || strcmp(it->c_str(), s))
+        return nullptr;
+    return &*it;
+}
+
+void AVLastChange::Var::setName(const char *nm)
+{
+    if ((m_name = knownName(nm)) == nullptr) {
+        m_ownname = nm;
+    }
+}
+
+void AVLastChange::Var::setChannel(const char *chan)
+{
+    if ((m_channel = knownName(chan)) == nullptr) {
+        m_ownchannel = chan;
+    }
+}
+
+bool AVLastChange::Var::sameKey(const Var& other) const
+{
+    bool samename = m_name && other.m_name ? m_name == other.m_name :
+        name() == other.name();
+    if (!samename)
+        return false;
+    return m_channel && other.m_channel ? m_channel == other.m_channel :
+        channel() == other.channel();
+}
+
+AVLastChange::Var& AVLastChange::append()
+{
+    size_t i = m_count++;
+    if (i < ninline)
+        return m_inline[i];
+    m_more.push_back(Var());
+    return m_more.back();
+}
+
+void AVLastChange::set(const string& name, int instance,
+                       const string& channel, const string& value)
+{
+    Var key;
+    key.setName(name.c_str());
+    key.setChannel(channel.c_str());
+    for (size_t i = 0; i < m_count; i++) {
+        Var& var = i < ninline ? m_inline[i] : m_more[i - ninline];
+        if (var.instance == instance && var.sameKey(key)) {
+            var.value = value;
+            return;
+        }
+    }
+    Var& var = append();
+    var.m_name = key.m_name;
+    var.m_channel = key.m_channel;
+    var.m_ownname = std::move(key.m_ownname);
+    var.m_ownchannel = std::move(key.m_ownchannel);
+    var.instance = instance;
+    var.value = value;
+}
+
+const AVLastChange::Var *AVLastChange::find(
+    const string& name, int instance, const string& channel) const
+{
+    for (size_t i = 0; i < m_count; i++) {
+        const Var& var = (*this)[i];
+        if (var.instance == instance && var.name() == name &&
+            var.channel() == channel)
+            return &var;
+    }
+    return nullptr;
+}
 
-class LastchangeParser : public inputRefXMLParser {
+string AVLastChange::toXML() const
+{
+    vector<int> instances;
+    for (size_t i = 0; i < m_count; i++) {
+        int inst = (*this)[i].instance;
+        if (std::find(instances.begin(), instances.end(), inst) ==
+            instances.end())
+            instances.push_back(inst);
+    }
+    string out("<Event>");
+    for (int inst : instances) {
+        out += "<InstanceID val=\"" + SoapHelp::i2s(inst) + "\">";
+        for (size_t i = 0; i < m_count; i++) {
+            const Var& var = (*this)[i];
+            if (var.instance != inst)
+                continue;
+            out += "<" + var.name();
+            if (!var.channel().empty())
+                out += " channel=\"" + SoapHelp::xmlQuote(var.channel()) +
+                    "\"";
+            out += " val=\"" + SoapHelp::xmlQuote(var.value) + "\"/>";
+        }
+        out += "</InstanceID>";
+    }
+    out += "</Event>";
+    return out;
+}
+
+// The parser for a thread, reused between calls.
+class AVLastChangeDecoder {
 public:
-    LastchangeParser(const string& input, std::unordered_map<string,string>& props)
-        : inputRefXMLParser(input), m_props(props)
-    {}
-
-protected:
-    virtual void StartElement(const XML_Char *name, const XML_Char **attrs)
-    {
-        //LOGDEB("LastchangeParser: begin " << name << endl);
+    ~AVLastChangeDecoder() {
+        if (m_parser)
+            XML_ParserFree(m_parser);
+    }
+
+    bool decode(const string& xml, AVLastChange& out) {
+        out.clear();
+        if (m_parser == nullptr) {
+            if ((m_parser = XML_ParserCreate(NULL)) == nullptr)
+                return false;
+        } else if (!XML_ParserReset(m_parser, NULL)) {
+            return false;
+        }
+        XML_SetUserData(m_parser, this);
+        XML_SetStartElementHandler(m_parser, startElement);
+        m_out = &out;
+        m_instance = 0;
+        bool ok = XML_Parse(m_parser, xml.c_str(), int(xml.size()),
+                            XML_TRUE) == XML_STATUS_OK;
+        m_out = nullptr;
+        return ok;
+    }
+
+private:
+    static void startElement(void *ud, const XML_Char *name,
+                             const XML_Char **attrs) {
+        AVLastChangeDecoder *me = (AVLastChangeDecoder *)ud;
+        const char *val = nullptr;
+        const char *chan = "";
         for (int i = 0; attrs[i] != 0; i += 2) {
-            //LOGDEB("    " << attrs[i] << " -> " << attrs[i+1] << endl);
             if (!strcmp("val", attrs[i])) {
-                m_props[name] = attrs[i+1];
+                val = attrs[i+1];
+            } else if (!strcmp("channel", attrs[i])) {
+                chan = attrs[i+1];
             }
         }
+        if (!strcmp(name, "InstanceID")) {
+            if (val)
+                me->m_instance = atoi(val);
+            return;
+        }
+        if (val == nullptr)
+            return;
+        AVLastChange::Var& var = me->m_out->append();
+        var.setName(name);
+        var.setChannel(chan);
+        var.instance = me->m_instance;
+        var.value = val;
     }
-private:
-    std::unordered_map<string, string>& m_props;
+
+    XML_Parser m_parser{nullptr};
+    AVLastChange *m_out{nullptr};
+    int m_instance{0};
 };
 
+bool decodeAVLastChange(const string& xml, AVLastChange& out)
+{
+    static thread_local AVLastChangeDecoder decoder;
+    return decoder.decode(xml, out);
+}
 
 bool decodeAVLastChange(const string& xml,
                         std::unordered_map<string, string>& props)
 {
-    LastchangeParser mparser(xml, props);
-    if (!mparser.Parse())
+    static thread_local AVLastChange lc;
+    if (!decodeAVLastChange(xml, lc))
         return false;
+    if (lc.size() == 0)
+        return true;
+    int instance = lc[0].instance;
+    props["InstanceID"] = SoapHelp::i2s(instance);
+    for (size_t i = 0; i < lc.size(); i++) {
+        const AVLastChange::Var& var = lc[i];
+        if (var.instance == instance &&
+            (var.channel().empty() || var.channel() == "Master")) {
+            props[var.name()] = var.value;
+        }
+    }
     return true;
 }
 
-
 }
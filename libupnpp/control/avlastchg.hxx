@@ -20,19 +20,93 @@
 
 #include "libupnpp/config.h"
 
-#include <unordered_map>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace UPnPClient {
 
-/** Helper function for decoding UPnP/AV LastChange data.
- *    <Event xmlns="urn:schemas-upnp-org:metadata-1-0/AVT_RCS">
+/** Decoded UPnP/AV LastChange data.
+ *    <Event xmlns="urn:schemas-upnp-org:metadata-1-0/RCS/">
  *      <InstanceID val="0">
- *        <Mute val="0"/>
- *        <Volume val="24"/>
+ *        <Mute channel="Master" val="0"/>
+ *        <Volume channel="Master" val="24"/>
+ *        <Volume channel="LF" val="20"/>
  *      </InstanceID>
  *    </Event>
+ *
+ * Each value is kept with its instance and channel (empty if the
+ * element has no channel attribute). The names defined by the
+ * AVTransport and RenderingControl specifications point to a static
+ * table, other names (vendor extensions) are stored in the Var. The
+ * first few values are stored inside the object, so that a reused
+ * object decodes a typical event without memory allocation.
  */
+class AVLastChange {
+public:
+    class Var {
+    public:
+        const std::string& name() const {
+            return m_name ? *m_name : m_ownname;
+        }
+        const std::string& channel() const {
+            return m_channel ? *m_channel : m_ownchannel;
+        }
+        /** Same variable name and channel (not checking instance) */
+        bool sameKey(const Var& other) const;
+        int instance{0};
+        std::string value;
+    private:
+        friend class AVLastChange;
+        friend class AVLastChangeDecoder;
+        void setName(const char *nm);
+        void setChannel(const char *chan);
+        // Null if the name is not in the static table.
+        const std::string *m_name{nullptr};
+        const std::string *m_channel{nullptr};
+        std::string m_ownname;
+        std::string m_ownchannel;
+    };
+
+    size_t size() const {
+        return m_count;
+    }
+    const Var& operator[](size_t i) const {
+        return i < ninline ? m_inline[i] : m_more[i - ninline];
+    }
+    void clear() {
+        m_count = 0;
+        m_more.clear();
+    }
+    /** Add or replace the value for (name, instance, channel). The
+     *  strings need not be interned. */
+    void set(const std::string& name, int instance,
+             const std::string& channel, const std::string& value);
+    /** Find value. Returns null if not found. An empty channel
+     *  matches the elements with no channel attribute. */
+    const Var *find(const std::string& name, int instance = 0,
+                    const std::string& channel = std::string()) const;
+    /** Build the XML representation, grouping the values by
+     *  instance. */
+    std::string toXML() const;
+
+private:
+    friend class AVLastChangeDecoder;
+    Var& append();
+
+    static const size_t ninline = 8;
+    Var m_inline[ninline];
+    std::vector<Var> m_more;
+    size_t m_count{0};
+};
+
+/** Decode LastChange data. The output object is cleared first. The
+ * parser is reused by the calling thread for the next calls. */
+extern bool decodeAVLastChange(const std::string& xml, AVLastChange& out);
+
+/** Decode LastChange data to a simple map. Only the values for the
+ * first instance and from the elements with no channel or the Master
+ * channel are kept. */
 extern bool decodeAVLastChange(const std::string& xml,
                                std::unordered_map<std::string,
                                std::string>& props);
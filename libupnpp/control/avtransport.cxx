@@ -22,11 +22,13 @@
 
 #include <ostream>                      // for basic_ostream, endl, etc
 #include <string>                       // for string, basic_string, etc
+#include <unordered_map>
 #include <utility>                      // for pair
 #include <vector>                       // for vector
 
 #include "libupnpp/control/avlastchg.hxx"  // for decodeAVLastChange
 #include "libupnpp/control/cdircontent.hxx"  // for UPnPDirContent, etc
+#include "libupnpp/control/subscriptions.hxx"  // for SubscriptionManager
 #include "libupnpp/log.hxx"             // for LOGERR, LOGDEB1, LOGDEB, etc
 #include "libupnpp/soaphelp.hxx"        // for SoapIncoming, etc
 #include "libupnpp/upnpavutils.hxx"     // for upnpdurationtos, etc
@@ -110,6 +112,41 @@ static AVTransport::PlayMode stringToPlayMode(const string& s)
     }
 }
 
+// How the event variables are decoded and reported. The table is
+// built once, so that the cost does not depend on the variable
+// position in a chain of comparisons.
+enum AVTEvtKind {AVTEVT_STRING, AVTEVT_TPSTATE, AVTEVT_TPSTATUS,
+                 AVTEVT_PLAYMODE, AVTEVT_ACTIONS, AVTEVT_INT,
+                 AVTEVT_DURATION, AVTEVT_META};
+
+static AVTEvtKind avtEvtKind(const string& nm)
+{
+    static const std::unordered_map<string, AVTEvtKind> kinds {
+        {"TransportState", AVTEVT_TPSTATE},
+        {"TransportStatus", AVTEVT_TPSTATUS},
+        {"CurrentPlayMode", AVTEVT_PLAYMODE},
+        {"CurrentTransportActions", AVTEVT_ACTIONS},
+        {"TransportPlaySpeed", AVTEVT_INT},
+        {"CurrentTrack", AVTEVT_INT},
+        {"NumberOfTracks", AVTEVT_INT},
+        {"RelativeCounterPosition", AVTEVT_INT},
+        {"AbsoluteCounterPosition", AVTEVT_INT},
+        {"InstanceID", AVTEVT_INT},
+        {"CurrentMediaDuration", AVTEVT_DURATION},
+        {"CurrentTrackDuration", AVTEVT_DURATION},
+        {"RelativeTimePosition", AVTEVT_DURATION},
+        {"AbsoluteTimePosition", AVTEVT_DURATION},
+        {"AVTransportURIMetaData", AVTEVT_META},
+        {"NextAVTransportURIMetaData", AVTEVT_META},
+        {"CurrentTrackMetaData", AVTEVT_META},
+        // CurrentTrackURI, AVTransportURI, NextAVTransportURI, the
+        // storage media and record variables, and the unknown ones
+        // are reported as strings.
+    };
+    auto it = kinds.find(nm);
+    return it == kinds.end() ? AVTEVT_STRING : it->second;
+}
+
 void AVTransport::evtCallback(
     const std::unordered_map<std::string, std::string>& props)
 {
@@ -130,81 +167,61 @@ void AVTransport::evtCallback(
                    << it->second << endl);
             return;
         }
+        VarEventReporter *reporter = getReporter();
+        if (reporter != m_metareporter ||
+            SubscriptionManager::isFullState()) {
+            // A new reporter, or an initial event or replay: the
+            // current values must be sent.
+            m_metareporter = reporter;
+            m_lastmeta.clear();
+        }
         for (std::unordered_map<std::string, std::string>::iterator it1 =
                     props1.begin(); it1 != props1.end(); it1++) {
-            if (!getReporter()) {
+            if (!reporter) {
                 LOGDEB1("AVTransport::evtCallback: " << it1->first << " -> "
                         << it1->second << endl);
                 continue;
             }
 
-            if (!it1->first.compare("TransportState")) {
-                getReporter()->changed(it1->first.c_str(),
-                                       stringToTpState(it1->second));
-
-            } else if (!it1->first.compare("TransportStatus")) {
-                getReporter()->changed(it1->first.c_str(),
-                                       stringToTpStatus(it1->second));
-
-            } else if (!it1->first.compare("CurrentPlayMode")) {
-                getReporter()->changed(it1->first.c_str(),
-                                       stringToPlayMode(it1->second));
-
-            } else if (!it1->first.compare("CurrentTransportActions")) {
+            const char *nm = it1->first.c_str();
+            switch (avtEvtKind(it1->first)) {
+            case AVTEVT_TPSTATE:
+                reporter->changed(nm, stringToTpState(it1->second));
+                break;
+            case AVTEVT_TPSTATUS:
+                reporter->changed(nm, stringToTpStatus(it1->second));
+                break;
+            case AVTEVT_PLAYMODE:
+                reporter->changed(nm, stringToPlayMode(it1->second));
+                break;
+            case AVTEVT_ACTIONS:
+            {
                 int iacts;
                 if (!CTAStringToBits(it1->second, iacts))
-                    getReporter()->changed(it1->first.c_str(), iacts);
-
-            } else if (!it1->first.compare("CurrentTrackURI") ||
-                       !it1->first.compare("AVTransportURI") ||
-                       !it1->first.compare("NextAVTransportURI")) {
-                getReporter()->changed(it1->first.c_str(),
-                                       it1->second.c_str());
-
-            } else if (!it1->first.compare("TransportPlaySpeed") ||
-                       !it1->first.compare("CurrentTrack") ||
-                       !it1->first.compare("NumberOfTracks") ||
-                       !it1->first.compare("RelativeCounterPosition") ||
-                       !it1->first.compare("AbsoluteCounterPosition") ||
-                       !it1->first.compare("InstanceID")) {
-                getReporter()->changed(it1->first.c_str(),
-                                       atoi(it1->second.c_str()));
-
-            } else if (!it1->first.compare("CurrentMediaDuration") ||
-                       !it1->first.compare("CurrentTrackDuration") ||
-                       !it1->first.compare("RelativeTimePosition") ||
-                       !it1->first.compare("AbsoluteTimePosition")) {
-                getReporter()->changed(it1->first.c_str(),
-                                       upnpdurationtos(it1->second));
-
-            } else if (!it1->first.compare("AVTransportURIMetaData") ||
-                       !it1->first.compare("NextAVTransportURIMetaData") ||
-                       !it1->first.compare("CurrentTrackMetaData")) {
-                UPnPDirContent meta;
-                if (!meta.parse(it1->second)) {
-                    LOGERR("AVTransport event: bad metadata: [" <<
-                           it1->second << "]" << endl);
-                } else {
-                    LOGDEB1("AVTransport event: good metadata: [" <<
-                            it1->second << "]" << endl);
-                    if (meta.m_items.size() > 0) {
-                        getReporter()->changed(it1->first.c_str(),
-                                               meta.m_items[0]);
-                    }
+                    reporter->changed(nm, iacts);
+                break;
+            }
+            case AVTEVT_INT:
+                reporter->changed(nm, atoi(it1->second.c_str()));
+                break;
+            case AVTEVT_DURATION:
+                reporter->changed(nm, upnpdurationtos(it1->second));
+                break;
+            case AVTEVT_META:
+            {
+                // Only parsed if the reporter asks for it.
+                auto hit = m_lastmeta.find(it1->first);
+                if (hit != m_lastmeta.end() && hit->second == it1->second) {
+                    LOGDEB1("AVTransport event: unchanged " << nm << endl);
+                    break;
                 }
-            } else if (!it1->first.compare("PlaybackStorageMedium") ||
-                       !it1->first.compare("PossiblePlaybackStorageMedia") ||
-                       !it1->first.compare("RecordStorageMedium") ||
-                       !it1->first.compare("PossibleRecordStorageMedia") ||
-                       !it1->first.compare("RecordMediumWriteStatus") ||
-                       !it1->first.compare("CurrentRecordQualityMode") ||
-                       !it1->first.compare("PossibleRecordQualityModes")) {
-                getReporter()->changed(it1->first.c_str(),it1->second.c_str());
-
-            } else {
-                LOGDEB1("AVTransport event: unknown variable: name [" <<
-                        it1->first << "] value [" << it1->second << endl);
-                getReporter()->changed(it1->first.c_str(),it1->second.c_str());
+                m_lastmeta[it1->first] = it1->second;
+                reporter->changed(nm, UPnPDirMeta(it1->second));
+                break;
+            }
+            case AVTEVT_STRING:
+                reporter->changed(nm, it1->second.c_str());
+                break;
             }
         }
     }
@@ -216,7 +233,7 @@ int AVTransport::setURI(const string& uri, const string& metadata,
 {
     SoapOutgoing args(getServiceType(), next ? "SetNextAVTransportURI" :
                       "SetAVTransportURI");
-    args("InstanceID", SoapHelp::i2s(instanceID))
+    args("InstanceID", instanceID)
     (next ? "NextURI" : "CurrentURI", uri)
     (next ? "NextURIMetaData" : "CurrentURIMetaData", metadata);
 
@@ -252,8 +269,8 @@ int AVTransport::setPlayMode(PlayMode pm, int instanceID)
         break;
     }
 
-    args("InstanceID", SoapHelp::i2s(instanceID))
-    ("NewPlayMode", playmode);
+    args("InstanceID", instanceID)
+    ("NewPlayMode", std::move(playmode));
 
     SoapIncoming data;
     return runAction(args, data);
@@ -262,7 +279,7 @@ int AVTransport::setPlayMode(PlayMode pm, int instanceID)
 int AVTransport::getMediaInfo(MediaInfo& info, int instanceID)
 {
     SoapOutgoing args(getServiceType(), "GetMediaInfo");
-    args("InstanceID", SoapHelp::i2s(instanceID));
+    args("InstanceID", instanceID);
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
@@ -273,14 +290,14 @@ int AVTransport::getMediaInfo(MediaInfo& info, int instanceID)
     data.get("MediaDuration", &s);
     info.mduration = upnpdurationtos(s);
     data.get("CurrentURI", &info.cururi);
-    data.get("CurrentURIMetaData", &s);
+    data.take("CurrentURIMetaData", &s);
     UPnPDirContent meta;
     meta.parse(s);
     if (meta.m_items.size() > 0)
         info.curmeta = meta.m_items[0];
     meta.clear();
     data.get("NextURI", &info.nexturi);
-    data.get("NextURIMetaData", &s);
+    data.take("NextURIMetaData", &s);
     if (meta.m_items.size() > 0)
         info.nextmeta = meta.m_items[0];
     data.get("PlayMedium", &info.pbstoragemed);
@@ -292,7 +309,7 @@ int AVTransport::getMediaInfo(MediaInfo& info, int instanceID)
 int AVTransport::getTransportInfo(TransportInfo& info, int instanceID)
 {
     SoapOutgoing args(getServiceType(), "GetTransportInfo");
-    args("InstanceID", SoapHelp::i2s(instanceID));
+    args("InstanceID", instanceID);
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
@@ -310,7 +327,7 @@ int AVTransport::getTransportInfo(TransportInfo& info, int instanceID)
 int AVTransport::getPositionInfo(PositionInfo& info, int instanceID)
 {
     SoapOutgoing args(getServiceType(), "GetPositionInfo");
-    args("InstanceID", SoapHelp::i2s(instanceID));
+    args("InstanceID", instanceID);
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
@@ -320,7 +337,7 @@ int AVTransport::getPositionInfo(PositionInfo& info, int instanceID)
     data.get("Track", &info.track);
     data.get("TrackDuration", &s);
     info.trackduration = upnpdurationtos(s);
-    data.get("TrackMetaData", &s);
+    data.take("TrackMetaData", &s);
     UPnPDirContent meta;
     meta.parse(s);
     if (meta.m_items.size() > 0) {
@@ -342,7 +359,7 @@ int AVTransport::getPositionInfo(PositionInfo& info, int instanceID)
 int AVTransport::getDeviceCapabilities(DeviceCapabilities& info, int iID)
 {
     SoapOutgoing args(getServiceType(), "GetDeviceCapabilities");
-    args("InstanceID", SoapHelp::i2s(iID));
+    args("InstanceID", iID);
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
@@ -357,7 +374,7 @@ int AVTransport::getDeviceCapabilities(DeviceCapabilities& info, int iID)
 int AVTransport::getTransportSettings(TransportSettings& info, int instanceID)
 {
     SoapOutgoing args(getServiceType(), "GetTransportSettings");
-    args("InstanceID", SoapHelp::i2s(instanceID));
+    args("InstanceID", instanceID);
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
@@ -373,7 +390,7 @@ int AVTransport::getTransportSettings(TransportSettings& info, int instanceID)
 int AVTransport::getCurrentTransportActions(int& iacts, int iID)
 {
     SoapOutgoing args(getServiceType(), "GetCurrentTransportActions");
-    args("InstanceID", SoapHelp::i2s(iID));
+    args("InstanceID", iID);
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
@@ -424,7 +441,7 @@ int AVTransport::CTAStringToBits(const string& actions, int& iacts)
 int AVTransport::stop(int instanceID)
 {
     SoapOutgoing args(getServiceType(), "Stop");
-    args("InstanceID", SoapHelp::i2s(instanceID));
+    args("InstanceID", instanceID);
     SoapIncoming data;
     return runAction(args, data);
 }
@@ -432,7 +449,7 @@ int AVTransport::stop(int instanceID)
 int AVTransport::pause(int instanceID)
 {
     SoapOutgoing args(getServiceType(), "Pause");
-    args("InstanceID", SoapHelp::i2s(instanceID));
+    args("InstanceID", instanceID);
     SoapIncoming data;
     return runAction(args, data);
 }
@@ -440,8 +457,8 @@ int AVTransport::pause(int instanceID)
 int AVTransport::play(int speed, int instanceID)
 {
     SoapOutgoing args(getServiceType(), "Play");
-    args("InstanceID", SoapHelp::i2s(instanceID))
-    ("Speed", SoapHelp::i2s(speed));
+    args("InstanceID", instanceID)
+    ("Speed", speed);
     SoapIncoming data;
     return runAction(args, data);
 }
@@ -482,9 +499,9 @@ int AVTransport::seek(SeekMode mode, int target, int instanceID)
     }
 
     SoapOutgoing args(getServiceType(), "Seek");
-    args("InstanceID", SoapHelp::i2s(instanceID))
+    args("InstanceID", instanceID)
     ("Unit", sm)
-    ("Target", value);
+    ("Target", std::move(value));
     SoapIncoming data;
     return runAction(args, data);
 }
@@ -492,7 +509,7 @@ int AVTransport::seek(SeekMode mode, int target, int instanceID)
 int AVTransport::next(int instanceID)
 {
     SoapOutgoing args(getServiceType(), "Next");
-    args("InstanceID", SoapHelp::i2s(instanceID));
+    args("InstanceID", instanceID);
     SoapIncoming data;
     return runAction(args, data);
 }
@@ -500,7 +517,7 @@ int AVTransport::next(int instanceID)
 int AVTransport::previous(int instanceID)
 {
     SoapOutgoing args(getServiceType(), "Previous");
-    args("InstanceID", SoapHelp::i2s(instanceID));
+    args("InstanceID", instanceID);
     SoapIncoming data;
     return runAction(args, data);
 }
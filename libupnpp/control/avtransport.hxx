@@ -21,6 +21,7 @@
 #include "libupnpp/config.h"
 
 #include <string>
+#include <unordered_map>
 
 #include "libupnpp/control/cdircontent.hxx"  // for UPnPDirObject
 #include "libupnpp/control/service.hxx"  // for Service
@@ -152,6 +153,13 @@ protected:
 private:
     void evtCallback(const std::unordered_map<std::string, std::string>&);
     void registerCallback();
+
+    // The last metadata values sent to m_metareporter, so
+    // that we don't report unchanged values (many renderers repeat
+    // them in every LastChange event). Reset for the initial events
+    // and replays, which always deliver the current values.
+    VarEventReporter *m_metareporter{nullptr};
+    std::unordered_map<std::string, std::string> m_lastmeta;
 };
 
 } // namespace UPnPClient
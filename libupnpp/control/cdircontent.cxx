@@ -19,7 +19,11 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <bitset>
+#include <mutex>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -36,33 +40,250 @@ namespace UPnPClient {
 
 string UPnPDirObject::nullstr;
 
+// Names of the DIDL-Lite elements and attributes we know about. The
+// index in the table is the name id used by the parser, and also the
+// key id in compact storage. Keep sorted in strcmp() order and in sync
+// with the DidlName enum.
+static const char *didlnames[] = {
+    "", // Resource URI key in compact storage
+    "DIDL-Lite",
+    "bitrate",
+    "bitsPerSample",
+    "childCount",
+    "container",
+    "dc:creator",
+    "dc:date",
+    "dc:description",
+    "dc:title",
+    "duration",
+    "id",
+    "item",
+    "nrAudioChannels",
+    "parentID",
+    "protocolInfo",
+    "res",
+    "resolution",
+    "restricted",
+    "role",
+    "sampleFrequency",
+    "searchable",
+    "size",
+    "upnp:album",
+    "upnp:albumArtURI",
+    "upnp:artist",
+    "upnp:class",
+    "upnp:genre",
+    "upnp:originalTrackNumber",
+};
+enum DidlName {
+    DN_URI, DN_DIDL, DN_bitrate, DN_bitsPerSample, DN_childCount,
+    DN_container, DN_dc_creator, DN_dc_date, DN_dc_description, DN_dc_title,
+    DN_duration, DN_id, DN_item, DN_nrAudioChannels, DN_parentID,
+    DN_protocolInfo, DN_res, DN_resolution, DN_restricted, DN_role,
+    DN_sampleFrequency, DN_searchable, DN_size, DN_upnp_album,
+    DN_upnp_albumArtURI, DN_upnp_artist, DN_upnp_class, DN_upnp_genre,
+    DN_upnp_originalTrackNumber,
+    DN_COUNT
+};
+static_assert(sizeof(didlnames) / sizeof(didlnames[0]) == DN_COUNT,
+              "didlnames and DidlName are out of sync");
+
+static bool didlnamecmp(const char *a, const char *b)
+{
+    return strcmp(a, b) < 0;
+}
+
+// Name id for an element or attribute name, -1 if unknown.
+static int didlNameId(const char *nm)
+{
+    auto it = std::lower_bound(std::begin(didlnames), std::end(didlnames),
+                               nm, didlnamecmp);
+    if (it == std::end(didlnames) || strcmp(*it, nm))
+        return -1;
+    return int(it - std::begin(didlnames));
+}
+
+// Set of names wanted by a UPnPDirContent projection. Known names
+// are checked through their id, without string comparisons.
+class DidlNameSet {
+public:
+    DidlNameSet(const vector<string>& names) {
+        for (const auto& nm : names) {
+            int id = didlNameId(nm.c_str());
+            if (id >= 0) {
+                m_known.set(id);
+            } else {
+                m_others.push_back(nm);
+            }
+        }
+    }
+    bool has(int id, const char *nm) const {
+        if (id >= 0)
+            return m_known.test(id);
+        for (const auto& other : m_others) {
+            if (!other.compare(nm))
+                return true;
+        }
+        return false;
+    }
+private:
+    std::bitset<DN_COUNT> m_known;
+    vector<string> m_others;
+};
+
+// Item classes which we recognize. Keep sorted.
+static const struct OkItem {
+    const char *cls;
+    UPnPDirObject::ItemClass iclass;
+} okitems[] = {
+    {"object.item.audioItem", UPnPDirObject::ITC_audioItem},
+    {"object.item.audioItem.audioBook", UPnPDirObject::ITC_audioItem},
+    {"object.item.audioItem.audioBroadcast", UPnPDirObject::ITC_audioItem},
+    {"object.item.audioItem.musicTrack", UPnPDirObject::ITC_audioItem},
+    {"object.item.playlistItem", UPnPDirObject::ITC_playlist},
+    {"object.item.videoItem", UPnPDirObject::ITC_videoItem},
+};
+
+static const OkItem *findOkItem(const string& cls)
+{
+    auto it = std::lower_bound(
+        std::begin(okitems), std::end(okitems), cls.c_str(),
+        [](const OkItem& e, const char *c) {return strcmp(e.cls, c) < 0;});
+    if (it == std::end(okitems) || strcmp(it->cls, cls.c_str()))
+        return nullptr;
+    return it;
+}
+
+// String storage for UPnPDirContent::SM_COMPACT. This is written by
+// the parser only, and the strings never move once stored, so that
+// the objects can keep pointers to them.
+class DIDLArena {
+public:
+    DIDLArena() {
+        // The known names get their table index as key id. Key 0
+        // (empty name) is used for the resource URIs.
+        for (const auto nm : didlnames) {
+            keyid(nm);
+        }
+    }
+    // Intern a property name. Returns -1 if the table is full.
+    int keyid(const string& nm) {
+        auto it = m_keyids.find(nm);
+        if (it != m_keyids.end())
+            return it->second;
+        if (m_keys.size() > 0xffff)
+            return -1;
+        m_keys.push_back(nm);
+        m_keyids[nm] = uint16_t(m_keys.size() - 1);
+        return int(m_keys.size() - 1);
+    }
+    // Look up a property name, -1 if we never saw it.
+    int findkey(const string& nm) const {
+        auto it = m_keyids.find(nm);
+        return it == m_keyids.end() ? -1 : int(it->second);
+    }
+    const string& keyname(uint16_t id) const {
+        return m_keys[id];
+    }
+    // Store a value. Identical values (class, album, artist,
+    // protocolInfo...) are only stored once.
+    const string *value(string&& v) {
+        return &*m_values.insert(std::move(v)).first;
+    }
+
+private:
+    vector<string> m_keys;
+    std::unordered_map<string, uint16_t> m_keyids;
+    std::unordered_set<string> m_values;
+};
+
+const string *UPnPDirObject::cfind(unsigned int res, const string& nm) const
+{
+    int key = m_arena->findkey(nm);
+    if (key < 0)
+        return nullptr;
+    CProp ref{uint16_t(res), uint16_t(key), nullptr};
+    auto it = std::lower_bound(m_cprops.begin(), m_cprops.end(), ref);
+    if (it == m_cprops.end() || it->res != ref.res || it->key != ref.key)
+        return nullptr;
+    return it->value;
+}
+
+string UPnPDirObject::cdump() const
+{
+    std::ostringstream os;
+    os << "UPnPDirObject: " << (m_type == item ? "item" : "container") <<
+       " id [" << m_id << "] pid [" << m_pid <<
+       "] title [" << m_title << "]" << endl;
+    os << "Properties: " << endl;
+    unsigned int res = 0;
+    for (const auto& prop : m_cprops) {
+        if (prop.res != res) {
+            if (res == 0)
+                os << "Resources:" << endl;
+            res = prop.res;
+        }
+        if (res == 0) {
+            os << "[" << m_arena->keyname(prop.key) << "]->[" <<
+                *prop.value << "] " << endl;
+        } else if (prop.key == 0) {
+            os << "  Uri [" << *prop.value << "]" << endl;
+            os << "  Resource attributes:" << endl;
+        } else {
+            os << "    [" << m_arena->keyname(prop.key) << "]->[" <<
+                *prop.value << "] " << endl;
+        }
+    }
+    os << endl;
+    return os.str();
+}
+
 // An XML parser which builds directory contents from DIDL-lite input.
 class UPnPDirParser : public inputRefXMLParser {
 public:
-    UPnPDirParser(UPnPDirContent& dir, const string& input)
-        : inputRefXMLParser(input), m_dir(dir)
+    UPnPDirParser(UPnPDirContent& dir, const string& input,
+                  std::shared_ptr<const string> doc,
+                  std::shared_ptr<DIDLArena> arena)
+        : inputRefXMLParser(input), m_dir(dir), m_doc(doc), m_arena(arena),
+          m_projprops(dir.m_projprops), m_projresattrs(dir.m_projresattrs)
     {
         //LOGDEB("UPnPDirParser: input: " << input << endl);
-        m_okitems["object.item.audioItem"] = UPnPDirObject::ITC_audioItem;
-        m_okitems["object.item.audioItem.musicTrack"] =
-            UPnPDirObject::ITC_audioItem;
-        m_okitems["object.item.audioItem.audioBroadcast"] =
-            UPnPDirObject::ITC_audioItem;
-        m_okitems["object.item.audioItem.audioBook"] =
-            UPnPDirObject::ITC_audioItem;
-        m_okitems["object.item.playlistItem"] = UPnPDirObject::ITC_playlist;
-        m_okitems["object.item.videoItem"] = UPnPDirObject::ITC_videoItem;
     }
     UPnPDirContent& m_dir;
 
+    // Get ready for an incremental parse (UPnPDirContent::parseStart()).
+    // The data will be passed through ParseChunk(), the caller takes
+    // care of accumulating it in doc if needed.
+    bool pushStart(std::shared_ptr<const string> doc,
+                   std::shared_ptr<DIDLArena> arena) {
+        m_doc = doc;
+        m_arena = arena;
+        m_depth = 0;
+        m_tobj.clear();
+        m_multi.clear();
+        m_projprops = DidlNameSet(m_dir.m_projprops);
+        m_projresattrs = DidlNameSet(m_dir.m_projresattrs);
+        return Reset();
+    }
+
 protected:
+    // Element stack entries are reused: m_path only grows, and the
+    // strings keep their buffers from one element to the next.
     class StackEl {
     public:
-        StackEl(const string& nm) : name(nm) {}
-        string name;
+        int id; // didlnames index or -1
+        bool skip; // Not wanted by the projection: ignore contents
         XML_Size sta;
-        std::unordered_map<string,string> attributes;
+        vector<pair<string, string> > attributes;
+        unsigned int nattrs;
         string data;
+        const string& attr(const char *nm) const {
+            for (unsigned int i = 0; i < nattrs; i++) {
+                if (!attributes[i].first.compare(nm))
+                    return attributes[i].second;
+            }
+            return UPnPDirObject::nullstr;
+        }
     };
 
     virtual void StartElement(const XML_Char *name, const XML_Char **attrs)
@@ -70,30 +291,40 @@ protected:
         //LOGDEB("startElement: name [" << name << "]" << " bpos " <<
         //             XML_GetCurrentByteIndex(expat_parser) << endl);
 
-        m_path.push_back(StackEl(name));
-        m_path.back().sta = XML_GetCurrentByteIndex(expat_parser);
-        auto& mapattrs = m_path.back().attributes;
-        mapattrs.clear();
-        for (int i = 0; attrs[i] != 0; i += 2) {
-            mapattrs[attrs[i]] = attrs[i+1];
+        if (m_depth == m_path.size()) {
+            m_path.push_back(StackEl());
         }
-
-        switch (name[0]) {
-        case 'c':
-            if (!strcmp(name, "container")) {
-                m_tobj.clear();
-                m_tobj.m_type = UPnPDirObject::container;
-                m_tobj.m_id = mapattrs["id"];
-                m_tobj.m_pid = mapattrs["parentID"];
+        StackEl& el = m_path[m_depth++];
+        el.id = didlNameId(name);
+        el.sta = XML_GetCurrentByteIndex(expat_parser);
+        el.data.clear();
+        el.nattrs = 0;
+        el.skip = m_dir.m_projection && projskip(el, name);
+        if (el.skip)
+            return;
+        for (int i = 0; attrs[i] != 0; i += 2) {
+            if (m_dir.m_projection && el.id == DN_res &&
+                !m_projresattrs.has(didlNameId(attrs[i]), attrs[i])) {
+                continue;
             }
-            break;
-        case 'i':
-            if (!strcmp(name, "item")) {
-                m_tobj.clear();
-                m_tobj.m_type = UPnPDirObject::item;
-                m_tobj.m_id = mapattrs["id"];
-                m_tobj.m_pid = mapattrs["parentID"];
+            if (el.nattrs == el.attributes.size()) {
+                el.attributes.push_back(pair<string, string>());
             }
+            el.attributes[el.nattrs].first.assign(attrs[i]);
+            el.attributes[el.nattrs].second.assign(attrs[i+1]);
+            el.nattrs++;
+        }
+
+        switch (el.id) {
+        case DN_container:
+        case DN_item:
+            m_tobj.clear();
+            m_multi.clear();
+            m_tobj.m_arena = m_arena;
+            m_tobj.m_type = el.id == DN_item ? UPnPDirObject::item :
+                UPnPDirObject::container;
+            m_tobj.m_id = el.attr("id");
+            m_tobj.m_pid = el.attr("parentID");
             break;
         default:
             break;
@@ -109,24 +340,23 @@ protected:
                            !m_tobj.m_title.empty();*/
 
         if (ok && m_tobj.m_type == UPnPDirObject::item) {
-            map<string, UPnPDirObject::ItemClass>::const_iterator it;
-            it = m_okitems.find(m_tobj.m_props["upnp:class"]);
-            if (it == m_okitems.end()) {
+            const OkItem *okitem = findOkItem(m_tobj.getprop("upnp:class"));
+            if (nullptr == okitem) {
                 // Only log this if the record comes from an MS as e.g. naims
                 // send records with empty classes (and empty id/pid)
                 if (!m_tobj.m_id.empty()) {
                     LOGINF("checkobjok: found object of unknown class: [" <<
-                           m_tobj.m_props["upnp:class"] << "]" << endl);
+                           m_tobj.getprop("upnp:class") << "]" << endl);
                 }
                 m_tobj.m_iclass = UPnPDirObject::ITC_unknown;
             } else {
-                m_tobj.m_iclass = it->second;
+                m_tobj.m_iclass = okitem->iclass;
             }
         }
 
         if (!ok) {
             LOGINF("checkobjok:skip: id ["<< m_tobj.m_id<<"] pid ["<<
-                   m_tobj.m_pid << "] clss [" << m_tobj.m_props["upnp:class"]
+                   m_tobj.m_pid << "] clss [" << m_tobj.getprop("upnp:class")
                    << "] tt [" << m_tobj.m_title << "]" << endl);
         }
         return ok;
@@ -134,83 +364,182 @@ protected:
 
     virtual void EndElement(const XML_Char *name)
     {
-        string parentname;
-        if (m_path.size() == 1) {
-            parentname = "root";
-        } else {
-            parentname = m_path[m_path.size()-2].name;
-        }
+        StackEl& el = m_path[m_depth-1];
+        int parentid = m_depth > 1 ? m_path[m_depth-2].id : -1;
         //LOGDEB("Closing element " << name << " inside element " <<
-        //       parentname << " data " << m_path.back().data << endl);
-        if (!strcmp(name, "container")) {
+        //       parentid << " data " << el.data << endl);
+        if (el.skip) {
+            m_depth--;
+            return;
+        }
+        switch (el.id) {
+        case DN_container:
+            cmultidone();
+            std::sort(m_tobj.m_cprops.begin(), m_tobj.m_cprops.end());
             if (checkobjok()) {
-                m_dir.m_containers.push_back(m_tobj);
+                emit(m_dir.m_containers);
             }
-        } else if (!strcmp(name, "item")) {
+            break;
+        case DN_item:
+            cmultidone();
+            std::sort(m_tobj.m_cprops.begin(), m_tobj.m_cprops.end());
             if (checkobjok()) {
-                unsigned int len = XML_GetCurrentByteIndex(expat_parser) -
-                                   m_path.back().sta;
-                m_tobj.m_didlfrag = m_input.substr(m_path.back().sta, len)
-                                    + "</item></DIDL-Lite>";
-                m_dir.m_items.push_back(m_tobj);
-            }
-        } else if (!parentname.compare("item") ||
-                   !parentname.compare("container")) {
-            switch (name[0]) {
-            case 'd':
-                if (!strcmp(name, "dc:title")) {
-                    m_tobj.m_title = m_path.back().data;
-                } else {
-                    addprop(name, m_path.back().data);
+                if (m_doc) {
+                    m_tobj.m_frag.doc = m_doc;
+                    m_tobj.m_frag.offs = el.sta;
+                    m_tobj.m_frag.len = XML_GetCurrentByteIndex(expat_parser) -
+                        el.sta;
                 }
+                emit(m_dir.m_items);
+            }
+            break;
+        default:
+            if (parentid != DN_item && parentid != DN_container)
                 break;
-            case 'r':
-                if (!strcmp(name, "res")) {
-                    // <res protocolInfo="http-get:*:audio/mpeg:*" size="517149"
-                    // bitrate="24576" duration="00:03:35"
-                    // sampleFrequency="44100" nrAudioChannels="2">
-                    UPnPResource res;
-                    res.m_uri = m_path.back().data;
-                    for (auto it : m_path.back().attributes) {
-                        res.m_props[it.first] = it.second;
+            if (el.id == DN_dc_title) {
+                m_tobj.m_title = el.data;
+            } else if (el.id == DN_res) {
+                // <res protocolInfo="http-get:*:audio/mpeg:*" size="517149"
+                // bitrate="24576" duration="00:03:35"
+                // sampleFrequency="44100" nrAudioChannels="2">
+                if (m_arena) {
+                    unsigned int res = ++m_tobj.m_cnres;
+                    caddprop(res, DN_URI, "", el.data);
+                    for (unsigned int i = 0; i < el.nattrs; i++) {
+                        const string& anm = el.attributes[i].first;
+                        caddprop(res, didlNameId(anm.c_str()), anm,
+                                 el.attributes[i].second);
                     }
-                    m_tobj.m_resources.push_back(res);
-                } else {
-                    addprop(name, m_path.back().data);
+                    break;
                 }
-                break;
-            default:
-                addprop(name, m_path.back().data);
-                break;
+                UPnPResource res;
+                res.m_uri = el.data;
+                for (unsigned int i = 0; i < el.nattrs; i++) {
+                    res.m_props[el.attributes[i].first] =
+                        el.attributes[i].second;
+                }
+                m_tobj.m_resources.push_back(std::move(res));
+            } else {
+                addprop(el, name);
             }
+            break;
         }
 
-        m_path.pop_back();
+        m_depth--;
     }
 
     virtual void CharacterData(const XML_Char *s, int len)
     {
-        if (s == 0 || *s == 0)
+        if (s == 0 || *s == 0 || m_path[m_depth-1].skip)
             return;
-        string str(s, len);
-        m_path.back().data += str;
+        m_path[m_depth-1].data.append(s, len);
     }
 
 private:
+    // Check if the projection excludes the element just pushed.
+    bool projskip(const StackEl& el, const char *nm) {
+        if (m_depth < 2)
+            return false;
+        const StackEl& parent = m_path[m_depth-2];
+        if (parent.skip)
+            return true;
+        if (parent.id != DN_item && parent.id != DN_container)
+            return false;
+        switch (el.id) {
+        case DN_dc_title:
+        case DN_upnp_class:
+            return false;
+        case DN_res:
+            return m_dir.m_projmaxres &&
+                m_tobj.resourceCount() >= m_dir.m_projmaxres;
+        default:
+            return !m_projprops.has(el.id, nm);
+        }
+    }
+
+    // Hand a completed object to the visitor and/or store it.
+    void emit(vector<UPnPDirObject>& vec) {
+        if (m_dir.m_stopped)
+            return;
+        if (m_dir.m_visitor && !m_dir.m_visitor(m_tobj)) {
+            m_dir.m_stopped = true;
+            XML_StopParser(expat_parser, XML_FALSE);
+        }
+        if (!m_dir.m_visitor || m_dir.m_visitstore) {
+            vec.push_back(std::move(m_tobj));
+        }
+    }
+
     vector<StackEl> m_path;
+    unsigned int m_depth{0};
     UPnPDirObject m_tobj;
-    map<string, UPnPDirObject::ItemClass> m_okitems;
+    // SM_COMPACT: multiple values for a property of m_tobj, by
+    // m_cprops index
+    vector<pair<unsigned int, string> > m_multi;
+    // Shared copy of m_input if we keep the fragments, else null
+    std::shared_ptr<const string> m_doc;
+    std::shared_ptr<DIDLArena> m_arena;
+    DidlNameSet m_projprops;
+    DidlNameSet m_projresattrs;
 
-    void addprop(const string& nm, const string& data) {
+    // Add compact property, the caller takes care of duplicates. id
+    // is the didlnames index if known, which is also the arena key.
+    UPnPDirObject::CProp *caddprop(unsigned int res, int id, const string& nm,
+                                   string value) {
+        int key = id >= 0 ? id : m_arena->keyid(nm);
+        if (key < 0 || res > 0xffff)
+            return nullptr;
+        m_tobj.m_cprops.push_back(
+            UPnPDirObject::CProp{uint16_t(res), uint16_t(key),
+                    m_arena->value(std::move(value))});
+        return &m_tobj.m_cprops.back();
+    }
+
+    // Store the accumulated multiple values. Must be called before
+    // sorting the properties.
+    void cmultidone() {
+        for (auto& ent : m_multi) {
+            m_tobj.m_cprops[ent.first].value =
+                m_arena->value(std::move(ent.second));
+        }
+        m_multi.clear();
+    }
+
+    void addprop(const StackEl& el, const char *nm) {
+        const string& data = el.data;
         // e.g <upnp:artist role="AlbumArtist">Jojo</upnp:artist>
-        auto& mapattrs = m_path.back().attributes;
-        auto roleit = mapattrs.find("role");
+        const string& role = el.attr("role");
         string rolevalue;
-        if (roleit != mapattrs.end()) {
-            if (roleit->second.compare("AlbumArtist")) {
-                // AlbumArtist is not useful for the user
-                rolevalue = string(" (") + roleit->second + string(")");
+        if (!role.empty() && role.compare("AlbumArtist")) {
+            // AlbumArtist is not useful for the user
+            rolevalue = string(" (") + role + string(")");
+        }
+        if (m_arena) {
+            int key = el.id >= 0 ? el.id : m_arena->keyid(nm);
+            for (unsigned int i = 0; i < m_tobj.m_cprops.size(); i++) {
+                const UPnPDirObject::CProp& prop = m_tobj.m_cprops[i];
+                if (prop.res == 0 && prop.key == key) {
+                    // Multiple values: accumulate them here, the
+                    // result goes to the arena when the object is
+                    // complete (see cmultidone()).
+                    auto mit = std::find_if(
+                        m_multi.begin(), m_multi.end(),
+                        [i] (const pair<unsigned int, string>& ent) {
+                            return ent.first == i;});
+                    const string& current = mit == m_multi.end() ?
+                        *prop.value : mit->second;
+                    if (current.compare(data)) {
+                        if (mit == m_multi.end()) {
+                            m_multi.push_back(make_pair(i, *prop.value));
+                            mit = m_multi.end() - 1;
+                        }
+                        mit->second += ", " + data + rolevalue;
+                    }
+                    return;
+                }
             }
+            caddprop(0, key, nm, data + rolevalue);
+            return;
         }
         auto it = m_tobj.m_props.find(nm);
         if (it == m_tobj.m_props.end()) {
@@ -227,10 +556,37 @@ private:
     }
 };
 
+// Common code for parse() and parseStart(). Each parse gets a new
+// arena: the objects from the previous ones keep theirs, which is not
+// modified any more, and can be read from other threads.
+static void prepareArena(UPnPDirContent::StorageMode mode,
+                         std::shared_ptr<DIDLArena>& arena)
+{
+    if (mode == UPnPDirContent::SM_COMPACT) {
+        arena = std::make_shared<DIDLArena>();
+    } else {
+        arena.reset();
+    }
+}
+
 bool UPnPDirContent::parse(const std::string& input)
 {
-    UPnPDirParser parser(*this, input);
+    if (m_stopped) {
+        return true;
+    }
+    prepareArena(m_mode, m_arena);
+    // If we keep the fragments, make one shared copy of the document
+    // and parse from it, the items will point into it.
+    std::shared_ptr<const string> doc;
+    if (m_keepdidl) {
+        doc = std::make_shared<const string>(input);
+    }
+    UPnPDirParser parser(*this, doc ? *doc : input, doc, m_arena);
     bool ret = parser.Parse();
+    if (ret == false && m_stopped) {
+        // Stopped by the visitor
+        return true;
+    }
     if (ret == false) {
         LOGERR("UPnPDirContent::parse: parser failed: " <<
                parser.getLastErrorMessage() << " for:\n" << input << endl);
@@ -238,6 +594,130 @@ bool UPnPDirContent::parse(const std::string& input)
     return ret;
 }
 
+bool UPnPDirContent::parse(const std::string& input, Visitor visitor)
+{
+    UPnPDirContent tmp(m_mode);
+    tmp.setKeepDidl(m_keepdidl);
+    if (m_projection) {
+        tmp.setProjection(m_projprops, m_projresattrs, m_projmaxres);
+    }
+    tmp.setVisitor(visitor, false);
+    return tmp.parse(input);
+}
+
+bool UPnPDirContent::parseStart()
+{
+    if (m_stopped) {
+        return true;
+    }
+    prepareArena(m_mode, m_arena);
+    // The items will point into the document as it grows. Use a new
+    // one each time, the previous one may still be referenced.
+    m_pdoc.reset();
+    if (m_keepdidl) {
+        m_pdoc = std::make_shared<string>();
+    }
+    // Don't reuse a parser which came with a copy of another content.
+    if (!m_pparser || &m_pparser->m_dir != this) {
+        // The input reference is only used by Parse(), not by the
+        // incremental interface
+        static const string noinput;
+        m_pparser = std::make_shared<UPnPDirParser>(
+            *this, noinput, nullptr, nullptr);
+    }
+    if (!m_pparser->pushStart(m_pdoc, m_arena)) {
+        LOGERR("UPnPDirContent::parseStart: parser reset failed" << endl);
+        m_pparser.reset();
+        return false;
+    }
+    return true;
+}
+
+bool UPnPDirContent::parseData(const char *data, size_t len)
+{
+    if (m_stopped) {
+        return true;
+    }
+    if (!m_pparser) {
+        return false;
+    }
+    if (m_pdoc) {
+        m_pdoc->append(data, len);
+    }
+    if (!m_pparser->ParseChunk(data, len, false)) {
+        if (m_stopped)
+            return true;
+        LOGERR("UPnPDirContent::parseData: parser failed: " <<
+               m_pparser->getLastErrorMessage() << endl);
+        m_pparser.reset();
+        return false;
+    }
+    return true;
+}
+
+bool UPnPDirContent::parseEnd()
+{
+    if (m_stopped) {
+        return true;
+    }
+    if (!m_pparser) {
+        return false;
+    }
+    bool ret = m_pparser->ParseChunk("", 0, true);
+    if (!ret && !m_stopped) {
+        LOGERR("UPnPDirContent::parseEnd: parser failed: " <<
+               m_pparser->getLastErrorMessage() << endl);
+        m_pparser.reset();
+        return false;
+    }
+    m_pdoc.reset();
+    return true;
+}
+
+class UPnPDirMeta::Internal {
+public:
+    string didl;
+    std::once_flag once;
+    UPnPDirObject item;
+    bool ok{false};
+
+    void parse() {
+        UPnPDirContent meta;
+        if (!meta.parse(didl)) {
+            LOGERR("UPnPDirMeta: bad metadata: [" << didl << "]" << endl);
+        } else if (!meta.m_items.empty()) {
+            item = std::move(meta.m_items[0]);
+            ok = true;
+        }
+    }
+};
+
+UPnPDirMeta::UPnPDirMeta(const std::string& didltext)
+    : m(std::make_shared<Internal>())
+{
+    m->didl = didltext;
+}
+
+const string& UPnPDirMeta::didl() const
+{
+    static const string empty;
+    return m ? m->didl : empty;
+}
+
+bool UPnPDirMeta::ok() const
+{
+    if (!m)
+        return false;
+    std::call_once(m->once, &Internal::parse, m.get());
+    return m->ok;
+}
+
+const UPnPDirObject& UPnPDirMeta::item() const
+{
+    static const UPnPDirObject empty = UPnPDirObject();
+    return ok() ? m->item : empty;
+}
+
 static const string didl_header(
     "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
     "<DIDL-Lite xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\""
@@ -245,11 +725,213 @@ static const string didl_header(
     " xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\""
     " xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\">");
 
-// Maybe we'll do something about building didl from scratch if this
-// proves necessary.
+// UPnPDirWriter builds didl from scratch if needed.
 string UPnPDirObject::getdidl() const
 {
-    return didl_header + m_didlfrag;
+    // Without the source text there is nothing to send: an empty
+    // string is better than an unterminated document.
+    if (!m_frag.doc)
+        return string();
+    string out(didl_header);
+    out.append(*m_frag.doc, m_frag.offs, m_frag.len);
+    out.append("</item></DIDL-Lite>");
+    return out;
+}
+
+static const string didl_trailer("</DIDL-Lite>");
+
+// Output targets for UPnPDirWriter::serialize(). The first pass uses
+// SizeSink to compute the exact size, so that the buffer can be
+// allocated once.
+static inline int xmlEscapeExtra(char c)
+{
+    switch (c) {
+    case '"': return 5; // &quot;
+    case '&': return 4; // &amp;
+    case '<': return 3; // &lt;
+    case '>': return 3; // &gt;
+    case '\'': return 5; // &apos;
+    default: return 0;
+    }
+}
+
+class SizeSink {
+public:
+    size_t size{0};
+    void put(const char *s) {
+        size += strlen(s);
+    }
+    void put(const string& s) {
+        size += s.size();
+    }
+    void esc(const string& s) {
+        size += s.size();
+        for (auto c : s) {
+            size += xmlEscapeExtra(c);
+        }
+    }
+};
+
+class StringSink {
+public:
+    StringSink(string& o) : out(o) {}
+    string& out;
+    void put(const char *s) {
+        out.append(s);
+    }
+    void put(const string& s) {
+        out.append(s);
+    }
+    // Same escaping as SoapHelp::xmlQuote, but appending to the
+    // output in runs instead of char by char.
+    void esc(const string& s) {
+        const char *cp = s.c_str();
+        const char *run = cp;
+        const char *end = cp + s.size();
+        for (; cp < end; cp++) {
+            const char *ent;
+            switch (*cp) {
+            case '"': ent = "&quot;"; break;
+            case '&': ent = "&amp;"; break;
+            case '<': ent = "&lt;"; break;
+            case '>': ent = "&gt;"; break;
+            case '\'': ent = "&apos;"; break;
+            default: continue;
+            }
+            out.append(run, cp - run);
+            out.append(ent);
+            run = cp + 1;
+        }
+        out.append(run, end - run);
+    }
+};
+
+template <class Sink>
+static void putElement(Sink& sink, const string& name, const string& value)
+{
+    sink.put("<");
+    sink.put(name);
+    sink.put(">");
+    sink.esc(value);
+    sink.put("</");
+    sink.put(name);
+    sink.put(">");
+}
+
+template <class Sink>
+static void putAttribute(Sink& sink, const string& name, const string& value)
+{
+    sink.put(" ");
+    sink.put(name);
+    sink.put("=\"");
+    sink.esc(value);
+    sink.put("\"");
+}
+
+template <class Sink>
+void UPnPDirWriter::serialize(Sink& sink, const UPnPDirObject& obj)
+{
+    const char *tag = obj.m_type == UPnPDirObject::container ?
+        "container" : "item";
+    sink.put("<");
+    sink.put(tag);
+    putAttribute(sink, "id", obj.m_id);
+    putAttribute(sink, "parentID", obj.m_pid);
+    sink.put(" restricted=\"1\">");
+    putElement(sink, "dc:title", obj.m_title);
+    if (obj.m_arena) {
+        // Sorted on (res, key): object properties first, then each
+        // resource, starting with its URI (empty key).
+        const auto& props = obj.m_cprops;
+        for (auto it = props.begin(); it != props.end();) {
+            if (it->res == 0) {
+                putElement(sink, obj.m_arena->keyname(it->key), *it->value);
+                ++it;
+                continue;
+            }
+            unsigned int res = it->res;
+            const string *uri = &UPnPDirObject::nullstr;
+            sink.put("<res");
+            for (; it != props.end() && it->res == res; ++it) {
+                if (it->key == 0) {
+                    uri = it->value;
+                } else {
+                    putAttribute(sink, obj.m_arena->keyname(it->key),
+                                 *it->value);
+                }
+            }
+            sink.put(">");
+            sink.esc(*uri);
+            sink.put("</res>");
+        }
+    } else {
+        for (const auto& prop : obj.m_props) {
+            putElement(sink, prop.first, prop.second);
+        }
+        for (const auto& res : obj.m_resources) {
+            sink.put("<res");
+            for (const auto& attr : res.m_props) {
+                putAttribute(sink, attr.first, attr.second);
+            }
+            sink.put(">");
+            sink.esc(res.m_uri);
+            sink.put("</res>");
+        }
+    }
+    sink.put("</");
+    sink.put(tag);
+    sink.put(">");
+}
+
+void UPnPDirWriter::start(size_t reserve)
+{
+    m_out.reserve(m_out.size() + didl_header.size() + reserve +
+                  didl_trailer.size());
+    m_out.append(didl_header);
+}
+
+void UPnPDirWriter::add(const UPnPDirObject& obj)
+{
+    StringSink sink(m_out);
+    serialize(sink, obj);
+}
+
+void UPnPDirWriter::finish()
+{
+    m_out.append(didl_trailer);
+}
+
+size_t UPnPDirWriter::objectSize(const UPnPDirObject& obj)
+{
+    SizeSink sink;
+    serialize(sink, obj);
+    return sink.size;
+}
+
+string UPnPDirWriter::didl(const vector<UPnPDirObject>& objs)
+{
+    size_t size = 0;
+    for (const auto& obj : objs) {
+        size += objectSize(obj);
+    }
+    string out;
+    UPnPDirWriter writer(out);
+    writer.start(size);
+    for (const auto& obj : objs) {
+        writer.add(obj);
+    }
+    writer.finish();
+    return out;
+}
+
+string UPnPDirWriter::didl(const UPnPDirObject& obj)
+{
+    string out;
+    UPnPDirWriter writer(out);
+    writer.start(objectSize(obj));
+    writer.add(obj);
+    writer.finish();
+    return out;
 }
 
 } // namespace
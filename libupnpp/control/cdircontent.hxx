@@ -18,7 +18,11 @@
 #ifndef _UPNPDIRCONTENT_H_X_INCLUDED_
 #define _UPNPDIRCONTENT_H_X_INCLUDED_
 
+#include <stdint.h>
+
+#include <functional>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <utility>
@@ -54,10 +58,20 @@ public:
 };
 
 
+// Shared string storage for UPnPDirContent::SM_COMPACT. Internal.
+class DIDLArena;
+class UPnPDirParser;
+class UPnPDirWriter;
+
 /**
  * UPnP Media Server directory entry, converted from XML data.
  *
  * This is a dumb data holder class, a struct with helpers.
+ *
+ * When the object was produced by a UPnPDirContent in SM_COMPACT
+ * mode, m_props and m_resources are empty, and the properties are
+ * only reachable through the accessor methods (getprop(), getrprop(),
+ * resourceCount(), getresuri(), etc.), which work in both modes.
  */
 class UPnPDirObject {
 public:
@@ -108,6 +122,13 @@ public:
      */
     bool getprop(const std::string& name, std::string& value) const
     {
+        if (m_arena) {
+            const std::string *cp = cfind(0, name);
+            if (nullptr == cp)
+                return false;
+            value = *cp;
+            return true;
+        }
         std::map<std::string, std::string>::const_iterator it =
             m_props.find(name);
         if (it == m_props.end())
@@ -122,6 +143,10 @@ public:
      */
     const std::string& getprop(const std::string& name) const
     {
+        if (m_arena) {
+            const std::string *cp = cfind(0, name);
+            return cp ? *cp : nullstr;
+        }
         std::map<std::string, std::string>::const_iterator it =
             m_props.find(name);
         if (it == m_props.end())
@@ -140,6 +165,14 @@ public:
     bool getrprop(unsigned int ridx, const std::string& nm, std::string& val)
     const
     {
+        if (m_arena) {
+            const std::string *cp =
+                ridx < m_cnres ? cfind(ridx+1, nm) : nullptr;
+            if (nullptr == cp)
+                return false;
+            val = *cp;
+            return true;
+        }
         if (ridx >= m_resources.size())
             return false;
         std::map<std::string, std::string>::const_iterator it =
@@ -151,6 +184,23 @@ public:
 
     }
 
+    /** Number of resources */
+    unsigned int resourceCount() const
+    {
+        return m_arena ? m_cnres : (unsigned int)m_resources.size();
+    }
+
+    /** URI for the resource at index ridx, or empty string */
+    const std::string& getresuri(unsigned int ridx) const
+    {
+        if (m_arena) {
+            const std::string *cp =
+                ridx < m_cnres ? cfind(ridx+1, "") : nullptr;
+            return cp ? *cp : nullstr;
+        }
+        return ridx < m_resources.size() ? m_resources[ridx].m_uri : nullstr;
+    }
+
     /** Simplified interface to retrieving values: we don't distinguish
      * between non-existing and empty, and we only use the first ressource
      */
@@ -182,6 +232,13 @@ public:
      * works for items, not containers. The idea is that we may have
      * missed useful stuff while parsing the data from the content
      * directory, so we send the original if we can.
+     *
+     * The item text is not copied when parsing: the object keeps a
+     * reference to the input document, and the result is built on
+     * each call. Note that the whole document (e.g. a complete Browse
+     * slice) stays in memory as long as any object parsed from it is
+     * kept. If the content had fragment retention disabled
+     * (UPnPDirContent::setKeepDidl()), an empty string is returned.
      */
     std::string getdidl() const;
 
@@ -194,11 +251,16 @@ public:
         m_iclass = (ItemClass)-1;
         m_props.clear();
         m_resources.clear();
-        m_didlfrag.clear();
+        m_frag = DidlFrag();
+        m_arena.reset();
+        m_cprops.clear();
+        m_cnres = 0;
     }
 
     std::string dump() const
     {
+        if (m_arena)
+            return cdump();
         std::ostringstream os;
         os << "UPnPDirObject: " << (m_type == item ? "item" : "container") <<
            " id [" << m_id << "] pid [" << m_pid <<
@@ -228,9 +290,36 @@ public:
 
 private:
     friend class UPnPDirParser;
-    // didl text for element, sans header
-    std::string m_didlfrag;
+    friend class UPnPDirWriter;
+    // didl text for element, sans header: offset/length inside the
+    // shared copy of the input document.
+    struct DidlFrag {
+        std::shared_ptr<const std::string> doc;
+        size_t offs{0};
+        size_t len{0};
+    };
+    DidlFrag m_frag;
     static std::string nullstr;
+
+    // Compact storage. Values point into the arena, which is shared
+    // with the UPnPDirContent and any copy of this object. The
+    // properties are sorted on (res, key). res is 0 for object
+    // properties, and ridx+1 for the attributes of resource ridx. The
+    // resource URI is stored under the empty key.
+    struct CProp {
+        uint16_t res;
+        uint16_t key;
+        const std::string *value;
+        bool operator<(const CProp& o) const {
+            return res < o.res || (res == o.res && key < o.key);
+        }
+    };
+    std::shared_ptr<DIDLArena> m_arena;
+    std::vector<CProp> m_cprops;
+    unsigned int m_cnres{0};
+
+    const std::string *cfind(unsigned int res, const std::string& nm) const;
+    std::string cdump() const;
 };
 
 /**
@@ -239,6 +328,27 @@ private:
  */
 class UPnPDirContent {
 public:
+    /**
+     * Storage for the parsed objects.
+     *
+     * SM_MAPS (default): each object owns its strings, in the public
+     *   m_props and m_resources maps.
+     * SM_COMPACT: the property and resource values are kept, with
+     *   duplicates merged, in an arena shared by all the objects
+     *   from a parse() call, and the objects only hold a small
+     *   sorted vector of pointers. This uses much less memory and
+     *   far fewer allocations for big containers, but the values are
+     *   only accessible through the UPnPDirObject methods. Objects
+     *   copied out keep the arena alive. Each parse() call uses a
+     *   new arena, which is not modified after the call returns: the
+     *   objects can then be read from other threads while this
+     *   content goes on parsing.
+     */
+    enum StorageMode {SM_MAPS, SM_COMPACT};
+
+    UPnPDirContent(StorageMode mode = SM_MAPS)
+        : m_mode(mode) {}
+
     std::vector<UPnPDirObject> m_containers;
     std::vector<UPnPDirObject> m_items;
 
@@ -246,6 +356,86 @@ public:
     {
         m_containers.clear();
         m_items.clear();
+        m_arena.reset();
+    }
+
+    StorageMode storageMode() const {
+        return m_mode;
+    }
+
+    /**
+     * Function called by parse() for each object (item or container),
+     * as soon as its closing tag is seen. Return false to stop the
+     * parse. The object may be moved from if it is not also stored.
+     */
+    typedef std::function<bool (UPnPDirObject&)> Visitor;
+
+    /**
+     * Set a visitor for the following parse() calls. This also applies
+     * to the ContentDirectory methods which fill a UPnPDirContent
+     * (readDir(), search(), etc.), which will stop reading slices
+     * if the visitor returns false.
+     *
+     * @param visitor the function to call, or an empty one to
+     *    return to normal operation.
+     * @param store also store the objects in m_items/m_containers.
+     *    If this is false, in SM_COMPACT mode, the memory used by a
+     *    parse() call is released when the objects kept by the
+     *    visitor are gone.
+     */
+    void setVisitor(Visitor visitor, bool store = false)
+    {
+        m_visitor = visitor;
+        m_visitstore = store;
+        m_stopped = false;
+    }
+
+    /**
+     * Keep a reference to the input text for UPnPDirObject::getdidl()
+     * (the default). Turning this off saves keeping the documents in
+     * memory as long as the objects when getdidl() will not be needed
+     * (read-only browsing). With retention on, a single object kept
+     * from a parse holds the complete input document.
+     */
+    void setKeepDidl(bool onoff)
+    {
+        m_keepdidl = onoff;
+    }
+
+    /**
+     * Only extract some of the data in the following parse() calls.
+     * The other elements and attributes are skipped while parsing,
+     * without copying their text. The object id, parent id, title and
+     * upnp:class are always extracted, as are the resource URIs.
+     *
+     * @param props the wanted properties (e.g. "upnp:artist").
+     * @param resattrs the wanted resource attributes
+     *   (e.g. "protocolInfo", "duration").
+     * @param maxres maximum number of resources kept per object.
+     *   0 for no limit.
+     */
+    void setProjection(const std::vector<std::string>& props,
+                       const std::vector<std::string>& resattrs =
+                       std::vector<std::string>(),
+                       unsigned int maxres = 0)
+    {
+        m_projection = true;
+        m_projprops = props;
+        m_projresattrs = resattrs;
+        m_projmaxres = maxres;
+    }
+    /** Go back to extracting all data */
+    void clearProjection()
+    {
+        m_projection = false;
+        m_projprops.clear();
+        m_projresattrs.clear();
+        m_projmaxres = 0;
+    }
+
+    /** True if the visitor asked to stop. Reset by setVisitor() */
+    bool stopped() const {
+        return m_stopped;
     }
 
     /**
@@ -262,6 +452,118 @@ public:
      * up...
      */
     bool parse(const std::string& didltext);
+
+    /**
+     * Parse, calling visitor for each object and storing nothing.
+     * This is independant of a visitor set with setVisitor().
+     * @return false for a parse error, true if the parse completed or
+     *     was stopped by the visitor.
+     */
+    bool parse(const std::string& didltext, Visitor visitor);
+
+    /**
+     * Incremental parse, for DIDL text which arrives in pieces, for
+     * example unescaped from an enclosing XML document. Call
+     * parseStart(), then parseData() with each piece in order, then
+     * parseEnd(). The result is the same as parse() on the
+     * concatenated text, but objects are passed to the visitor as soon
+     * as they are complete, and the underlying XML parser is reused
+     * for successive documents.
+     * @return false for a parse error (further parseData() calls
+     *    will fail until the next parseStart()).
+     */
+    bool parseStart();
+    bool parseData(const char *data, size_t len);
+    bool parseEnd();
+
+private:
+    friend class UPnPDirParser;
+    StorageMode m_mode;
+    std::shared_ptr<DIDLArena> m_arena;
+    // Reusable parser for the incremental interface.
+    std::shared_ptr<UPnPDirParser> m_pparser;
+    std::shared_ptr<std::string> m_pdoc;
+    Visitor m_visitor;
+    bool m_visitstore{false};
+    bool m_stopped{false};
+    bool m_keepdidl{true};
+    bool m_projection{false};
+    std::vector<std::string> m_projprops;
+    std::vector<std::string> m_projresattrs;
+    unsigned int m_projmaxres{0};
+};
+
+/**
+ * DIDL-Lite serializer, for building metadata from UPnPDirObject
+ * data (e.g. for setAVTransportURI or OpenHome Insert, or a Browse
+ * response).
+ *
+ * The output is escaped and appended directly to the caller's
+ * buffer. Use start() with a size hint (see objectSize()) to get a
+ * single allocation for the document. Works for objects in any
+ * storage mode. The object and resource properties are written back
+ * as elements and attributes, and multiple values (e.g. several
+ * artists) come out as the single comma-separated value stored by
+ * the parser.
+ *
+ * Example:
+ *    std::string out;
+ *    UPnPDirWriter w(out);
+ *    w.start();
+ *    for (const auto& obj : objs) w.add(obj);
+ *    w.finish();
+ */
+class UPnPDirWriter {
+public:
+    UPnPDirWriter(std::string& out)
+        : m_out(out) {}
+
+    /** Write the document header
+     * @param reserve space to reserve in the buffer for the following
+     *   data, in addition to the header and trailer.
+     */
+    void start(size_t reserve = 0);
+    /** Write one item or container */
+    void add(const UPnPDirObject& obj);
+    /** Close the document */
+    void finish();
+
+    /** Exact size of the add(obj) output */
+    static size_t objectSize(const UPnPDirObject& obj);
+
+    /** Build a complete document, with one allocation */
+    static std::string didl(const std::vector<UPnPDirObject>& objs);
+    static std::string didl(const UPnPDirObject& obj);
+
+private:
+    std::string& m_out;
+    template <class Sink> static void serialize(Sink&, const UPnPDirObject&);
+};
+
+/**
+ * Lazily decoded DIDL-Lite metadata, as found in events
+ * (e.g. AVTransport CurrentTrackMetaData).
+ *
+ * The raw text is kept and only parsed on the first call to item()
+ * (or ok()). Copies are cheap and share the parse result. The object
+ * can be used from multiple threads.
+ */
+class UPnPDirMeta {
+public:
+    UPnPDirMeta() {}
+    explicit UPnPDirMeta(const std::string& didltext);
+
+    /** The raw DIDL-Lite text */
+    const std::string& didl() const;
+    /** Parse if not already done, and check that we got an item */
+    bool ok() const;
+    /** The first item. Parses the data if needed. Returns an empty
+     *  object if the parse failed or found no item. */
+    const UPnPDirObject& item() const;
+
+private:
+    class Internal;
+    std::shared_ptr<Internal> m;
 };
 
 } // namespace
@@ -24,10 +24,18 @@
 #include <upnp/upnp.h>
 #include <upnp/upnptools.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <iostream>
+#include <list>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "libupnpp/control/cdircontent.hxx"
@@ -59,32 +67,414 @@ bool ContentDirectory::serviceTypeMatch(const std::string& tp)
     return isCDService(tp);
 }
 
+// SystemUpdateID is reported as an int, the update and transfer id
+// lists as strings. Unknown variables are logged, then passed as
+// strings.
+enum CDEvtKind {CDEVT_UNKNOWN, CDEVT_INT, CDEVT_STRING};
+
+static CDEvtKind cdEvtKind(const string& nm)
+{
+    static const std::unordered_map<string, CDEvtKind> kinds {
+        {"SystemUpdateID", CDEVT_INT},
+        {"ContainerUpdateIDs", CDEVT_STRING},
+        {"TransferIDs", CDEVT_STRING},
+    };
+    auto it = kinds.find(nm);
+    return it == kinds.end() ? CDEVT_UNKNOWN : it->second;
+}
+
+// Browse/Search results cache, shared by all the objects and keyed
+// by server UDN. We store the raw DIDL text, so that the caller's
+// parse options (storage mode, visitor, projection) apply to the
+// cached data too.
+enum CacheKind {CK_CHILDREN, CK_METADATA, CK_SEARCH};
+
+class BrowseCache {
+public:
+    class Entry {
+    public:
+        string key;
+        string udn;
+        string objid;
+        CacheKind kind;
+        string didl;
+        int didread;
+        int total;
+        size_t size() const {
+            return sizeof(Entry) + key.size() + udn.size() + objid.size() +
+                didl.size();
+        }
+    };
+    class Server {
+    public:
+        int users{0};          // Cache-enabled objects
+        bool synced{false};    // Tracking the events since the last sync
+        long updateid{-1};     // Last SystemUpdateID
+        bool hascuids{false};  // Server sends ContainerUpdateIDs
+        unsigned int gen{0};   // Incremented by each invalidation
+    };
+
+    static string key(const string& udn, CacheKind kind,
+                      const string& objid, const string& criteria,
+                      const string& filter, const string& sort,
+                      int offset, int count) {
+        static const char *kinds[] = {
+            "BrowseDirectChildren", "BrowseMetadata", "Search"};
+        string k(udn);
+        for (const string *s : {&objid, &criteria, &filter, &sort}) {
+            k += '\0';
+            k += *s;
+        }
+        k += '\0';
+        k += kinds[kind];
+        k += '\0';
+        k += lltodecstr(offset) + " " + lltodecstr(count);
+        return k;
+    }
+
+    // Fetch entry data. *gen is set for a possible following put()
+    bool get(const string& k, const string& udn, string& didl,
+             int *didread, int *total, unsigned int *gen) {
+        std::unique_lock<std::mutex> lock(mutex);
+        Server& srv = servers[udn];
+        *gen = srv.gen;
+        if (!srv.synced)
+            return false;
+        auto it = index.find(k);
+        if (it == index.end())
+            return false;
+        lru.splice(lru.begin(), lru, it->second);
+        didl = it->second->didl;
+        *didread = it->second->didread;
+        *total = it->second->total;
+        return true;
+    }
+
+    // Store data fetched from the network, if nothing was invalidated
+    // for the server since the get() which returned gen.
+    void put(Entry&& e, unsigned int gen) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (servers[e.udn].gen != gen || e.size() > maxbytes / 4)
+            return;
+        auto it = index.find(e.key);
+        if (it != index.end())
+            erase(it->second);
+        bytes += e.size();
+        lru.push_front(std::move(e));
+        index[lru.front().key] = lru.begin();
+        while (bytes > maxbytes && !lru.empty())
+            erase(std::prev(lru.end()));
+    }
+
+    // Count the objects using the cache for a server. Without users,
+    // nobody follows the events: we will need a new sync.
+    void use(const string& udn, bool onoff) {
+        std::unique_lock<std::mutex> lock(mutex);
+        Server& srv = servers[udn];
+        srv.users += onoff ? 1 : -1;
+        if (srv.users <= 0) {
+            srv.users = 0;
+            srv.synced = false;
+        }
+    }
+
+    // The subscription is not active: we may miss events
+    void desync(const string& udn) {
+        std::unique_lock<std::mutex> lock(mutex);
+        servers[udn].synced = false;
+    }
+
+    void event(const string& udn, const string *sysupdid,
+               const string *cuids);
+
+    void clear(const string& udn) {
+        std::unique_lock<std::mutex> lock(mutex);
+        eraseIf(udn, [] (const Entry&) {return true;});
+    }
+
+    void setMax(size_t mx) {
+        std::unique_lock<std::mutex> lock(mutex);
+        maxbytes = mx;
+        while (bytes > maxbytes && !lru.empty())
+            erase(std::prev(lru.end()));
+    }
+
+private:
+    void erase(std::list<Entry>::iterator it) {
+        bytes -= it->size();
+        index.erase(it->key);
+        lru.erase(it);
+    }
+    // Erase the entries for a server (or all if udn is empty) for which
+    // pred returns true
+    template <class P> void eraseIf(const string& udn, P pred) {
+        for (auto it = lru.begin(); it != lru.end();) {
+            auto cur = it++;
+            if ((udn.empty() || cur->udn == udn) && pred(*cur))
+                erase(cur);
+        }
+        if (udn.empty()) {
+            for (auto& srv : servers)
+                srv.second.gen++;
+        } else {
+            servers[udn].gen++;
+        }
+    }
+
+    std::mutex mutex;
+    size_t maxbytes{16 * 1024 * 1024};
+    size_t bytes{0};
+    std::list<Entry> lru; // Most recently used first
+    std::unordered_map<string, std::list<Entry>::iterator> index;
+    std::unordered_map<string, Server> servers;
+};
+
+void BrowseCache::event(const string& udn, const string *sysupdid,
+                        const string *cuids)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    Server& srv = servers[udn];
+    bool flushall = false;
+    if (cuids && !cuids->empty()) {
+        // id,updateid,id,updateid... The listed containers changed,
+        // and maybe some objects inside them: drop the metadata and
+        // search results, for which we can't tell.
+        vector<string> vals;
+        if (csvToStrings(*cuids, vals)) {
+            srv.hascuids = true;
+            std::unordered_set<string> ids;
+            for (unsigned int i = 0; i < vals.size(); i += 2)
+                ids.insert(vals[i]);
+            eraseIf(udn, [&ids] (const Entry& e) {
+                    return e.kind != CK_CHILDREN ||
+                        ids.find(e.objid) != ids.end();});
+        } else {
+            LOGINF("ContentDirectory: bad ContainerUpdateIDs [" << *cuids <<
+                   "]\n");
+            flushall = true;
+        }
+    }
+    if (sysupdid) {
+        long updateid = atol(sysupdid->c_str());
+        if (!srv.synced) {
+            // First event since we last followed the server: the
+            // cached data is valid if nothing changed meanwhile.
+            flushall = flushall || updateid != srv.updateid;
+            srv.synced = srv.users > 0;
+        } else if (updateid != srv.updateid && !srv.hascuids) {
+            flushall = true;
+        }
+        srv.updateid = updateid;
+    }
+    if (flushall) {
+        LOGDEB("ContentDirectory: flushing results cache for " << udn << endl);
+        eraseIf(udn, [] (const Entry&) {return true;});
+    }
+}
+
+static BrowseCache o_browsecache;
+
 void ContentDirectory::evtCallback(
     const std::unordered_map<string, string>& props)
 {
+    if (m_cacheon) {
+        auto sysupdid = props.find("SystemUpdateID");
+        auto cuids = props.find("ContainerUpdateIDs");
+        o_browsecache.event(
+            getDeviceId(),
+            sysupdid == props.end() ? nullptr : &sysupdid->second,
+            cuids == props.end() ? nullptr : &cuids->second);
+    }
+    VarEventReporter *reporter = getReporter();
     for (std::unordered_map<std::string, std::string>::const_iterator it =
              props.begin(); it != props.end(); it++) {
-        if (!getReporter()) {
+        if (!reporter) {
             LOGDEB1("ContentDirectory::evtCallback: " << it->first << " -> "
                     << it->second << endl);
             continue;
         }
-        if (!it->first.compare("SystemUpdateID")) {
-            getReporter()->changed(it->first.c_str(), atoi(it->second.c_str()));
+        const char *nm = it->first.c_str();
+        switch (cdEvtKind(it->first)) {
+        case CDEVT_INT:
+            reporter->changed(nm, atoi(it->second.c_str()));
+            break;
+        case CDEVT_STRING:
+            reporter->changed(nm, it->second.c_str());
+            break;
+        case CDEVT_UNKNOWN:
+            LOGERR("ContentDirectory event: unknown variable: name [" <<
+                   it->first << "] value [" << it->second << endl);
+            reporter->changed(nm, it->second.c_str());
+            break;
+        }
+    }
+}
 
-        } else if (!it->first.compare("ContainerUpdateIDs") ||
-                   !it->first.compare("TransferIDs")) {
-            getReporter()->changed(it->first.c_str(),
-                                   it->second.c_str());
+// Automatic slice size tuning. The state is kept by server UDN,
+// because ContentDirectory objects are usually created anew for each
+// use.
+static const int tuneMinSlice = 10;
+static const int tuneMaxSlice = 2000;
+static const int tuneSamples = 3;    // Reads needed to judge a size
+static const int tuneReprobe = 20;   // Settled reads before a new probe
+
+class SliceTuning {
+public:
+    int size{0};          // Size we are using now
+    int bestsize{0};      // Best size seen so far
+    double bestrate{0};   // Entries/s at bestsize
+    double rate{0};       // Entries/s at size (moving average)
+    int nsamples{0};      // Samples in rate
+    int cap{0};           // Max returned by the server, 0 if unknown
+    int maxok{tuneMaxSlice}; // Sizes above this timed out
+    int settledcnt{-1};   // >= 0 when settled: requests since then
+};
+
+static std::mutex o_tunemutex;
+static bool o_tuning{false};
+static std::unordered_map<string, SliceTuning> o_tunings;
+
+// Size to use for the server, dflt if we know nothing
+static int tunedSliceSize(const string& udn, int dflt)
+{
+    std::unique_lock<std::mutex> lock(o_tunemutex);
+    if (!o_tuning)
+        return dflt;
+    auto it = o_tunings.find(udn);
+    if (it == o_tunings.end() || it->second.size == 0)
+        return dflt;
+    return it->second.size;
+}
 
+// Record the result of a single Browse/Search request: server
+// maximum and timeouts. callerdeadline is set if a timeout may come
+// from the caller's deadline rather than from the transport.
+static void tuneObserveRequest(const string& udn, int requested, int offset,
+                               int didread, int total, int err,
+                               bool callerdeadline)
+{
+    std::unique_lock<std::mutex> lock(o_tunemutex);
+    if (!o_tuning)
+        return;
+    SliceTuning& t = o_tunings[udn];
+    if (t.size == 0)
+        t.size = requested;
+    // Requests from an explicit readDirSlice(), or started with a
+    // previous size, tell us nothing.
+    if (requested != t.size)
+        return;
+
+    if (err != UPNP_E_SUCCESS) {
+        if (err == UPNP_E_TIMEDOUT && !callerdeadline &&
+            t.size > tuneMinSlice) {
+            t.maxok = std::max(tuneMinSlice, t.size - 1);
+            t.size = std::max(tuneMinSlice, t.size / 2);
+            t.bestsize = std::min(t.bestsize, t.size);
+            t.nsamples = 0;
+            t.settledcnt = 0;
+            LOGINF("ContentDirectory: " << udn << ": timeout, slice size " <<
+                   t.size << endl);
+        }
+        return;
+    }
+
+    if (didread < requested && didread > 0 && offset + didread < total) {
+        // The server has its own maximum
+        t.cap = std::max(tuneMinSlice, didread);
+        if (t.size > t.cap) {
+            t.size = t.cap;
+            t.bestsize = std::min(t.bestsize, t.size);
+            t.nsamples = 0;
+            LOGDEB("ContentDirectory: " << udn << ": server max " <<
+                   t.cap << endl);
+        }
+    }
+}
+
+// Record the throughput of a readDir() or search() call, which read
+// nread entries with the given slice size. This is measured for the
+// whole call, so that it includes the effect of concurrent fetching.
+static void tuneObserveRead(const string& udn, int slicesize, int nread,
+                            double secs)
+{
+    std::unique_lock<std::mutex> lock(o_tunemutex);
+    if (!o_tuning)
+        return;
+    SliceTuning& t = o_tunings[udn];
+    if (t.size == 0)
+        t.size = slicesize;
+    // Started with a previous size, or less than a full slice: not
+    // significant.
+    if (slicesize != t.size || nread < slicesize)
+        return;
+
+    double rate = nread / std::max(secs, 0.001);
+    t.rate = t.nsamples ? 0.7 * t.rate + 0.3 * rate : rate;
+    t.nsamples++;
+
+    if (t.settledcnt >= 0) {
+        if (t.size == t.bestsize)
+            t.bestrate = t.rate;
+        if (++t.settledcnt < tuneReprobe)
+            return;
+        // Time to check if a bigger size would do better now. An old
+        // timeout may have been transient.
+        t.settledcnt = -1;
+        t.maxok = tuneMaxSlice;
+    }
+    if (t.nsamples < tuneSamples)
+        return;
+    if (t.bestsize == 0 || t.size == t.bestsize || t.rate > t.bestrate * 1.1) {
+        t.bestsize = t.size;
+        t.bestrate = t.rate;
+        int next = std::min(std::min(t.size * 3 / 2, t.maxok),
+                            t.cap ? t.cap : tuneMaxSlice);
+        if (next > t.size) {
+            t.size = next;
+            t.nsamples = 0;
         } else {
-            LOGERR("ContentDirectory event: unknown variable: name [" <<
-                   it->first << "] value [" << it->second << endl);
-            getReporter()->changed(it->first.c_str(), it->second.c_str());
+            t.settledcnt = 0;
         }
+    } else {
+        // Growing did not help, go back
+        t.size = t.bestsize;
+        t.nsamples = 0;
+        t.settledcnt = 0;
+        LOGDEB("ContentDirectory: " << udn << ": slice size settled at " <<
+               t.size << endl);
     }
 }
 
+void ContentDirectory::setSliceTuning(bool onoff)
+{
+    std::unique_lock<std::mutex> lock(o_tunemutex);
+    o_tuning = onoff;
+}
+
+std::map<string, int> ContentDirectory::learnedSliceSizes()
+{
+    std::unique_lock<std::mutex> lock(o_tunemutex);
+    std::map<string, int> out;
+    for (const auto& entry : o_tunings) {
+        const SliceTuning& t = entry.second;
+        out[entry.first] = t.bestsize ? t.bestsize : t.size;
+    }
+    return out;
+}
+
+void ContentDirectory::setLearnedSliceSize(const string& udn, int size)
+{
+    std::unique_lock<std::mutex> lock(o_tunemutex);
+    if (size <= 0) {
+        o_tunings.erase(udn);
+        return;
+    }
+    SliceTuning t;
+    t.size = t.bestsize = std::min(std::max(size, tuneMinSlice), tuneMaxSlice);
+    t.settledcnt = 0;
+    o_tunings[udn] = t;
+}
+
 /*
   manufacturer: Bubblesoft model BubbleUPnP Media Server
   manufacturer: Justin Maggard model Windows Media Connect compatible (MiniDLNA)
@@ -176,36 +566,125 @@ void ContentDirectory::registerCallback()
     Service::registerCallback(bind(&ContentDirectory::evtCallback, this, _1));
 }
 
-int ContentDirectory::readDirSlice(const string& objectId, int offset,
-                                   int count, UPnPDirContent& dirbuf,
-                                   int *didread, int *total)
+ContentDirectory::~ContentDirectory()
 {
-    LOGDEB("CDService::readDirSlice: objId [" << objectId << "] offset " <<
-           offset << " count " << count << endl);
+    if (m_cacheon) {
+        o_browsecache.use(getDeviceId(), false);
+    }
+}
 
-    // Create request
+void ContentDirectory::setBrowseCache(bool onoff)
+{
+    if (m_cacheon.exchange(onoff) == onoff)
+        return;
+    o_browsecache.use(getDeviceId(), onoff);
+    if (onoff) {
+        // The initial event will tell if the cached data is valid
+        if (!callbackRegistered())
+            registerCallback();
+    } else if (getReporter() == nullptr && !stateMirrorEnabled()) {
+        unregisterCallback();
+    }
+}
+
+void ContentDirectory::setBrowseCacheSize(size_t maxbytes)
+{
+    o_browsecache.setMax(maxbytes);
+}
+
+void ContentDirectory::clearBrowseCache(const string& udn)
+{
+    o_browsecache.clear(udn);
+}
+
+bool ContentDirectory::cacheUsable()
+{
+    if (!m_cacheon)
+        return false;
+    if (!eventsActive()) {
+        o_browsecache.desync(getDeviceId());
+        return false;
+    }
+    return true;
+}
+
+int ContentDirectory::fetchSlice(bool search, const string& objectId,
+                                 const string& ss, int offset, int count,
+                                 string& tbuf, int *didread, int *total)
+{
+    const char *what = search ? "search" : "readDir";
     // Some devices require an empty SortCriteria, else bad params
-    SoapOutgoing args(getServiceType(), "Browse");
-    args("ObjectID", objectId)
-    ("BrowseFlag", "BrowseDirectChildren")
-    ("Filter", "*")
-    ("SortCriteria", "")
-    ("StartingIndex", SoapHelp::i2s(offset))
-    ("RequestedCount", SoapHelp::i2s(count));
+    static const string filter("*");
+    static const string sort;
+
+    const CacheKind kind = search ? CK_SEARCH : CK_CHILDREN;
+    bool caching = cacheUsable();
+    string ckey;
+    unsigned int cgen{0};
+    if (caching) {
+        ckey = BrowseCache::key(getDeviceId(), kind, objectId, ss, filter,
+                                sort, offset, count);
+        if (o_browsecache.get(ckey, getDeviceId(), tbuf, didread, total,
+                              &cgen)) {
+            LOGDEB1("CDService::" << what << ": from cache" << endl);
+            return UPNP_E_SUCCESS;
+        }
+    }
+
+    // Create request
+    SoapOutgoing args(getServiceType(), search ? "Search" : "Browse");
+    if (search) {
+        args("ContainerID", objectId)
+        ("SearchCriteria", ss);
+    } else {
+        args("ObjectID", objectId)
+        ("BrowseFlag", "BrowseDirectChildren");
+    }
+    args("Filter", filter)
+    ("SortCriteria", sort)
+    ("StartingIndex", offset)
+    ("RequestedCount", count);
 
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
+        LOGINF("CDService::" << what << ": UpnpSendAction failed: " <<
+               UpnpGetErrorMessage(ret) << endl);
+        bool callerdeadline = ActionScope::currentTimeout() > 0 ||
+            getActionTimeout() > 0;
+        tuneObserveRequest(getDeviceId(), count, offset, 0, 0, ret,
+                           callerdeadline);
         return ret;
     }
 
-    string tbuf;
     if (!data.get("NumberReturned", didread) ||
             !data.get("TotalMatches", total) ||
-            !data.get("Result", &tbuf)) {
-        LOGERR("CDService::readDir: missing elts in response" << endl);
+            !data.take("Result", &tbuf)) {
+        LOGERR("CDService::" << what << ": missing elts in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
+    tuneObserveRequest(getDeviceId(), count, offset, *didread, *total, ret,
+                       false);
+    if (caching) {
+        o_browsecache.put(BrowseCache::Entry{ckey, getDeviceId(), objectId,
+                    kind, tbuf, *didread, *total}, cgen);
+    }
+    return UPNP_E_SUCCESS;
+}
+
+int ContentDirectory::readDirSlice(const string& objectId, int offset,
+                                   int count, UPnPDirContent& dirbuf,
+                                   int *didread, int *total)
+{
+    LOGDEB("CDService::readDirSlice: objId [" << objectId << "] offset " <<
+           offset << " count " << count << endl);
+
+    string tbuf;
+    int ret = fetchSlice(false, objectId, string(), offset, count, tbuf,
+                         didread, total);
+    if (ret != UPNP_E_SUCCESS) {
+        return ret;
+    }
 
     if (*didread <= 0) {
         LOGINF("CDService::readDir: got -1 or 0 entries" << endl);
@@ -224,29 +703,6 @@ int ContentDirectory::readDirSlice(const string& objectId, int offset,
     return UPNP_E_SUCCESS;
 }
 
-int ContentDirectory::readDir(const string& objectId,
-                              UPnPDirContent& dirbuf)
-{
-    LOGDEB("CDService::readDir: url [" << getActionURL() << "] type [" <<
-           getServiceType() << "] udn [" << getDeviceId() << "] objId [" <<
-           objectId << endl);
-
-    int offset = 0;
-    int total = 1000;// Updated on first read.
-
-    while (offset < total) {
-        int count;
-        int error = readDirSlice(objectId, offset, m_rdreqcnt, dirbuf,
-                                 &count, &total);
-        if (error != UPNP_E_SUCCESS)
-            return error;
-
-        offset += count;
-    }
-
-    return UPNP_E_SUCCESS;
-}
-
 int ContentDirectory::searchSlice(const string& objectId,
                                   const string& ss,
                                   int offset, int count, UPnPDirContent& dirbuf,
@@ -255,31 +711,12 @@ int ContentDirectory::searchSlice(const string& objectId,
     LOGDEB("CDService::searchSlice: objId [" << objectId << "] offset " <<
            offset << " count " << count << endl);
 
-    // Create request
-    SoapOutgoing args(getServiceType(), "Search");
-    args("ContainerID", objectId)
-    ("SearchCriteria", ss)
-    ("Filter", "*")
-    ("SortCriteria", "")
-    ("StartingIndex", SoapHelp::i2s(offset))
-    ("RequestedCount", SoapHelp::i2s(count));
-
-    SoapIncoming data;
-    int ret = runAction(args, data);
-
+    string tbuf;
+    int ret = fetchSlice(true, objectId, ss, offset, count, tbuf,
+                         didread, total);
     if (ret != UPNP_E_SUCCESS) {
-        LOGINF("CDService::search: UpnpSendAction failed: " <<
-               UpnpGetErrorMessage(ret) << endl);
         return ret;
     }
-
-    string tbuf;
-    if (!data.get("NumberReturned", didread) ||
-            !data.get("TotalMatches", total) ||
-            !data.get("Result", &tbuf)) {
-        LOGERR("CDService::search: missing elts in response" << endl);
-        return UPNP_E_BAD_RESPONSE;
-    }
     if (*didread <=  0) {
         LOGINF("CDService::search: got -1 or 0 entries" << endl);
         return count < 0 ? UPNP_E_BAD_RESPONSE : UPNP_E_SUCCESS;
@@ -290,6 +727,188 @@ int ContentDirectory::searchSlice(const string& objectId,
     return UPNP_E_SUCCESS;
 }
 
+// Fetching the slices which follow the first one, with several
+// requests outstanding. The fetcher threads take the slices in order
+// and store the raw results, which the calling thread parses in
+// order. The fetchers don't get more than 'window' slices ahead of
+// the parser, which bounds the memory used.
+class SliceFetcher {
+public:
+    struct Result {
+        bool done{false};
+        int error{UPNP_E_SUCCESS};
+        int didread{0};
+        string tbuf;
+    };
+    SliceFetcher(int nslices, int window)
+        : results(nslices), window(window) {}
+    vector<Result> results;
+    int window;
+    std::mutex mutex;
+    std::condition_variable cond;
+    int next{0};    // Next slice to be fetched
+    int parsed{0};  // Slices handed to the parser
+    bool abort{false};
+
+    // Fetcher thread: get the next slice number, or -1 if done
+    int getWork() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this] {
+                return abort || next >= int(results.size()) ||
+                    next < parsed + window;});
+        if (abort || next >= int(results.size()))
+            return -1;
+        return next++;
+    }
+    void setResult(int i, Result&& res) {
+        std::unique_lock<std::mutex> lock(mutex);
+        results[i] = std::move(res);
+        results[i].done = true;
+        cond.notify_all();
+    }
+    // Parser: wait for slice i and take its data
+    Result take(int i) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this, i] {return results[i].done;});
+        parsed = i + 1;
+        cond.notify_all();
+        return std::move(results[i]);
+    }
+    void stop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        abort = true;
+        cond.notify_all();
+    }
+};
+
+// The fetcher threads for a readAll() call. They are stopped and
+// joined when it exits, including by an exception (e.g. from a
+// visitor).
+class SliceWorkers {
+public:
+    SliceWorkers(SliceFetcher& fetcher)
+        : fetcher(fetcher) {}
+    ~SliceWorkers() {
+        fetcher.stop();
+        for (auto& thr : threads) {
+            thr.join();
+        }
+    }
+    SliceFetcher& fetcher;
+    vector<std::thread> threads;
+};
+
+int ContentDirectory::readAll(bool search, const string& objectId,
+                              const string& ss, UPnPDirContent& dirbuf)
+{
+    const int slicesize = tunedSliceSize(getDeviceId(), goodSliceSize());
+    const int window = m_rdconcurrency;
+    auto sliceFunc = [&](int offset, int count, int *didread, int *total) {
+        return search ?
+        searchSlice(objectId, ss, offset, count, dirbuf, didread, total) :
+        readDirSlice(objectId, offset, count, dirbuf, didread, total);
+    };
+    // Report the throughput of a complete read to the slice tuning
+    auto tstart = std::chrono::steady_clock::now();
+    auto observe = [&](int nread) {
+        if (dirbuf.stopped())
+            return;
+        double secs = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - tstart).count();
+        tuneObserveRead(getDeviceId(), slicesize, nread, secs);
+    };
+
+    // The first slice tells us the total.
+    int offset = 0;
+    int total = 1000;// Updated on first read.
+    int count;
+    int error = sliceFunc(0, slicesize, &count, &total);
+    if (error != UPNP_E_SUCCESS)
+        return error;
+    offset += count;
+
+    if (window <= 1 || offset >= total || count <= 0 || dirbuf.stopped()) {
+        // A server may report a larger total than it will return: an
+        // empty slice ends the read.
+        while (count > 0 && offset < total && !dirbuf.stopped()) {
+            error = sliceFunc(offset, slicesize, &count, &total);
+            if (error != UPNP_E_SUCCESS)
+                return error;
+            offset += count;
+        }
+        observe(offset);
+        return UPNP_E_SUCCESS;
+    }
+
+    // Remaining slices: fetch concurrently, parse here in order.
+    const int base = offset;
+    const int nslices = (total - base + slicesize - 1) / slicesize;
+    SliceFetcher fetcher(nslices, window);
+    // The worker threads use the same action settings as we do.
+    const int scopetimeout = ActionScope::currentTimeout();
+    ActionCancel *scopecancel = ActionScope::currentCancel();
+    SliceWorkers workers(fetcher);
+    for (int i = 0; i < std::min(window, nslices); i++) {
+        workers.threads.push_back(std::thread([&] {
+                    ActionScope scope(scopetimeout, scopecancel);
+                    int slice;
+                    while ((slice = fetcher.getWork()) >= 0) {
+                        SliceFetcher::Result res;
+                        int ntotal;
+                        res.error = fetchSlice(
+                            search, objectId, ss, base + slice * slicesize,
+                            slicesize, res.tbuf, &res.didread, &ntotal);
+                        fetcher.setResult(slice, std::move(res));
+                    }
+                }));
+    }
+
+    for (int slice = 0; slice < nslices; slice++) {
+        SliceFetcher::Result res = fetcher.take(slice);
+        if (res.error != UPNP_E_SUCCESS) {
+            error = res.error;
+            break;
+        }
+        if (res.didread <= 0) {
+            LOGINF("CDService::readAll: got -1 or 0 entries" << endl);
+            if (!search)
+                error = UPNP_E_BAD_RESPONSE;
+            break;
+        }
+        if (!dirbuf.parse(res.tbuf)) {
+            error = UPNP_E_BAD_RESPONSE;
+            break;
+        }
+        // Some servers return fewer entries than asked even when
+        // more exist: get the rest of the slice before going on.
+        int sliceoffs = base + slice * slicesize;
+        int sliceend = std::min(sliceoffs + slicesize, total);
+        offset = sliceoffs + res.didread;
+        while (offset < sliceend && !dirbuf.stopped()) {
+            int ntotal;
+            error = sliceFunc(offset, sliceend - offset, &count, &ntotal);
+            if (error != UPNP_E_SUCCESS || count <= 0)
+                break;
+            offset += count;
+        }
+        if (error != UPNP_E_SUCCESS || dirbuf.stopped())
+            break;
+    }
+    if (error == UPNP_E_SUCCESS)
+        observe(offset);
+    return error;
+}
+
+int ContentDirectory::readDir(const string& objectId,
+                              UPnPDirContent& dirbuf)
+{
+    LOGDEB("CDService::readDir: url [" << getActionURL() << "] type [" <<
+           getServiceType() << "] udn [" << getDeviceId() << "] objId [" <<
+           objectId << endl);
+
+    return readAll(false, objectId, string(), dirbuf);
+}
+
 int ContentDirectory::search(const string& objectId,
                              const string& ss,
                              UPnPDirContent& dirbuf)
@@ -298,20 +917,7 @@ int ContentDirectory::search(const string& objectId,
            getServiceType() << "] udn [" << getDeviceId() << "] objid [" <<
            objectId <<  "] search [" << ss << "]" << endl);
 
-    int offset = 0;
-    int total = 1000;// Updated on first read.
-
-    while (offset < total) {
-        int count;
-        int error = searchSlice(objectId, ss, offset, m_rdreqcnt, dirbuf,
-                                &count, &total);
-        if (error != UPNP_E_SUCCESS)
-            return error;
-
-        offset += count;
-    }
-
-    return UPNP_E_SUCCESS;
+    return readAll(true, objectId, ss, dirbuf);
 }
 
 int ContentDirectory::getSearchCapabilities(set<string>& result)
@@ -352,12 +958,28 @@ int ContentDirectory::getMetadata(const string& objectId,
            getServiceType() << "] udn [" << getDeviceId() << "] objId [" <<
            objectId << "]" << endl);
 
+    static const string filter("*");
+    static const string sort;
+    string tbuf;
+    bool caching = cacheUsable();
+    string ckey;
+    unsigned int cgen{0};
+    int didread, total;
+    if (caching) {
+        ckey = BrowseCache::key(getDeviceId(), CK_METADATA, objectId,
+                                string(), filter, sort, 0, 1);
+        if (o_browsecache.get(ckey, getDeviceId(), tbuf, &didread, &total,
+                              &cgen)) {
+            return dirbuf.parse(tbuf) ? UPNP_E_SUCCESS : UPNP_E_BAD_RESPONSE;
+        }
+    }
+
     SoapOutgoing args(getServiceType(), "Browse");
     SoapIncoming data;
     args("ObjectID", objectId)
     ("BrowseFlag", "BrowseMetadata")
-    ("Filter", "*")
-    ("SortCriteria", "")
+    ("Filter", filter)
+    ("SortCriteria", sort)
     ("StartingIndex", "0")
     ("RequestedCount", "1");
     int ret = runAction(args, data);
@@ -366,11 +988,14 @@ int ContentDirectory::getMetadata(const string& objectId,
                UpnpGetErrorMessage(ret) << endl);
         return ret;
     }
-    string tbuf;
-    if (!data.get("Result", &tbuf)) {
+    if (!data.take("Result", &tbuf)) {
         LOGERR("CDService::getmetadata: missing Result in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
+    if (caching) {
+        o_browsecache.put(BrowseCache::Entry{ckey, getDeviceId(), objectId,
+                    CK_METADATA, tbuf, 1, 1}, cgen);
+    }
 
     if (dirbuf.parse(tbuf))
         return UPNP_E_SUCCESS;
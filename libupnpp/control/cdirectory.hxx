@@ -20,6 +20,8 @@
 
 #include "libupnpp/config.h"
 
+#include <atomic>
+#include <map>
 #include <unordered_map>
 #include <set>
 #include <string>
@@ -58,7 +60,7 @@ public:
 
     /** Construct by copying data from device and service objects. */
     ContentDirectory(const UPnPDeviceDesc& dev, const UPnPServiceDesc& srv);
-    virtual ~ContentDirectory() {}
+    virtual ~ContentDirectory();
 
     /** An empty one */
     ContentDirectory() {}
@@ -83,6 +85,10 @@ public:
                                 CDSH& server);
 
     /** Read a full container's children list
+     *
+     * If a visitor is set on dirbuf (UPnPDirContent::setVisitor()),
+     * the entries are passed to it as each slice is parsed, and the
+     * reading stops if it returns false.
      *
      * @param objectId the UPnP object Id for the container. Root has Id "0"
      * @param[out] dirbuf stores the entries we read.
@@ -107,11 +113,80 @@ public:
                      int count, UPnPDirContent& dirbuf,
                      int *didread, int *total);
 
+    /** Slice size used by readDir() and search(), unless slice
+     * tuning is enabled and has learned a value for the server. */
     int goodSliceSize()
     {
         return m_rdreqcnt;
     }
 
+    /** Enable or disable the automatic slice size tuning (disabled
+     * by default). The library measures the throughput of the
+     * readDir() and search() calls, and adjusts the slice size for
+     * each server: it grows while this improves the throughput, goes
+     * back when it does not, shrinks after timeouts, and respects the
+     * maximum a server is seen to return. The current values are
+     * periodically re-probed. The timeouts are ignored when the
+     * caller sets a deadline (Service::setActionTimeout() or
+     * ActionScope), as they may not come from the server.
+     */
+    static void setSliceTuning(bool onoff);
+
+    /** Learned slice sizes by server UDN, e.g. for saving them */
+    static std::map<std::string, int> learnedSliceSizes();
+
+    /** Set the starting slice size for a server, e.g. from saved data.
+     * 0 to forget what we know. */
+    static void setLearnedSliceSize(const std::string& udn, int size);
+
+    /** Set the maximum number of slice requests which readDir() and
+     * search() keep outstanding once the first slice has told them
+     * the total count. The slices are parsed in order by the calling
+     * thread while the following ones are being fetched. The default
+     * is 1: fetch serially. Some servers don't deal well with
+     * concurrent requests, so only raise this for those known to
+     * support it.
+     */
+    void setReadConcurrency(int n)
+    {
+        m_rdconcurrency = n > 0 ? n : 1;
+    }
+    int readConcurrency() const
+    {
+        return m_rdconcurrency;
+    }
+
+    /** Enable or disable the results cache for this object.
+     *
+     * When enabled, the Browse and Search results (for readDir(),
+     * readDirSlice(), search(), searchSlice() and getMetadata()) are
+     * kept in a memory cache shared by all the ContentDirectory
+     * objects, and the identical requests are answered from
+     * it. This subscribes to the service events (even if no reporter
+     * is installed), which are used for invalidation:
+     *  - ContainerUpdateIDs: drops the children lists of the listed
+     *    containers, and all the metadata and search results for the
+     *    server.
+     *  - SystemUpdateID: drops everything for a server which does not
+     *    send ContainerUpdateIDs.
+     * The cache is only used while we hold a subscription and have
+     * seen the initial event. The data for a server survives the
+     * objects, and is kept after a new subscription if the
+     * SystemUpdateID did not change meanwhile.
+     */
+    void setBrowseCache(bool onoff);
+    bool browseCacheEnabled() const {
+        return m_cacheon;
+    }
+
+    /** Set the memory size for the results cache, least recently used
+     * entries are evicted beyond it. The default is 16 MB. 0 empties
+     * and disables the cache. */
+    static void setBrowseCacheSize(size_t maxbytes);
+
+    /** Empty the results cache for a server, or for all if udn is empty */
+    static void clearBrowseCache(const std::string& udn = std::string());
+
     /** Search the content directory service.
      *
      * @param objectId the UPnP object Id under which the search
@@ -120,7 +195,8 @@ public:
      * @param searchstring an UPnP searchcriteria string. Check the
      * UPnP document: UPnP-av-ContentDirectory-v1-Service-20020625.pdf
      * section 2.5.5. Maybe we'll provide an easier way some day...
-     * @param[out] dirbuf stores the entries we read.
+     * @param[out] dirbuf stores the entries we read. A visitor set on
+     *   dirbuf is used as for readDir().
      * @return UPNP_E_SUCCESS for success, else libupnp error code.
      */
     int search(const std::string& objectId, const std::string& searchstring,
@@ -156,10 +232,33 @@ protected:
 
 private:
     int m_rdreqcnt{200}; // Slice size to use when reading
+    int m_rdconcurrency{1}; // Max outstanding slice requests
     ServiceKind m_serviceKind{CDSKIND_UNKNOWN};
+    // Read by the event callback
+    std::atomic<bool> m_cacheon{false};
+
+    // Run a Browse or Search (with criteria ss) request for one
+    // slice, and return the raw DIDL text
+    int fetchSlice(bool search, const std::string& objectId,
+                   const std::string& ss, int offset, int count,
+                   std::string& tbuf, int *didread, int *total);
+    // Common code for readDir() and search()
+    int readAll(bool search, const std::string& objectId,
+                const std::string& ss, UPnPDirContent& dirbuf);
+
+    // Check if the results cache can be used for a request
+    bool cacheUsable();
+
+    // Can't copy these: each object accounts for its use of the
+    // shared results cache, and the event callback refers to it.
+    ContentDirectory(const ContentDirectory&);
+    ContentDirectory& operator=(const ContentDirectory&);
 
     void evtCallback(const std::unordered_map<std::string, std::string>&);
     void registerCallback();
+    virtual bool keepEvents() const {
+        return m_cacheon;
+    }
 };
 
 }
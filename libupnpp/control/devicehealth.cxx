@@ -0,0 +1,274 @@
+/* Copyright (C) 2006-2016 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+#include "libupnpp/config.h"
+
+#include "libupnpp/control/devicehealth.hxx"
+
+#include <upnp/upnp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+#include "libupnpp/control/description.hxx"
+#include "libupnpp/control/discovery.hxx"
+
+using namespace std;
+
+namespace UPnPClient {
+
+typedef std::chrono::steady_clock::time_point TimePoint;
+
+// Period for counting the recent timeouts
+static const std::chrono::seconds timeoutWindow(60);
+
+static std::atomic<bool> o_enabled(false);
+static int o_maxfailures{3};
+static int o_maxtimeouts{2};
+static int o_cooldownms{5000};
+static int o_maxcooldownms{60000};
+
+class DevHealthEntry {
+public:
+    DeviceHealth::State state{DeviceHealth::HEALTHY};
+    int consecutivefailures{0};
+    std::deque<TimePoint> timeouts;
+    // Current cooldown, doubled on each failed probe
+    int cooldownms{0};
+    // Time after which a probe may be attempted
+    TimePoint retryafter;
+    // Tripped because of a discovery byebye or expiry, not call failures
+    bool lost{false};
+};
+
+// Entries exist only for the devices which had a failure
+static std::unordered_map<string, DevHealthEntry> o_devices;
+static std::mutex o_mutex;
+
+// Results which tell nothing about the device state: local problems,
+// or cancellation or deadline from the caller.
+static bool isInconclusive(int err, bool callerdeadline)
+{
+    if (callerdeadline)
+        return true;
+    switch (err) {
+    case UPNP_E_CANCELED:
+    case UPNP_E_OUTOF_MEMORY:
+    case UPNP_E_INVALID_PARAM:
+    case UPNP_E_INVALID_HANDLE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Is this a failure to reach the device (as opposed to an error
+// returned by the device) ?
+static bool isNetworkFailure(int err)
+{
+    return err < 0 && err != UPNP_E_BAD_RESPONSE;
+}
+
+static bool isTimeout(int err)
+{
+    return err == UPNP_E_TIMEDOUT || err == UPNP_E_SOCKET_READ ||
+        err == UPNP_E_SOCKET_CONNECT;
+}
+
+// Trip the breaker. Called with the lock held
+static void trip(const string& udn, DevHealthEntry& ent, bool lost)
+{
+    if (ent.state == DeviceHealth::PROBING && ent.cooldownms > 0) {
+        ent.cooldownms = std::min(2 * ent.cooldownms, o_maxcooldownms);
+    } else {
+        ent.cooldownms = o_cooldownms;
+    }
+    LOGINF("DeviceHealth: tripping " << udn << (lost ? " (lost)" : "") <<
+           " for " << ent.cooldownms << " mS" << endl);
+    ent.state = DeviceHealth::TRIPPED;
+    ent.lost = lost;
+    ent.retryafter = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(ent.cooldownms);
+}
+
+static void deviceLost(const string& udn)
+{
+    if (!o_enabled)
+        return;
+    std::unique_lock<std::mutex> lock(o_mutex);
+    DevHealthEntry& ent = o_devices[udn];
+    if (ent.state != DeviceHealth::TRIPPED) {
+        trip(udn, ent, true);
+    }
+}
+
+// An alive message only clears a trip caused by the device going
+// away. A device can still answer SSDP while its HTTP server is
+// stuck, failure-caused trips are cleared by a successful probe.
+static bool deviceSeen(const UPnPDeviceDesc& dev, const UPnPServiceDesc&)
+{
+    std::unique_lock<std::mutex> lock(o_mutex);
+    auto it = o_devices.find(dev.UDN);
+    if (it != o_devices.end() && it->second.lost) {
+        LOGDEB("DeviceHealth: " << dev.UDN << " is back" << endl);
+        o_devices.erase(it);
+    }
+    return true;
+}
+
+// Register our discovery callbacks. This does not start the discovery
+// if the application does not use it.
+static void initDiscoveryCallbacks()
+{
+    static std::once_flag once;
+    std::call_once(once, [] () {
+            UPnPDeviceDirectory::addCallback(deviceSeen);
+            UPnPDeviceDirectory::addLostCallback(deviceLost);
+        });
+}
+
+void DeviceHealth::setEnabled(bool onoff)
+{
+    std::unique_lock<std::mutex> lock(o_mutex);
+    o_enabled = onoff;
+    if (!onoff) {
+        o_devices.clear();
+    }
+}
+
+bool DeviceHealth::isEnabled()
+{
+    return o_enabled;
+}
+
+void DeviceHealth::setParams(int maxfailures, int maxtimeouts,
+                             int cooldownms, int maxcooldownms)
+{
+    std::unique_lock<std::mutex> lock(o_mutex);
+    o_maxfailures = std::max(maxfailures, 1);
+    o_maxtimeouts = std::max(maxtimeouts, 1);
+    o_cooldownms = std::max(cooldownms, 0);
+    o_maxcooldownms = std::max(maxcooldownms, o_cooldownms);
+}
+
+DeviceHealth::State DeviceHealth::getState(const string& udn)
+{
+    std::unique_lock<std::mutex> lock(o_mutex);
+    auto it = o_devices.find(udn);
+    if (it == o_devices.end())
+        return HEALTHY;
+    return it->second.state;
+}
+
+void DeviceHealth::reset(const string& udn)
+{
+    std::unique_lock<std::mutex> lock(o_mutex);
+    o_devices.erase(udn);
+}
+
+bool DeviceHealth::callAllowed(const string& udn, bool *isprobe)
+{
+    *isprobe = false;
+    if (!o_enabled)
+        return true;
+    initDiscoveryCallbacks();
+
+    std::unique_lock<std::mutex> lock(o_mutex);
+    auto it = o_devices.find(udn);
+    if (it == o_devices.end())
+        return true;
+    DevHealthEntry& ent = it->second;
+    switch (ent.state) {
+    case HEALTHY:
+        return true;
+    case PROBING:
+        // Only one probe at a time
+        return false;
+    case TRIPPED:
+    default:
+        if (std::chrono::steady_clock::now() < ent.retryafter) {
+            return false;
+        }
+        LOGDEB("DeviceHealth: probing " << udn << endl);
+        ent.state = PROBING;
+        *isprobe = true;
+        return true;
+    }
+}
+
+void DeviceHealth::callDone(const string& udn, int err, bool isprobe,
+                            bool callerdeadline)
+{
+    if (!o_enabled)
+        return;
+
+    std::unique_lock<std::mutex> lock(o_mutex);
+    if (isInconclusive(err, callerdeadline)) {
+        if (isprobe) {
+            // Let another call try.
+            auto it = o_devices.find(udn);
+            if (it != o_devices.end() && it->second.state == PROBING) {
+                it->second.state = TRIPPED;
+            }
+        }
+        return;
+    }
+    if (!isNetworkFailure(err)) {
+        // The device answered: forget the past failures.
+        auto it = o_devices.find(udn);
+        if (it != o_devices.end()) {
+            if (it->second.state != HEALTHY) {
+                LOGINF("DeviceHealth: " << udn << " is healthy again" << endl);
+            }
+            o_devices.erase(it);
+        }
+        return;
+    }
+
+    DevHealthEntry& ent = o_devices[udn];
+    auto now = std::chrono::steady_clock::now();
+    if (isprobe || ent.state == PROBING) {
+        trip(udn, ent, false);
+        return;
+    }
+    if (ent.state == TRIPPED) {
+        // Concurrent call started before the trip
+        return;
+    }
+    ent.consecutivefailures++;
+    if (isTimeout(err)) {
+        ent.timeouts.push_back(now);
+    }
+    while (!ent.timeouts.empty() && now - ent.timeouts.front() > timeoutWindow) {
+        ent.timeouts.pop_front();
+    }
+    if (ent.consecutivefailures >= o_maxfailures ||
+        int(ent.timeouts.size()) >= o_maxtimeouts) {
+        ent.consecutivefailures = 0;
+        ent.timeouts.clear();
+        trip(udn, ent, false);
+    }
+}
+
+} // namespace UPnPClient
@@ -0,0 +1,94 @@
+/* Copyright (C) 2006-2016 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+#ifndef _DEVICEHEALTH_HXX_INCLUDED_
+#define _DEVICEHEALTH_HXX_INCLUDED_
+
+#include "libupnpp/config.h"
+
+#include <string>
+
+namespace UPnPClient {
+
+/** Per-device circuit breaker for the action calls.
+ *
+ * When a device stops responding, each action call would otherwise
+ * wait for the full connection timeout. Service::runAction() reports
+ * the outcome of each call here, and the device is marked as tripped
+ * after a number of consecutive network failures, or a number of
+ * timeouts in a short period. Calls to a tripped device fail at once
+ * with UPNP_E_NETWORK_ERROR, without any network access.
+ *
+ * After a cooldown period, a single call is let through as a probe
+ * (the device is "probing"). If it succeeds the device is healthy
+ * again, else it is tripped for a longer period (the cooldown doubles
+ * up to a maximum).
+ *
+ * Discovery events feed the same state: a device which says byebye or
+ * expires from the directory is tripped immediately, and an alive
+ * message or search response clears this. An alive message does not
+ * clear a trip caused by call failures, because a device can still
+ * answer SSDP while its HTTP server is stuck: this needs a successful
+ * probe.
+ *
+ * Errors returned by the device itself (positive UPnP error codes) do
+ * not count as failures: the device is responding. Neither do the
+ * timeouts set by the caller (Service::setActionTimeout() or
+ * ActionScope), which may be shorter than what the device needs.
+ *
+ * The breaker is disabled by default.
+ */
+class DeviceHealth {
+public:
+    enum State {HEALTHY, TRIPPED, PROBING};
+
+    /** Enable or disable the circuit breaker. Disabling resets the
+     * state for all devices. */
+    static void setEnabled(bool onoff);
+    static bool isEnabled();
+
+    /** Set the trip thresholds and cooldown.
+     * @param maxfailures consecutive failures before tripping (default 3).
+     * @param maxtimeouts number of timeouts in the last minute before
+     *    tripping (default 2).
+     * @param cooldownms initial delay before a probe is allowed
+     *    (default 5000). 
+     * @param maxcooldownms maximum delay (default 60000).
+     */
+    static void setParams(int maxfailures, int maxtimeouts,
+                          int cooldownms, int maxcooldownms);
+
+    /** Return the current state for the device. Unknown devices are
+     * healthy. */
+    static State getState(const std::string& udn);
+
+    /** Forget anything we know about the device, making it healthy. */
+    static void reset(const std::string& udn);
+
+    /** Private: called by Service::runAction() before a call. Returns
+     * false if the call should fail fast, else sets *isprobe */
+    static bool callAllowed(const std::string& udn, bool *isprobe);
+    /** Private: called by Service::runAction() with the call
+     * result. callerdeadline is set if the call timed out because of
+     * the caller's deadline. */
+    static void callDone(const std::string& udn, int err, bool isprobe,
+                         bool callerdeadline = false);
+};
+
+} // namespace UPnPClient
+
+#endif /* _DEVICEHEALTH_HXX_INCLUDED_ */
@@ -255,6 +255,49 @@ void UPnPDeviceDirectory::delCallback(unsigned int idx)
     o_callbacks.erase(o_callbacks.begin() + idx);
 }
 
+// Client functions to be called when a device goes away.
+static vector<UPnPDeviceDirectory::LostCallback> o_lostcallbacks;
+static std::mutex o_lostcallbacks_mutex;
+
+unsigned int UPnPDeviceDirectory::addLostCallback(
+    UPnPDeviceDirectory::LostCallback v)
+{
+    std::unique_lock<std::mutex> lock(o_lostcallbacks_mutex);
+    o_lostcallbacks.push_back(v);
+    return o_lostcallbacks.size() - 1;
+}
+
+void UPnPDeviceDirectory::delLostCallback(unsigned int idx)
+{
+    std::unique_lock<std::mutex> lock(o_lostcallbacks_mutex);
+    if (idx >= o_lostcallbacks.size())
+        return;
+    o_lostcallbacks.erase(o_lostcallbacks.begin() + idx);
+}
+
+// Call the lost device callbacks. Must not be called with the pool
+// locked.
+static void reportLost(const vector<string>& udns)
+{
+    if (udns.empty())
+        return;
+    std::unique_lock<std::mutex> lock(o_lostcallbacks_mutex);
+    for (const auto& udn : udns) {
+        for (auto& cbp : o_lostcallbacks) {
+            cbp(udn);
+        }
+    }
+}
+
+// Append the UDNs for a device and its embedded devices
+static void deviceUDNs(const UPnPDeviceDesc& dev, vector<string>& udns)
+{
+    udns.push_back(dev.UDN);
+    for (const auto& emb : dev.embedded) {
+        udns.push_back(emb.UDN);
+    }
+}
+
 // Descriptor kept in the device pool for each device found on the network.
 class DeviceDescriptor {
 public:
@@ -300,13 +343,20 @@ static void *discoExplorer(void *)
 
         if (!tsk->alive) {
             // Device signals it is going off.
-            std::unique_lock<std::mutex> lock(o_pool.m_mutex);
-            auto it = o_pool.m_devices.find(tsk->deviceId);
-            if (it != o_pool.m_devices.end()) {
-                o_pool.m_devices.erase(it);
-                //LOGDEB("discoExplorer: delete " << tsk->deviceId.c_str() <<
-                // endl);
+            vector<string> lost;
+            {
+                std::unique_lock<std::mutex> lock(o_pool.m_mutex);
+                auto it = o_pool.m_devices.find(tsk->deviceId);
+                if (it != o_pool.m_devices.end()) {
+                    deviceUDNs(it->second.device, lost);
+                    o_pool.m_devices.erase(it);
+                    //LOGDEB("discoExplorer: delete " << tsk->deviceId <<
+                    // endl);
+                } else {
+                    lost.push_back(tsk->deviceId);
+                }
             }
+            reportLost(lost);
         } else {
             // Update or insert the device
             DeviceDescriptor d(tsk->url, tsk->description,
@@ -344,6 +394,7 @@ static void *discoExplorer(void *)
 static void expireDevices()
 {
     LOGDEB1("discovery: expireDevices:" << endl);
+    vector<string> lost;
     std::unique_lock<std::mutex> lock(o_pool.m_mutex);
     auto now = std::chrono::steady_clock::now();
     bool didsomething = false;
@@ -354,6 +405,7 @@ static void expireDevices()
         if (now - it->second.last_seen > it->second.expires) {
             LOGDEB1("expireDevices: deleting " <<  it->first.c_str() << " " <<
                     it->second.device.friendlyName.c_str() << endl);
+            deviceUDNs(it->second.device, lost);
             it = o_pool.m_devices.erase(it);
             didsomething = true;
         } else {
@@ -368,6 +420,8 @@ static void expireDevices()
         std::chrono::seconds(5)) {
         search();
     }
+    lock.unlock();
+    reportLost(lost);
 }
 
 // m_searchTimeout is the UPnP device search timeout, which should
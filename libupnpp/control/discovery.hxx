@@ -93,6 +93,20 @@ public:
     static unsigned int addCallback(Visitor v);
     static void delCallback(unsigned int idx);
 
+    /** Type of user callback functions used for reporting devices going
+     * away. The parameter is the device UDN. */
+    typedef std::function<void (const std::string&)> LostCallback;
+
+    /** Set a callback to be called when a device leaves the network
+     *  (byebye message) or is expired from the directory because it
+     *  was not seen for too long. This is called for the root device
+     *  and for each of its embedded devices. Calls are performed
+     *  from the discovery thread, or from the thread calling
+     *  traverse() for expiries.
+     */
+    static unsigned int addLostCallback(LostCallback v);
+    static void delLostCallback(unsigned int idx);
+
     /** Find device by 'friendly name'.
      *
      * This will wait for the remaining duration of the search window if the 
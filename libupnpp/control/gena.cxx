@@ -0,0 +1,789 @@
+/* Copyright (C) 2006-2016 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+#include "libupnpp/config.h"
+
+#include "libupnpp/control/gena.hxx"
+
+#include <expat.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+using namespace std;
+
+namespace UPnPClient {
+
+// Network timeout for both the listener and the subscription
+// requests (milliseconds)
+static const int genaTimeoutMs = 5000;
+// Sanity limits for the NOTIFY requests
+static const size_t maxHeaderSize = 16 * 1024;
+static const size_t maxBodySize = 4 * 1024 * 1024;
+
+// SAX decoder for propertyset documents:
+// <e:propertyset><e:property><varname>value</varname></e:property>...
+// The expat parser is reset and reused between documents.
+class PropSetDecoder {
+public:
+    ~PropSetDecoder() {
+        if (m_parser)
+            XML_ParserFree(m_parser);
+    }
+
+    bool decode(const char *data, size_t len,
+                std::unordered_map<string, string>& props) {
+        if (m_parser == nullptr) {
+            if ((m_parser = XML_ParserCreate(NULL)) == nullptr)
+                return false;
+        } else if (!XML_ParserReset(m_parser, NULL)) {
+            return false;
+        }
+        XML_SetUserData(m_parser, this);
+        XML_SetElementHandler(m_parser, startElement, endElement);
+        XML_SetCharacterDataHandler(m_parser, charData);
+        m_props = &props;
+        m_depth = 0;
+        bool ok = XML_Parse(m_parser, data, int(len), XML_TRUE) ==
+            XML_STATUS_OK;
+        if (!ok) {
+            LOGERR("GENA: bad propertyset: " <<
+                   XML_ErrorString(XML_GetErrorCode(m_parser)) << endl);
+        }
+        m_props = nullptr;
+        return ok;
+    }
+
+private:
+    // Depth of the variable elements. 1 is the propertyset, 2 the
+    // property.
+    static const int vardepth = 3;
+
+    static void startElement(void *ud, const XML_Char *name,
+                             const XML_Char **) {
+        PropSetDecoder *me = (PropSetDecoder *)ud;
+        if (++me->m_depth == vardepth) {
+            me->m_name = name;
+            me->m_value.clear();
+        }
+    }
+    static void endElement(void *ud, const XML_Char *) {
+        PropSetDecoder *me = (PropSetDecoder *)ud;
+        if (me->m_depth-- == vardepth) {
+            (*me->m_props)[me->m_name].swap(me->m_value);
+        }
+    }
+    static void charData(void *ud, const XML_Char *s, int len) {
+        PropSetDecoder *me = (PropSetDecoder *)ud;
+        if (me->m_depth == vardepth) {
+            me->m_value.append(s, len);
+        }
+    }
+
+    XML_Parser m_parser{nullptr};
+    std::unordered_map<string, string> *m_props{nullptr};
+    int m_depth{0};
+    string m_name;
+    string m_value;
+};
+
+bool genaDecodePropertySet(const char *data, size_t len,
+                           std::unordered_map<string, string>& props)
+{
+    static thread_local PropSetDecoder decoder;
+    return decoder.decode(data, len, props);
+}
+
+#ifndef WIN32
+
+// Find a header value in a raw header block (case-insensitive name).
+// The value is returned as a pointer into the block, not copied.
+static bool findHeader(const char *hdrs, size_t len, const char *name,
+                       const char **val, size_t *vlen)
+{
+    size_t nlen = strlen(name);
+    const char *end = hdrs + len;
+    const char *line = hdrs;
+    while (line < end) {
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        if (eol == nullptr)
+            eol = end;
+        if (size_t(eol - line) > nlen && line[nlen] == ':' &&
+            !strncasecmp(line, name, nlen)) {
+            const char *cp = line + nlen + 1;
+            const char *ep = eol;
+            while (cp < ep && (*cp == ' ' || *cp == '\t'))
+                cp++;
+            while (ep > cp && (ep[-1] == '\r' || ep[-1] == ' ' ||
+                               ep[-1] == '\t'))
+                ep--;
+            *val = cp;
+            *vlen = ep - cp;
+            return true;
+        }
+        line = eol + 1;
+    }
+    return false;
+}
+
+static bool valueIs(const char *val, size_t vlen, const char *s)
+{
+    return strlen(s) == vlen && !strncasecmp(val, s, vlen);
+}
+
+// TIMEOUT: Second-nnn or infinite
+static int parseTimeout(const char *val, size_t vlen, int dflt)
+{
+    if (vlen > 7 && !strncasecmp(val, "Second-", 7)) {
+        string s(val + 7, vlen - 7);
+        if (s == "infinite")
+            return dflt;
+        int secs = atoi(s.c_str());
+        return secs > 0 ? secs : dflt;
+    }
+    return dflt;
+}
+
+// Wait for the socket to be ready. Returns false on timeout or error.
+static bool waitFd(int fd, short events, int ms)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    for (;;) {
+        int ret = poll(&pfd, 1, ms);
+        if (ret > 0)
+            return true;
+        if (ret < 0 && errno == EINTR)
+            continue;
+        return false;
+    }
+}
+
+static bool sendAll(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        if (!waitFd(fd, POLLOUT, genaTimeoutMs))
+            return false;
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Read some more data. Returns the byte count, 0 for EOF, -1 for error
+// or timeout.
+static ssize_t readSome(int fd, vector<char>& buf, size_t& have)
+{
+    if (buf.size() - have < 4096)
+        buf.resize(buf.size() + 8192);
+    if (!waitFd(fd, POLLIN, genaTimeoutMs))
+        return -1;
+    ssize_t n;
+    do {
+        n = recv(fd, &buf[have], buf.size() - have, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0)
+        have += n;
+    return n;
+}
+
+// Read until the end of the headers. Returns the header block length
+// (including the empty line) or 0.
+static size_t readHeaders(int fd, vector<char>& buf, size_t& have)
+{
+    for (;;) {
+        if (have >= 4) {
+            for (size_t i = 3; i < have; i++) {
+                if (buf[i] == '\n' && buf[i-1] == '\r' && buf[i-2] == '\n' &&
+                    buf[i-3] == '\r')
+                    return i + 1;
+            }
+        }
+        if (have > maxHeaderSize)
+            return 0;
+        if (readSome(fd, buf, have) <= 0)
+            return 0;
+    }
+}
+
+static void setNonBlock(int fd, bool onoff)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return;
+    flags = onoff ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    fcntl(fd, F_SETFL, flags);
+}
+
+// A connection being received. The devices use one connection per
+// event: we read the request, respond, and close. All the
+// connections are non-blocking and served by the poll loop, so that a
+// slow sender does not delay the others.
+class GenaConn {
+public:
+    int fd{-1};
+    vector<char> buf;
+    size_t have{0};
+    size_t scanned{0};   // Searched for the end of headers up to there
+    size_t hlen{0};      // Header block length, 0 until complete
+    size_t in{0};        // Chunked body: next chunk size line
+    size_t out{0};       // Chunked body: end of decoded data
+    std::chrono::steady_clock::time_point deadline;
+};
+
+// Max simultaneous connections. Beyond this, the new ones wait in
+// the listen backlog.
+static const size_t maxConns = 256;
+
+class GenaListener::Internal {
+public:
+    Handler handler;
+    int lfd{-1};
+    // Used to wake up the listener thread for stopping
+    int wakefds[2]{-1, -1};
+    int port{0};
+    std::thread thr;
+    vector<GenaConn> conns;
+    PropSetDecoder decoder;
+
+    void run();
+    void accepted(int fd);
+    // Receive data for the connection and process it. Returns false
+    // when it should be closed.
+    bool receive(GenaConn& c);
+    enum ProcStatus {PROC_MORE, PROC_DONE};
+    ProcStatus process(GenaConn& c);
+    bool bodyComplete(GenaConn& c, const char **body, size_t *blen,
+                      ProcStatus *st);
+    void respond(GenaConn& c, const char *status) {
+        // Small response on a fresh connection: the socket buffer has
+        // room, we don't wait.
+        string rsp = string("HTTP/1.1 ") + status +
+            "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        if (send(c.fd, rsp.c_str(), rsp.size(), MSG_NOSIGNAL) !=
+            ssize_t(rsp.size())) {
+            LOGDEB("GenaListener: could not send response" << endl);
+        }
+    }
+    void closeConns() {
+        for (auto& c : conns)
+            close(c.fd);
+        conns.clear();
+    }
+    void closeAll() {
+        closeConns();
+        if (lfd >= 0)
+            close(lfd);
+        for (int i = 0; i < 2; i++) {
+            if (wakefds[i] >= 0)
+                close(wakefds[i]);
+            wakefds[i] = -1;
+        }
+        lfd = -1;
+    }
+};
+
+void GenaListener::Internal::run()
+{
+    vector<struct pollfd> pfds;
+    for (;;) {
+        // Listen and wake fds, then the connections, in order
+        pfds.resize(2 + conns.size());
+        pfds[0].fd = conns.size() < maxConns ? lfd : -1;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = wakefds[0];
+        pfds[1].events = POLLIN;
+        auto now = std::chrono::steady_clock::now();
+        int timeout = -1;
+        for (size_t i = 0; i < conns.size(); i++) {
+            pfds[i+2].fd = conns[i].fd;
+            pfds[i+2].events = POLLIN;
+            int ms = int(std::chrono::duration_cast<std::chrono::milliseconds>(
+                             conns[i].deadline - now).count());
+            ms = ms < 0 ? 0 : ms + 1;
+            if (timeout < 0 || ms < timeout)
+                timeout = ms;
+        }
+        int ret = poll(&pfds[0], pfds.size(), timeout);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGERR("GenaListener: poll failed, errno " << errno << endl);
+            return;
+        }
+        if (pfds[1].revents) {
+            return;
+        }
+        // Serve the connections, and drop the finished or expired ones
+        now = std::chrono::steady_clock::now();
+        size_t j = 0;
+        for (size_t i = 0; i < conns.size(); i++) {
+            bool keep;
+            if (pfds[i+2].revents) {
+                keep = receive(conns[i]);
+            } else {
+                keep = now < conns[i].deadline;
+                if (!keep) {
+                    LOGDEB("GenaListener: request timed out" << endl);
+                }
+            }
+            if (!keep) {
+                close(conns[i].fd);
+            } else {
+                if (j != i)
+                    conns[j] = std::move(conns[i]);
+                j++;
+            }
+        }
+        conns.resize(j);
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept(lfd, nullptr, nullptr);
+            if (fd >= 0)
+                accepted(fd);
+        }
+    }
+}
+
+void GenaListener::Internal::accepted(int fd)
+{
+    setNonBlock(fd, true);
+    GenaConn c;
+    c.fd = fd;
+    c.deadline = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(genaTimeoutMs);
+    conns.push_back(std::move(c));
+}
+
+bool GenaListener::Internal::receive(GenaConn& c)
+{
+    if (c.buf.size() - c.have < 4096)
+        c.buf.resize(c.buf.size() + 8192);
+    ssize_t n;
+    do {
+        n = recv(c.fd, &c.buf[c.have], c.buf.size() - c.have, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return true;
+    if (n <= 0) {
+        LOGDEB("GenaListener: connection closed before complete request" <<
+               endl);
+        return false;
+    }
+    c.have += n;
+    return process(c) == PROC_MORE;
+}
+
+// Check if the body is complete, possibly decoding the chunks
+// received so far. *st is set to PROC_DONE if we responded with an
+// error.
+bool GenaListener::Internal::bodyComplete(
+    GenaConn& c, const char **body, size_t *blen, ProcStatus *st)
+{
+    *st = PROC_MORE;
+    const char *hdrs = &c.buf[0];
+    const char *val;
+    size_t vlen;
+    if (findHeader(hdrs, c.hlen, "CONTENT-LENGTH", &val, &vlen)) {
+        size_t clen = size_t(atol(string(val, vlen).c_str()));
+        if (clen > maxBodySize) {
+            respond(c, "413 Request Entity Too Large");
+            *st = PROC_DONE;
+            return false;
+        }
+        if (c.have < c.hlen + clen)
+            return false;
+        *body = &c.buf[c.hlen];
+        *blen = clen;
+        return true;
+    } else if (findHeader(hdrs, c.hlen, "TRANSFER-ENCODING", &val, &vlen) &&
+               valueIs(val, vlen, "chunked")) {
+        // Decode the complete chunks in place, to the start of the
+        // body area. Resumes where the previous call stopped.
+        if (c.in == 0)
+            c.in = c.out = c.hlen;
+        for (;;) {
+            if (c.have - c.hlen > maxBodySize) {
+                respond(c, "413 Request Entity Too Large");
+                *st = PROC_DONE;
+                return false;
+            }
+            const char *cp = (const char *)memchr(c.buf.data() + c.in, '\n',
+                                                  c.have - c.in);
+            if (cp == nullptr)
+                return false;
+            size_t eol = cp - c.buf.data();
+            size_t csize = strtoul(c.buf.data() + c.in, nullptr, 16);
+            if (csize == 0)
+                break;
+            if (csize > maxBodySize) {
+                respond(c, "413 Request Entity Too Large");
+                *st = PROC_DONE;
+                return false;
+            }
+            if (c.have < eol + 1 + csize + 2)
+                return false;
+            memmove(&c.buf[c.out], &c.buf[eol + 1], csize);
+            c.out += csize;
+            c.in = eol + 1 + csize + 2;
+        }
+        *body = &c.buf[c.hlen];
+        *blen = c.out - c.hlen;
+        return true;
+    }
+    respond(c, "411 Length Required");
+    *st = PROC_DONE;
+    return false;
+}
+
+GenaListener::Internal::ProcStatus
+GenaListener::Internal::process(GenaConn& c)
+{
+    if (c.hlen == 0) {
+        size_t i = c.scanned < 3 ? 3 : c.scanned;
+        for (; i < c.have; i++) {
+            if (c.buf[i] == '\n' && c.buf[i-1] == '\r' &&
+                c.buf[i-2] == '\n' && c.buf[i-3] == '\r') {
+                c.hlen = i + 1;
+                break;
+            }
+        }
+        c.scanned = i;
+        if (c.hlen == 0) {
+            if (c.have > maxHeaderSize) {
+                LOGDEB("GenaListener: request headers too big" << endl);
+                return PROC_DONE;
+            }
+            return PROC_MORE;
+        }
+    }
+
+    const char *hdrs = &c.buf[0];
+    if (c.hlen < 7 || strncmp(hdrs, "NOTIFY ", 7)) {
+        respond(c, "405 Method Not Allowed");
+        return PROC_DONE;
+    }
+    const char *val;
+    size_t vlen;
+    if (!findHeader(hdrs, c.hlen, "NT", &val, &vlen) ||
+        !valueIs(val, vlen, "upnp:event") ||
+        !findHeader(hdrs, c.hlen, "NTS", &val, &vlen) ||
+        !valueIs(val, vlen, "upnp:propchange") ||
+        !findHeader(hdrs, c.hlen, "SID", &val, &vlen)) {
+        respond(c, "412 Precondition Failed");
+        return PROC_DONE;
+    }
+    string sid(val, vlen);
+
+    const char *body;
+    size_t blen;
+    ProcStatus st;
+    if (!bodyComplete(c, &body, &blen, &st))
+        return st;
+
+    int seq = 0;
+    if (findHeader(hdrs, c.hlen, "SEQ", &val, &vlen)) {
+        seq = atoi(string(val, vlen).c_str());
+    }
+    std::unordered_map<string, string> props;
+    if (!decoder.decode(body, blen, props)) {
+        respond(c, "400 Bad Request");
+        return PROC_DONE;
+    }
+    bool known = handler(sid, seq, std::move(props));
+    respond(c, known ? "200 OK" : "412 Precondition Failed");
+    return PROC_DONE;
+}
+
+GenaListener::GenaListener(Handler handler)
+{
+    if ((m = new Internal()) == 0) {
+        LOGERR("GenaListener: out of memory" << endl);
+        return;
+    }
+    m->handler = handler;
+}
+
+GenaListener::~GenaListener()
+{
+    stop();
+    delete m;
+}
+
+bool GenaListener::start(const string& ip, int port)
+{
+    if (m == nullptr || m->lfd >= 0)
+        return false;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (ip.empty()) {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    } else if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1) {
+        LOGERR("GenaListener: bad address " << ip << endl);
+        return false;
+    }
+    if ((m->lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        pipe(m->wakefds) < 0) {
+        LOGERR("GenaListener: socket/pipe failed, errno " << errno << endl);
+        m->closeAll();
+        return false;
+    }
+    int one = 1;
+    setsockopt(m->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    socklen_t alen = sizeof(addr);
+    if (bind(m->lfd, (struct sockaddr *)&addr, alen) < 0 ||
+        listen(m->lfd, 128) < 0 ||
+        getsockname(m->lfd, (struct sockaddr *)&addr, &alen) < 0) {
+        LOGERR("GenaListener: bind/listen failed for " << ip << ":" << port <<
+               " errno " << errno << endl);
+        m->closeAll();
+        return false;
+    }
+    m->port = ntohs(addr.sin_port);
+    m->thr = std::thread(&Internal::run, m);
+    LOGDEB("GenaListener: listening on port " << m->port << endl);
+    return true;
+}
+
+void GenaListener::stop()
+{
+    if (m == nullptr || m->lfd < 0)
+        return;
+    if (m->thr.joinable()) {
+        char c = 0;
+        if (write(m->wakefds[1], &c, 1) != 1) {
+            LOGERR("GenaListener: can't wake up thread" << endl);
+        }
+        m->thr.join();
+    }
+    m->closeAll();
+}
+
+int GenaListener::port() const
+{
+    return m ? m->port : 0;
+}
+
+// Split http://host:port/path
+static bool parseURL(const string& url, string& host, string& port,
+                     string& path)
+{
+    if (url.compare(0, 7, "http://"))
+        return false;
+    string::size_type slash = url.find('/', 7);
+    string hostport = url.substr(7, slash == string::npos ?
+                                 string::npos : slash - 7);
+    path = slash == string::npos ? "/" : url.substr(slash);
+    string::size_type colon = hostport.rfind(':');
+    string::size_type bracket = hostport.rfind(']');
+    if (colon != string::npos &&
+        (bracket == string::npos || colon > bracket)) {
+        host = hostport.substr(0, colon);
+        port = hostport.substr(colon + 1);
+    } else {
+        host = hostport;
+        port = "80";
+    }
+    if (!host.empty() && host[0] == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+    return !host.empty();
+}
+
+static int connectTo(const string& host, const string& port)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) {
+        LOGERR("GENA: can't resolve " << host << endl);
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != nullptr; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype,
+                         ai->ai_protocol)) < 0)
+            continue;
+        setNonBlock(fd, true);
+        int ret = connect(fd, ai->ai_addr, ai->ai_addrlen);
+        if (ret < 0 && errno == EINPROGRESS && waitFd(fd, POLLOUT,
+                                                      genaTimeoutMs)) {
+            int err = 0;
+            socklen_t elen = sizeof(err);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &elen);
+            ret = err ? -1 : 0;
+        }
+        if (ret == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Perform a GENA request and return the status and response headers.
+static bool genaRequest(const string& eventURL, const char *method,
+                        const string& hdrs, int *status, string& rsphdrs)
+{
+    string host, port, path;
+    if (!parseURL(eventURL, host, port, path)) {
+        LOGERR("GENA: bad event URL " << eventURL << endl);
+        return false;
+    }
+    int fd = connectTo(host, port);
+    if (fd < 0) {
+        LOGERR("GENA: can't connect to " << eventURL << endl);
+        return false;
+    }
+    string rq = string(method) + " " + path + " HTTP/1.1\r\n"
+        "HOST: " + (host.find(':') != string::npos ? "[" + host + "]" : host) +
+        ":" + port + "\r\n" + hdrs + "Connection: close\r\n\r\n";
+    vector<char> buf;
+    size_t have = 0, hlen = 0;
+    if (sendAll(fd, rq.c_str(), rq.size())) {
+        hlen = readHeaders(fd, buf, have);
+    }
+    close(fd);
+    if (hlen < 12 || strncmp(&buf[0], "HTTP/1.", 7)) {
+        LOGERR("GENA: " << method << " " << eventURL << ": no response" <<
+               endl);
+        return false;
+    }
+    *status = atoi(&buf[9]);
+    rsphdrs.assign(&buf[0], hlen);
+    return true;
+}
+
+bool genaSubscribe(const string& eventURL, const string& callbackURL,
+                   string& sid, int *timeoutsecs)
+{
+    string hdrs = "CALLBACK: <" + callbackURL + ">\r\n"
+        "NT: upnp:event\r\n"
+        "TIMEOUT: Second-" + std::to_string(*timeoutsecs) + "\r\n";
+    int status;
+    string rsp;
+    if (!genaRequest(eventURL, "SUBSCRIBE", hdrs, &status, rsp))
+        return false;
+    const char *val;
+    size_t vlen;
+    if (status != 200 ||
+        !findHeader(rsp.c_str(), rsp.size(), "SID", &val, &vlen)) {
+        LOGERR("GENA: SUBSCRIBE " << eventURL << " failed, status " <<
+               status << endl);
+        return false;
+    }
+    sid.assign(val, vlen);
+    if (findHeader(rsp.c_str(), rsp.size(), "TIMEOUT", &val, &vlen)) {
+        *timeoutsecs = parseTimeout(val, vlen, *timeoutsecs);
+    }
+    return true;
+}
+
+bool genaRenew(const string& eventURL, const string& sid, int *timeoutsecs)
+{
+    string hdrs = "SID: " + sid + "\r\n"
+        "TIMEOUT: Second-" + std::to_string(*timeoutsecs) + "\r\n";
+    int status;
+    string rsp;
+    if (!genaRequest(eventURL, "SUBSCRIBE", hdrs, &status, rsp))
+        return false;
+    if (status != 200) {
+        LOGINF("GENA: renewal for " << eventURL << " failed, status " <<
+               status << endl);
+        return false;
+    }
+    const char *val;
+    size_t vlen;
+    if (findHeader(rsp.c_str(), rsp.size(), "TIMEOUT", &val, &vlen)) {
+        *timeoutsecs = parseTimeout(val, vlen, *timeoutsecs);
+    }
+    return true;
+}
+
+bool genaUnSubscribe(const string& eventURL, const string& sid)
+{
+    int status;
+    string rsp;
+    if (!genaRequest(eventURL, "UNSUBSCRIBE", "SID: " + sid + "\r\n",
+                     &status, rsp))
+        return false;
+    return status == 200;
+}
+
+#else /* WIN32 -> */
+
+class GenaListener::Internal {
+};
+GenaListener::GenaListener(Handler) {}
+GenaListener::~GenaListener() {}
+bool GenaListener::start(const string&, int)
+{
+    LOGERR("GenaListener: not supported on this platform" << endl);
+    return false;
+}
+void GenaListener::stop() {}
+int GenaListener::port() const {return 0;}
+bool genaSubscribe(const string&, const string&, string&, int *)
+{
+    return false;
+}
+bool genaRenew(const string&, const string&, int *)
+{
+    return false;
+}
+bool genaUnSubscribe(const string&, const string&)
+{
+    return false;
+}
+
+#endif /* WIN32 */
+
+} // namespace UPnPClient
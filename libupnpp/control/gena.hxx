@@ -0,0 +1,99 @@
+/* Copyright (C) 2006-2016 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+#ifndef _GENA_HXX_INCLUDED_
+#define _GENA_HXX_INCLUDED_
+
+#include "libupnpp/config.h"
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+namespace UPnPClient {
+
+/** Private: native GENA eventing, bypassing libupnp.
+ *
+ * libupnp parses each event body into an IXML DOM, which we then walk
+ * again. With thousands of subscriptions this dominates the CPU
+ * usage. The GenaListener is a minimal HTTP server which only accepts
+ * NOTIFY requests: the headers are parsed in place in the receive
+ * buffer, and the property set is decoded by a SAX parser. The
+ * subscription requests (SUBSCRIBE, renewal, UNSUBSCRIBE) are then
+ * also performed by us, with the listener address as CALLBACK.
+ *
+ * This has no libupnp dependency, and can be exercised on the
+ * loopback interface with a simple sender. Not available on Windows.
+ */
+class GenaListener {
+public:
+    /** Called from the listener thread for each event.
+     * @param sid subscription identifier from the SID header.
+     * @param seq event sequence number (SEQ header).
+     * @param props decoded state variables.
+     * @return false if the SID is unknown (the device gets a 412
+     *   status and should stop sending).
+     */
+    typedef std::function<bool(const std::string& sid, int seq,
+                               std::unordered_map<std::string,
+                               std::string>&& props)> Handler;
+
+    GenaListener(Handler handler);
+    ~GenaListener();
+
+    /** Start listening.
+     * @param ip local address to bind, empty for any.
+     * @param port 0 to let the system choose.
+     */
+    bool start(const std::string& ip, int port);
+    void stop();
+    /** Actual port, after start() */
+    int port() const;
+
+    class Internal;
+private:
+    GenaListener(const GenaListener&);
+    GenaListener& operator=(const GenaListener&);
+    Internal *m{nullptr};
+};
+
+/** Decode a propertyset document from the NOTIFY body. */
+extern bool genaDecodePropertySet(
+    const char *data, size_t len,
+    std::unordered_map<std::string, std::string>& props);
+
+/** Send a SUBSCRIBE request.
+ * @param eventURL the service event URL.
+ * @param callbackURL where the device will send the events.
+ * @param[out] sid subscription identifier.
+ * @param[in,out] timeoutsecs requested, then granted duration.
+ */
+extern bool genaSubscribe(const std::string& eventURL,
+                          const std::string& callbackURL,
+                          std::string& sid, int *timeoutsecs);
+
+/** Renew an existing subscription. */
+extern bool genaRenew(const std::string& eventURL, const std::string& sid,
+                      int *timeoutsecs);
+
+/** Cancel a subscription. */
+extern bool genaUnSubscribe(const std::string& eventURL,
+                            const std::string& sid);
+
+} // namespace UPnPClient
+
+#endif /* _GENA_HXX_INCLUDED_ */
@@ -92,7 +92,7 @@ int OHInfo::metatext(UPnPDirObject *dirent)
         return ret;
     }
     string didl;
-    if (!data.get("Value", &didl)) {
+    if (!data.take("Value", &didl)) {
         LOGERR("OHInfo::Read: missing Value in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
@@ -18,19 +18,19 @@
 #include "libupnpp/control/ohplaylist.hxx"
 
 #include <stdlib.h>                     // for atoi
-#include <string.h>                     // for strcmp
 #include <upnp/upnp.h>                  // for UPNP_E_BAD_RESPONSE, etc
 
 #include <functional>                   // for _Bind, bind, _1
 #include <ostream>                      // for endl, basic_ostream, etc
 #include <string>                       // for string, basic_string, etc
+#include <unordered_map>
 #include <utility>                      // for pair
 #include <vector>                       // for vector
 
 #include "libupnpp/upnpavutils.hxx"
 #include "libupnpp/control/cdircontent.hxx"  // for UPnPDirContent, etc
+#include "libupnpp/control/ohtracklist.hxx"  // for ohDecodeTrackList
 #include "libupnpp/control/service.hxx"  // for VarEventReporter, Service
-#include "libupnpp/expatmm.hxx"         // for inputRefXMLParser
 #include "libupnpp/log.hxx"             // for LOGERR, LOGDEB1, LOGINF
 #include "libupnpp/soaphelp.hxx"        // for SoapIncoming, etc
 #include "libupnpp/upnpp_p.hxx"         // for stringToBool
@@ -74,48 +74,74 @@ int OHPlaylist::stringToTpState(const string& value, OHPlaylist::TPState *tpp)
     return UPNP_E_BAD_RESPONSE;
 }
 
+// How each Playlist variable is decoded before calling the reporter.
+// IdArray is a base64 array, and is expanded to a vector of ids.
+enum OHPLEvtKind {OHPLEVT_UNKNOWN, OHPLEVT_TPSTATE, OHPLEVT_STRING,
+                  OHPLEVT_BOOL, OHPLEVT_INT, OHPLEVT_IDARRAY};
+
+static OHPLEvtKind ohplEvtKind(const string& nm)
+{
+    static const std::unordered_map<string, OHPLEvtKind> kinds {
+        {"TransportState", OHPLEVT_TPSTATE},
+        {"ProtocolInfo", OHPLEVT_STRING},
+        {"Repeat", OHPLEVT_BOOL},
+        {"Shuffle", OHPLEVT_BOOL},
+        {"Id", OHPLEVT_INT},
+        {"TracksMax", OHPLEVT_INT},
+        {"IdArray", OHPLEVT_IDARRAY},
+    };
+    auto it = kinds.find(nm);
+    return it == kinds.end() ? OHPLEVT_UNKNOWN : it->second;
+}
+
 void OHPlaylist::evtCallback(
     const std::unordered_map<std::string, std::string>& props)
 {
     LOGDEB1("OHPlaylist::evtCallback: getReporter(): " << getReporter() << endl);
+    VarEventReporter *reporter = getReporter();
     for (std::unordered_map<std::string, std::string>::const_iterator it =
                 props.begin(); it != props.end(); it++) {
-        if (!getReporter()) {
+        if (!reporter) {
             LOGDEB1("OHPlaylist::evtCallback: " << it->first << " -> "
                     << it->second << endl);
             continue;
         }
 
-        if (!it->first.compare("TransportState")) {
+        const char *nm = it->first.c_str();
+        switch (ohplEvtKind(it->first)) {
+        case OHPLEVT_TPSTATE:
+        {
             TPState tp;
             stringToTpState(it->second, &tp);
-            getReporter()->changed(it->first.c_str(), int(tp));
-
-        } else if (!it->first.compare("ProtocolInfo")) {
-            getReporter()->changed(it->first.c_str(),
-                                   it->second.c_str());
-
-        } else if (!it->first.compare("Repeat") ||
-                   !it->first.compare("Shuffle")) {
+            reporter->changed(nm, int(tp));
+            break;
+        }
+        case OHPLEVT_STRING:
+            reporter->changed(nm, it->second.c_str());
+            break;
+        case OHPLEVT_BOOL:
+        {
             bool val = false;
             stringToBool(it->second, &val);
-            getReporter()->changed(it->first.c_str(), val ? 1 : 0);
-
-        } else if (!it->first.compare("Id") ||
-                   !it->first.compare("TracksMax")) {
-            getReporter()->changed(it->first.c_str(),
-                                   atoi(it->second.c_str()));
-
-        } else if (!it->first.compare("IdArray")) {
+            reporter->changed(nm, val ? 1 : 0);
+            break;
+        }
+        case OHPLEVT_INT:
+            reporter->changed(nm, atoi(it->second.c_str()));
+            break;
+        case OHPLEVT_IDARRAY:
+        {
             // Decode IdArray. See how we call the client
             vector<int> v;
             ohplIdArrayToVec(it->second, &v);
-            getReporter()->changed(it->first.c_str(), v);
-
-        } else {
+            reporter->changed(nm, v);
+            break;
+        }
+        case OHPLEVT_UNKNOWN:
             LOGERR("OHPlaylist event: unknown variable: name [" <<
                    it->first << "] value [" << it->second << endl);
-            getReporter()->changed(it->first.c_str(), it->second.c_str());
+            reporter->changed(nm, it->second.c_str());
+            break;
         }
     }
 }
@@ -127,23 +153,33 @@ void OHPlaylist::registerCallback()
 
 int OHPlaylist::play()
 {
-    return runTrivialAction("Play");
+    int ret = runTrivialAction("Play");
+    mirrorInvalidate("TransportState");
+    return ret;
 }
 int OHPlaylist::pause()
 {
-    return runTrivialAction("Pause");
+    int ret = runTrivialAction("Pause");
+    mirrorInvalidate("TransportState");
+    return ret;
 }
 int OHPlaylist::stop()
 {
-    return runTrivialAction("Stop");
+    int ret = runTrivialAction("Stop");
+    mirrorInvalidate("TransportState");
+    return ret;
 }
 int OHPlaylist::next()
 {
-    return runTrivialAction("Next");
+    int ret = runTrivialAction("Next");
+    mirrorInvalidate("TransportState");
+    return ret;
 }
 int OHPlaylist::previous()
 {
-    return runTrivialAction("Previous");
+    int ret = runTrivialAction("Previous");
+    mirrorInvalidate("TransportState");
+    return ret;
 }
 int OHPlaylist::setRepeat(bool onoff)
 {
@@ -171,19 +207,24 @@ int OHPlaylist::seekSecondRelative(int value)
 }
 int OHPlaylist::seekId(int value)
 {
-    return runSimpleAction("SeekId", "Value", value);
+    int ret = runSimpleAction("SeekId", "Value", value);
+    mirrorInvalidate("TransportState");
+    return ret;
 }
 int OHPlaylist::seekIndex(int value)
 {
-    return runSimpleAction("SeekIndex", "Value", value);
+    int ret = runSimpleAction("SeekIndex", "Value", value);
+    mirrorInvalidate("TransportState");
+    return ret;
 }
 
-int OHPlaylist::transportState(TPState* tpp)
+int OHPlaylist::transportState(TPState* tpp, bool fromnet)
 {
     string value;
     int ret;
 
-    if ((ret = runSimpleGet("TransportState", "Value", &value)))
+    if ((ret = runMirroredGet("TransportState", "Value", "TransportState",
+                              &value, fromnet)))
         return ret;
 
     return stringToTpState(value, tpp);
@@ -197,7 +238,7 @@ int OHPlaylist::id(int *value)
 int OHPlaylist::read(int id, std::string* urip, UPnPDirObject *dirent)
 {
     SoapOutgoing args(getServiceType(), "Read");
-    args("Id", SoapHelp::i2s(id));
+    args("Id", id);
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
@@ -208,7 +249,7 @@ int OHPlaylist::read(int id, std::string* urip, UPnPDirObject *dirent)
         return UPNP_E_BAD_RESPONSE;
     }
     string didl;
-    if (!data.get("Metadata", &didl)) {
+    if (!data.take("Metadata", &didl)) {
         LOGERR("OHPlaylist::Read: missing Uri in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
@@ -228,91 +269,29 @@ int OHPlaylist::read(int id, std::string* urip, UPnPDirObject *dirent)
     return 0;
 }
 
-// Tracklist format
-// <TrackList>
-//   <Entry>
-//     <Id>10</Id>
-//     <Uri>http://blabla</Uri>
-//     <Metadata>(xmlencoded didl)</Metadata>
-//   </Entry>
-// </TrackList>
-
-
-class OHTrackListParser : public inputRefXMLParser {
-public:
-    OHTrackListParser(const string& input,
-                      vector<OHPlaylist::TrackListEntry>* vp)
-        : inputRefXMLParser(input), m_v(vp)
-    {
-        //LOGDEB("OHTrackListParser: input: " << input << endl);
-    }
-
-protected:
-    virtual void StartElement(const XML_Char *name, const XML_Char **) {
-        m_path.push_back(name);
-    }
-    virtual void EndElement(const XML_Char *name) {
-        if (!strcmp(name, "Entry")) {
-            UPnPDirContent dir;
-            if (!dir.parse(m_tdidl)) {
-                LOGERR("OHPlaylist::ReadList: didl parse failed: "
-                       << m_tdidl << endl);
-                return;
-            }
-            if (dir.m_items.size() != 1) {
-                LOGERR("OHPlaylist::ReadList: " << dir.m_items.size()
-                       << " in response!" << endl);
-                return;
-            }
-            m_tt.dirent = dir.m_items[0];
-            m_v->push_back(m_tt);
-            m_tt.clear();
-            m_tdidl.clear();
-        }
-        m_path.pop_back();
-    }
-    virtual void CharacterData(const XML_Char *s, int len) {
-        if (s == 0 || *s == 0)
-            return;
-        string str(s, len);
-        if (!m_path.back().compare("Id"))
-            m_tt.id = atoi(str.c_str());
-        else if (!m_path.back().compare("Uri"))
-            m_tt.url = str;
-        else if (!m_path.back().compare("Metadata"))
-            m_tdidl += str;
-    }
-
-private:
-    vector<OHPlaylist::TrackListEntry>* m_v;
-    std::vector<std::string> m_path;
-    OHPlaylist::TrackListEntry m_tt;
-    string m_tdidl;
-};
-
 int OHPlaylist::readList(const std::vector<int>& ids,
                          vector<TrackListEntry>* entsp)
 {
     string idsparam;
     for (vector<int>::const_iterator it = ids.begin(); it != ids.end(); it++) {
-        idsparam += SoapHelp::i2s(*it) + " ";
+        idsparam += SoapHelp::i2s(*it);
+        idsparam += ' ';
     }
     entsp->clear();
 
     SoapOutgoing args(getServiceType(), "ReadList");
-    args("IdList", idsparam);
+    args("IdList", std::move(idsparam));
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
         return ret;
     }
     string xml;
-    if (!data.get("TrackList", &xml)) {
+    if (!data.take("TrackList", &xml)) {
         LOGERR("OHPlaylist::readlist: missing TrackList in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
-    OHTrackListParser mparser(xml, entsp);
-    if (!mparser.Parse())
+    if (!ohDecodeTrackList(xml, entsp, "OHPlaylist"))
         return UPNP_E_BAD_RESPONSE;
     return 0;
 }
@@ -321,7 +300,7 @@ int OHPlaylist::insert(int afterid, const string& uri, const string& didl,
                        int *nid)
 {
     SoapOutgoing args(getServiceType(), "Insert");
-    args("AfterId", SoapHelp::i2s(afterid))
+    args("AfterId", afterid)
     ("Uri", uri)
     ("Metadata", didl);
     SoapIncoming data;
@@ -347,7 +326,9 @@ int OHPlaylist::deleteId(int value)
 }
 int OHPlaylist::deleteAll()
 {
-    return runTrivialAction("DeleteAll");
+    int ret = runTrivialAction("DeleteAll");
+    mirrorInvalidate("TransportState");
+    return ret;
 }
 int OHPlaylist::tracksMax(int *valuep)
 {
@@ -371,7 +352,7 @@ int OHPlaylist::idArray(vector<int> *ids, int *tokp)
         *tokp = ltok;
     }
     string arraydata;
-    if (!data.get("Array", &arraydata)) {
+    if (!data.take("Array", &arraydata)) {
         LOGINF("OHPlaylist::idArray: missing Array in response" << endl);
         // We get this for an empty array ? This would need to be investigated
     }
@@ -382,7 +363,7 @@ int OHPlaylist::idArray(vector<int> *ids, int *tokp)
 int OHPlaylist::idArrayChanged(int token, bool *changed)
 {
     SoapOutgoing args(getServiceType(), "IdArrayChanged");
-    args("Token", SoapHelp::i2s(token));
+    args("Token", token);
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
@@ -69,7 +69,9 @@ public:
     enum TPState {TPS_Unknown, TPS_Buffering, TPS_Paused, TPS_Playing,
                   TPS_Stopped
                  };
-    int transportState(TPState *tps);
+    /** Get the transport state. This may be answered from the state
+     * mirror (see Service::setStateMirror()), unless fromnet is set. */
+    int transportState(TPState *tps, bool fromnet = false);
     int id(int *value);
     int read(int id, std::string* uri, UPnPDirObject *dirent);
 
@@ -22,6 +22,7 @@
 #include <upnp/upnp.h>                  // for UPNP_E_BAD_RESPONSE, etc
 #include <ostream>                      // for endl
 #include <string>                       // for string
+#include <unordered_map>
 #include <vector>                       // for vector
 
 #include "libupnpp/expatmm.hxx"         // for inputRefXMLParser
@@ -112,27 +113,49 @@ bool OHProduct::serviceTypeMatch(const std::string& tp)
 }
 
 
+// Product variables which get a typed value. Anything else (e.g.
+// SourceXml) goes to the reporter as a string.
+enum OHPREvtKind {OHPREVT_UNKNOWN, OHPREVT_INT, OHPREVT_BOOL};
+
+static OHPREvtKind ohprEvtKind(const string& nm)
+{
+    static const std::unordered_map<string, OHPREvtKind> kinds {
+        {"SourceIndex", OHPREVT_INT},
+        {"Standby", OHPREVT_BOOL},
+    };
+    auto it = kinds.find(nm);
+    return it == kinds.end() ? OHPREVT_UNKNOWN : it->second;
+}
+
 void OHProduct::evtCallback(
     const std::unordered_map<std::string, std::string>& props)
 {
     LOGDEB1("OHProduct::evtCallback: getReporter(): " << getReporter() << endl);
+    VarEventReporter *reporter = getReporter();
     for (std::unordered_map<std::string, std::string>::const_iterator it =
                 props.begin(); it != props.end(); it++) {
-        if (!getReporter()) {
+        if (!reporter) {
             LOGDEB1("OHProduct::evtCallback: " << it->first << " -> "
                     << it->second << endl);
             continue;
         }
-        if (!it->first.compare("SourceIndex")) {
-            getReporter()->changed(it->first.c_str(), atoi(it->second.c_str()));
-        } else if (!it->first.compare("Standby")) {
+        const char *nm = it->first.c_str();
+        switch (ohprEvtKind(it->first)) {
+        case OHPREVT_INT:
+            reporter->changed(nm, atoi(it->second.c_str()));
+            break;
+        case OHPREVT_BOOL:
+        {
             bool val = false;
             stringToBool(it->second, &val);
-            getReporter()->changed(it->first.c_str(), val ? 1 : 0);
-        } else {
+            reporter->changed(nm, val ? 1 : 0);
+            break;
+        }
+        case OHPREVT_UNKNOWN:
             LOGDEB1("OHProduct event: unknown variable: name [" <<
                     it->first << "] value [" << it->second << endl);
-            getReporter()->changed(it->first.c_str(), it->second.c_str());
+            reporter->changed(nm, it->second.c_str());
+            break;
         }
     }
 }
@@ -151,7 +174,7 @@ int OHProduct::getSources(vector<Source>& sources)
         return ret;
     }
     string sxml;
-    if (!data.get("Value", &sxml)) {
+    if (!data.take("Value", &sxml)) {
         LOGERR("OHProduct:getSources: missing Value in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
@@ -162,26 +185,24 @@ int OHProduct::getSources(vector<Source>& sources)
     return UPNP_E_SUCCESS;
 }
 
-int OHProduct::sourceIndex(int *index)
+int OHProduct::sourceIndex(int *index, bool fromnet)
 {
-    string value;
-    int ret;
-
-    if ((ret = runSimpleGet("SourceIndex", "Value", &value)))
-        return ret;
-
-    *index = atoi(value.c_str());
-    return 0;
+    return runMirroredGet("SourceIndex", "Value", "SourceIndex", index,
+                          fromnet);
 }
 
 int OHProduct::setSourceIndex(int index)
 {
-    return runSimpleAction("SetSourceIndex", "Value", index);
+    int ret = runSimpleAction("SetSourceIndex", "Value", index);
+    mirrorInvalidate("SourceIndex");
+    return ret;
 }
 
 int OHProduct::setSourceIndexByName(const string& name)
 {
-    return runSimpleAction("SetSourceIndexByName", "Value", name);
+    int ret = runSimpleAction("SetSourceIndexByName", "Value", name);
+    mirrorInvalidate("SourceIndex");
+    return ret;
 }
 
 int OHProduct::standby(bool *value)
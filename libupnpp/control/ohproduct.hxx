@@ -66,7 +66,10 @@ public:
 
     /** @return 0 for success, upnp error else */
     int getSources(std::vector<Source>& sources);
-    int sourceIndex(int *index);
+    /** Get the current source index. This may be answered from the
+     * state mirror (see Service::setStateMirror()), unless fromnet
+     * is set. */
+    int sourceIndex(int *index, bool fromnet = false);
     int setSourceIndex(int index);
     int setSourceIndexByName(const std::string& name);
     int standby(bool *value);
@@ -18,19 +18,19 @@
 #include "libupnpp/control/ohradio.hxx"
 
 #include <stdlib.h>                     // for atoi
-#include <string.h>                     // for strcmp
 #include <upnp/upnp.h>                  // for UPNP_E_BAD_RESPONSE, etc
 
 #include <functional>                   // for _Bind, bind, _1
 #include <ostream>                      // for endl, basic_ostream, etc
 #include <string>                       // for string, basic_string, etc
+#include <unordered_map>
 #include <utility>                      // for pair
 #include <vector>                       // for vector
 
 #include "libupnpp/upnpavutils.hxx"
 #include "libupnpp/control/cdircontent.hxx"  // for UPnPDirContent, etc
+#include "libupnpp/control/ohtracklist.hxx"  // for ohDecodeTrackList
 #include "libupnpp/control/service.hxx"  // for VarEventReporter, Service
-#include "libupnpp/expatmm.hxx"         // for inputRefXMLParser
 #include "libupnpp/log.hxx"             // for LOGERR, LOGDEB1, LOGINF
 #include "libupnpp/soaphelp.hxx"        // for SoapIncoming, etc
 #include "libupnpp/upnpp_p.hxx"         // for stringToBool
@@ -73,45 +73,78 @@ int OHRadio::decodeMetadata(const string& who,
     return 0;
 }
 
+// How each Radio variable is decoded before calling the reporter.
+// Metadata is parsed as DIDL, IdArray is expanded to a vector of ids.
+enum OHRDEvtKind {OHRDEVT_UNKNOWN, OHRDEVT_INT, OHRDEVT_IDARRAY,
+                  OHRDEVT_STRING, OHRDEVT_META, OHRDEVT_TPSTATE};
+
+static OHRDEvtKind ohrdEvtKind(const string& nm)
+{
+    static const std::unordered_map<string, OHRDEvtKind> kinds {
+        {"Id", OHRDEVT_INT},
+        {"ChannelsMax", OHRDEVT_INT},
+        {"IdArray", OHRDEVT_IDARRAY},
+        {"ProtocolInfo", OHRDEVT_STRING},
+        {"Uri", OHRDEVT_STRING},
+        {"Metadata", OHRDEVT_META},
+        {"TransportState", OHRDEVT_TPSTATE},
+    };
+    auto it = kinds.find(nm);
+    return it == kinds.end() ? OHRDEVT_UNKNOWN : it->second;
+}
+
 void OHRadio::evtCallback(
     const std::unordered_map<std::string, std::string>& props)
 {
     LOGDEB1("OHRadio::evtCallback: getReporter(): " << getReporter() << endl);
+    VarEventReporter *reporter = getReporter();
     for (std::unordered_map<std::string, std::string>::const_iterator it =
                 props.begin(); it != props.end(); it++) {
-        if (!getReporter()) {
+        if (!reporter) {
             LOGDEB1("OHRadio::evtCallback: " << it->first << " -> "
                     << it->second << endl);
             continue;
         }
 
-        if (!it->first.compare("Id") ||
-                !it->first.compare("ChannelsMax")) {
-            getReporter()->changed(it->first.c_str(), atoi(it->second.c_str()));
-        } else if (!it->first.compare("IdArray")) {
+        const char *nm = it->first.c_str();
+        switch (ohrdEvtKind(it->first)) {
+        case OHRDEVT_INT:
+            reporter->changed(nm, atoi(it->second.c_str()));
+            break;
+        case OHRDEVT_IDARRAY:
+        {
             // Decode IdArray. See how we call the client
             vector<int> v;
             ohplIdArrayToVec(it->second, &v);
-            getReporter()->changed(it->first.c_str(), v);
-        } else if (!it->first.compare("ProtocolInfo") ||
-                   !it->first.compare("Uri")) {
-            getReporter()->changed(it->first.c_str(), it->second.c_str());
-        } else if (!it->first.compare("Metadata")) {
+            reporter->changed(nm, v);
+            break;
+        }
+        case OHRDEVT_STRING:
+            reporter->changed(nm, it->second.c_str());
+            break;
+        case OHRDEVT_META:
+        {
             /* Metadata is a didl-lite string */
             UPnPDirObject dirent;
             if (decodeMetadata("evt", it->second, &dirent) == 0) {
-                getReporter()->changed(it->first.c_str(), dirent);
+                reporter->changed(nm, dirent);
             } else {
                 LOGDEB("OHRadio:evtCallback: bad metadata in event\n");
             }
-        } else if (!it->first.compare("TransportState")) {
+            break;
+        }
+        case OHRDEVT_TPSTATE:
+        {
             OHPlaylist::TPState tp;
             OHPlaylist::stringToTpState(it->second, &tp);
-            getReporter()->changed(it->first.c_str(), int(tp));
-        } else {
+            reporter->changed(nm, int(tp));
+            break;
+        }
+        case OHRDEVT_UNKNOWN:
             LOGERR("OHRadio event: unknown variable: name [" <<
                    it->first << "] value [" << it->second << endl);
-            getReporter()->changed(it->first.c_str(), it->second.c_str());
+            reporter->changed(nm, it->second.c_str());
+            break;
         }
     }
 }
@@ -134,7 +167,7 @@ int OHRadio::channel(std::string* urip, UPnPDirObject *dirent)
         return UPNP_E_BAD_RESPONSE;
     }
     string didl;
-    if (!data.get("Metadata", &didl)) {
+    if (!data.take("Metadata", &didl)) {
         LOGERR("OHRadio::Read: missing Uri in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
@@ -164,7 +197,7 @@ int OHRadio::idArray(vector<int> *ids, int *tokp)
         return UPNP_E_BAD_RESPONSE;
     }
     string arraydata;
-    if (!data.get("Array", &arraydata)) {
+    if (!data.take("Array", &arraydata)) {
         LOGINF("OHRadio::idArray: missing Array in response" << endl);
         // We get this for an empty array ? This would need to be investigated
     }
@@ -175,7 +208,7 @@ int OHRadio::idArray(vector<int> *ids, int *tokp)
 int OHRadio::idArrayChanged(int token, bool *changed)
 {
     SoapOutgoing args(getServiceType(), "IdArrayChanged");
-    args("Token", SoapHelp::i2s(token));
+    args("Token", token);
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
@@ -216,105 +249,43 @@ int OHRadio::protocolInfo(std::string *proto)
 int OHRadio::read(int id, UPnPDirObject *dirent)
 {
     SoapOutgoing args(getServiceType(), "Read");
-    args("Id", SoapHelp::i2s(id));
+    args("Id", id);
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
         return ret;
     }
     string didl;
-    if (!data.get("Metadata", &didl)) {
+    if (!data.take("Metadata", &didl)) {
         LOGERR("OHRadio::Read: missing Metadata in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
     return decodeMetadata("read", didl, dirent);
 }
 
-// Tracklist format
-// <TrackList>
-//   <Entry>
-//     <Id>10</Id>
-//     <Uri>http://blabla</Uri>
-//     <Metadata>(xmlencoded didl)</Metadata>
-//   </Entry>
-// </TrackList>
-
-
-class OHTrackListParser : public inputRefXMLParser {
-public:
-    OHTrackListParser(const string& input,
-                      vector<OHPlaylist::TrackListEntry>* vp)
-        : inputRefXMLParser(input), m_v(vp)
-    {
-        //LOGDEB("OHTrackListParser: input: " << input << endl);
-    }
-
-protected:
-    virtual void StartElement(const XML_Char *name, const XML_Char **) {
-        m_path.push_back(name);
-    }
-    virtual void EndElement(const XML_Char *name) {
-        if (!strcmp(name, "Entry")) {
-            UPnPDirContent dir;
-            if (!dir.parse(m_tdidl)) {
-                LOGERR("OHRadio::ReadList: didl parse failed: "
-                       << m_tdidl << endl);
-                return;
-            }
-            if (dir.m_items.size() != 1) {
-                LOGERR("OHRadio::ReadList: " << dir.m_items.size()
-                       << " in response!" << endl);
-                return;
-            }
-            m_tt.dirent = dir.m_items[0];
-            m_v->push_back(m_tt);
-            m_tt.clear();
-            m_tdidl.clear();
-        }
-        m_path.pop_back();
-    }
-    virtual void CharacterData(const XML_Char *s, int len) {
-        if (s == 0 || *s == 0)
-            return;
-        string str(s, len);
-        if (!m_path.back().compare("Id"))
-            m_tt.id = atoi(str.c_str());
-        else if (!m_path.back().compare("Uri"))
-            m_tt.url = str;
-        else if (!m_path.back().compare("Metadata"))
-            m_tdidl += str;
-    }
-
-private:
-    vector<OHPlaylist::TrackListEntry>* m_v;
-    std::vector<std::string> m_path;
-    OHPlaylist::TrackListEntry m_tt;
-    string m_tdidl;
-};
-
 int OHRadio::readList(const std::vector<int>& ids,
                       vector<OHPlaylist::TrackListEntry>* entsp)
 {
     string idsparam;
     for (vector<int>::const_iterator it = ids.begin(); it != ids.end(); it++) {
-        idsparam += SoapHelp::i2s(*it) + " ";
+        idsparam += SoapHelp::i2s(*it);
+        idsparam += ' ';
     }
     entsp->clear();
 
     SoapOutgoing args(getServiceType(), "ReadList");
-    args("IdList", idsparam);
+    args("IdList", std::move(idsparam));
     SoapIncoming data;
     int ret = runAction(args, data);
     if (ret != UPNP_E_SUCCESS) {
         return ret;
     }
     string xml;
-    if (!data.get("ChannelList", &xml)) {
+    if (!data.take("ChannelList", &xml)) {
         LOGERR("OHRadio::readlist: missing TrackList in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
-    OHTrackListParser mparser(xml, entsp);
-    if (!mparser.Parse())
+    if (!ohDecodeTrackList(xml, entsp, "OHRadio"))
         return UPNP_E_BAD_RESPONSE;
     return 0;
 }
@@ -331,7 +302,7 @@ int OHRadio::setChannel(const std::string& uri, const std::string& didl)
 int OHRadio::setId(int id, const std::string& uri)
 {
     SoapOutgoing args(getServiceType(), "SetId");
-    args("Value", SoapHelp::val2s(id))
+    args("Value", id)
     ("Uri", uri);
     SoapIncoming data;
     return runAction(args, data);
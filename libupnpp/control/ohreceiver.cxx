@@ -122,7 +122,7 @@ int OHReceiver::sender(string& uri, string& meta)
         LOGERR("OHReceiver::Sender: missing Uri in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
-    if (!data.get("Metadata", &meta)) {
+    if (!data.take("Metadata", &meta)) {
         LOGERR("OHReceiver::Sender: missing Metadata in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
@@ -96,7 +96,7 @@ int OHSender::metadata(string& uri, string& didl)
     if (ret != UPNP_E_SUCCESS) {
         return ret;
     }
-    if (!data.get("Value", &didl)) {
+    if (!data.take("Value", &didl)) {
         LOGERR("OHSender::Sender: missing Value in response" << endl);
         return UPNP_E_BAD_RESPONSE;
     }
@@ -0,0 +1,162 @@
+/* Copyright (C) 2006-2016 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+#include "libupnpp/config.h"
+
+#include "libupnpp/control/ohtracklist.hxx"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "libupnpp/control/cdircontent.hxx"
+#include "libupnpp/expatmm.hxx"
+#include "libupnpp/log.hxx"
+
+using namespace std;
+using namespace UPnPP;
+
+namespace UPnPClient {
+
+// Tracklist format
+// <TrackList>
+//   <Entry>
+//     <Id>10</Id>
+//     <Uri>http://blabla</Uri>
+//     <Metadata>(xmlencoded didl)</Metadata>
+//   </Entry>
+// </TrackList>
+
+class OHTrackListParser : public inputRefXMLParser {
+public:
+    OHTrackListParser(const string& input,
+                      vector<OHPlaylist::TrackListEntry>* vp, const char *who)
+        : inputRefXMLParser(input), m_v(vp), m_who(who)
+    {
+        //LOGDEB("OHTrackListParser: input: " << input << endl);
+        m_dir.setVisitor([this](UPnPDirObject& obj) {
+                // Only items count, as with the old m_items check
+                if (obj.m_type != UPnPDirObject::item)
+                    return true;
+                if (m_nitems++ == 0)
+                    m_tt.dirent = std::move(obj);
+                return true;
+            });
+    }
+
+protected:
+    enum ElKind {EK_OTHER, EK_ENTRY, EK_ID, EK_URI, EK_METADATA};
+
+    virtual void StartElement(const XML_Char *name, const XML_Char **) {
+        ElKind kind = EK_OTHER;
+        switch (name[0]) {
+        case 'E':
+            if (!strcmp(name, "Entry")) {
+                kind = EK_ENTRY;
+                m_tt.clear();
+                m_id.clear();
+                m_metaok = false;
+                m_nitems = 0;
+            }
+            break;
+        case 'I':
+            if (!strcmp(name, "Id"))
+                kind = EK_ID;
+            break;
+        case 'U':
+            if (!strcmp(name, "Uri"))
+                kind = EK_URI;
+            break;
+        case 'M':
+            if (!strcmp(name, "Metadata")) {
+                kind = EK_METADATA;
+                m_metaok = m_dir.parseStart();
+            }
+            break;
+        default:
+            break;
+        }
+        m_path.push_back(kind);
+    }
+
+    virtual void EndElement(const XML_Char *) {
+        switch (m_path.back()) {
+        case EK_ID:
+            m_tt.id = atoi(m_id.c_str());
+            break;
+        case EK_METADATA:
+            m_metaok = m_metaok && m_dir.parseEnd();
+            break;
+        case EK_ENTRY:
+            if (!m_metaok) {
+                LOGERR(m_who << "::ReadList: didl parse failed for id " <<
+                       m_tt.id << endl);
+            } else if (m_nitems != 1) {
+                LOGERR(m_who << "::ReadList: " << m_nitems <<
+                       " in response!" << endl);
+            } else {
+                m_v->push_back(std::move(m_tt));
+            }
+            break;
+        default:
+            break;
+        }
+        m_path.pop_back();
+    }
+
+    virtual void CharacterData(const XML_Char *s, int len) {
+        if (s == 0 || *s == 0 || m_path.empty())
+            return;
+        switch (m_path.back()) {
+        case EK_ID:
+            m_id.append(s, len);
+            break;
+        case EK_URI:
+            m_tt.url.append(s, len);
+            break;
+        case EK_METADATA:
+            if (m_metaok)
+                m_metaok = m_dir.parseData(s, len);
+            break;
+        default:
+            break;
+        }
+    }
+
+private:
+    vector<OHPlaylist::TrackListEntry>* m_v;
+    const char *m_who;
+    vector<ElKind> m_path;
+    OHPlaylist::TrackListEntry m_tt;
+    string m_id;
+    // Incremental DIDL parser, reused for all the entries.
+    UPnPDirContent m_dir;
+    bool m_metaok{false};
+    int m_nitems{0};
+};
+
+bool ohDecodeTrackList(const string& xml,
+                       vector<OHPlaylist::TrackListEntry> *entsp,
+                       const char *who)
+{
+    OHTrackListParser mparser(xml, entsp, who);
+    return mparser.Parse();
+}
+
+} // namespace UPnPClient
@@ -0,0 +1,47 @@
+/* Copyright (C) 2006-2016 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+#ifndef _OHTRACKLIST_HXX_INCLUDED_
+#define _OHTRACKLIST_HXX_INCLUDED_
+
+#include <string>
+#include <vector>
+
+#include "libupnpp/control/ohplaylist.hxx"
+
+namespace UPnPClient {
+
+/** Private: decode the TrackList document returned by the OpenHome
+ * Playlist and Radio ReadList actions.
+ *
+ * This is done in a single pass: the embedded (escaped) DIDL
+ * metadata is fed to a reused incremental DIDL parser as the outer
+ * parser delivers it, and the entries are moved into the output.
+ *
+ * @param xml the TrackList (Playlist) or ChannelList (Radio) value.
+ * @param[out] entsp the decoded entries are appended. Entries with
+ *    bad metadata are skipped.
+ * @param who service name for the log messages.
+ * @return false for an outer parse error.
+ */
+extern bool ohDecodeTrackList(const std::string& xml,
+                              std::vector<OHPlaylist::TrackListEntry> *entsp,
+                              const char *who);
+
+} // namespace UPnPClient
+
+#endif /* _OHTRACKLIST_HXX_INCLUDED_ */
@@ -156,10 +156,10 @@ int OHVolume::vol0100ToDev(int ivol)
     return desiredVolume;
 }
 
-int OHVolume::volume(int *value)
+int OHVolume::volume(int *value, bool fromnet)
 {
     int mval;
-    int ret = runSimpleGet("Volume", "Value", &mval);
+    int ret = runMirroredGet("Volume", "Value", "Volume", &mval, fromnet);
     if (ret == 0) {
         *value = devVolTo0100(mval);
     } else {
@@ -173,7 +173,15 @@ int OHVolume::setVolume(int value)
 {
     int mval = vol0100ToDev(value);
     LOGDEB1("OHVolume::setVolume: input " << value << " vol " << mval << endl);
-    return runSimpleAction("SetVolume", "Value", mval);
+    int ret = runSimpleAction("SetVolume", "Value", mval);
+    if (ret == 0) {
+        // Spare the GetVolume call in the next setVolume(). An event
+        // will correct this if the device did something else.
+        mirrorSet("Volume", SoapHelp::i2s(mval));
+    } else {
+        mirrorInvalidate("Volume");
+    }
+    return ret;
 }
 
 int OHVolume::volumeLimit(int *value)
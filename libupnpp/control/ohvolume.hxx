@@ -77,9 +77,11 @@ public:
     int characteristics(OHVCharacteristics* c);
     /** Retrieve volume level.
      * @param[output] value place to store the retrieved value (0-100).
+     * @param fromnet do not use the state mirror (see
+     *   Service::setStateMirror()), always query the device.
      * @return 0 for success, < 0 for error.
      */
-    int volume(int *value);
+    int volume(int *value, bool fromnet = false);
     /** Set volume level.
      * @param value volume level to set (0-100).
      * @return 0 for success or < 0 for error.
@@ -96,6 +96,14 @@ int RenderingControl::devVolTo0100(int dev_vol)
     return volume;
 }
 
+// State mirror key for the volume of a channel
+static string volMirrorKey(const string& channel)
+{
+    if (channel.empty() || !channel.compare("Master"))
+        return "Volume";
+    return "Volume/" + channel;
+}
+
 void RenderingControl::evtCallback(
     const std::unordered_map<std::string, std::string>& props)
 {
@@ -104,25 +112,33 @@ void RenderingControl::evtCallback(
     for (std::unordered_map<std::string, std::string>::const_iterator it =
                 props.begin(); it != props.end(); it++) {
         if (!it->first.compare("LastChange")) {
-            std::unordered_map<std::string, std::string> props1;
-            if (!decodeAVLastChange(it->second, props1)) {
+            AVLastChange lc;
+            if (!decodeAVLastChange(it->second, lc)) {
                 LOGERR("RenderingControl::evtCallback: bad LastChange value: "
                        << it->second << endl);
                 return;
             }
-            for (std::unordered_map<std::string, std::string>::iterator it1 =
-                        props1.begin(); it1 != props1.end(); it1++) {
-                LOGDEB1("    " << it1->first << " -> " <<
-                        it1->second << endl);
-                if (!it1->first.compare("Volume")) {
-                    int vol = devVolTo0100(atoi(it1->second.c_str()));
-                    if (getReporter()) {
-                        getReporter()->changed(it1->first.c_str(), vol);
+            for (size_t i = 0; i < lc.size(); i++) {
+                const AVLastChange::Var& var = lc[i];
+                LOGDEB1("    " << var.instance << " " << var.name() << " [" <<
+                        var.channel() << "] -> " << var.value << endl);
+                // We only ever use instance 0, and the reporter only
+                // knows about the Master channel.
+                if (var.instance != 0)
+                    continue;
+                bool master = var.channel().empty() ||
+                    !var.channel().compare("Master");
+                if (!var.name().compare("Volume")) {
+                    mirrorSet(volMirrorKey(var.channel()), var.value);
+                    if (master && getReporter()) {
+                        int vol = devVolTo0100(atoi(var.value.c_str()));
+                        getReporter()->changed(var.name().c_str(), vol);
                     }
-                } else if (!it1->first.compare("Mute")) {
+                } else if (!var.name().compare("Mute")) {
                     bool mute;
-                    if (getReporter() && stringToBool(it1->second, &mute))
-                        getReporter()->changed(it1->first.c_str(), mute);
+                    if (master && getReporter() &&
+                        stringToBool(var.value, &mute))
+                        getReporter()->changed(var.name().c_str(), mute);
                 }
             }
         } else {
@@ -186,13 +202,25 @@ int RenderingControl::setVolume(int ivol, const string& channel)
 
     SoapOutgoing args(getServiceType(), "SetVolume");
     args("InstanceID", "0")("Channel", channel)
-    ("DesiredVolume", SoapHelp::i2s(desiredVolume));
+    ("DesiredVolume", desiredVolume);
     SoapIncoming data;
-    return runAction(args, data);
+    int ret = runAction(args, data);
+    if (ret == UPNP_E_SUCCESS) {
+        // Spare the GetVolume call in the next setVolume(). An
+        // event will correct this if the device did something else.
+        mirrorSet(volMirrorKey(channel), SoapHelp::i2s(desiredVolume));
+    } else {
+        mirrorInvalidate(volMirrorKey(channel));
+    }
+    return ret;
 }
 
-int RenderingControl::getVolume(const string& channel)
+int RenderingControl::getVolume(const string& channel, bool fromnet)
 {
+    string mval;
+    if (!fromnet && mirrorGet(volMirrorKey(channel), &mval) && !mval.empty()) {
+        return devVolTo0100(atoi(mval.c_str()));
+    }
     SoapOutgoing args(getServiceType(), "GetVolume");
     args("InstanceID", "0")("Channel", channel);
     SoapIncoming data;
@@ -207,6 +235,7 @@ int RenderingControl::getVolume(const string& channel)
         return UPNP_E_BAD_RESPONSE;
     }
     LOGDEB0("RenderingControl::getVolume: got " << dev_volume << endl);
+    mirrorSet(volMirrorKey(channel), SoapHelp::i2s(dev_volume));
     // Output is always 0-100. Translate from device range
     return devVolTo0100(dev_volume);
 }
@@ -215,7 +244,7 @@ int RenderingControl::setMute(bool mute, const string& channel)
 {
     SoapOutgoing args(getServiceType(), "SetMute");
     args("InstanceID", "0")("Channel", channel)
-    ("DesiredMute", SoapHelp::i2s(mute?1:0));
+    ("DesiredMute", mute);
     SoapIncoming data;
     return runAction(args, data);
 }
@@ -55,8 +55,13 @@ public:
      * @return 0 for success, upnp error else 
      */
     int setVolume(int volume, const std::string& channel = "Master");
-    /** @return current volume value (0-100) or negative for error. */
-    int getVolume(const std::string& channel = "Master");
+    /** @return current volume value (0-100) or negative for error. 
+     * The value may be answered from the state mirror (see
+     * Service::setStateMirror()), unless fromnet is set. The mirror
+     * keeps the volume for each channel found in the events.
+     */
+    int getVolume(const std::string& channel = "Master",
+                  bool fromnet = false);
     int setMute(bool mute, const std::string& channel = "Master");
     bool getMute(const std::string& channel = "Master");
 
@@ -19,13 +19,26 @@
 
 #include "libupnpp/control/service.hxx"
 
+#include <stdlib.h>
+
 #include <upnp/upnp.h>                  // for Upnp_Event, UPNP_E_SUCCESS, etc
 #include <upnp/upnptools.h>             // for UpnpGetErrorMessage
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>                       // for string, char_traits, etc
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>                      // for pair
+#include <vector>
 
+#include "libupnpp/control/actionstats.hxx"
 #include "libupnpp/control/description.hxx"  // for UPnPDeviceDesc, etc
+#include "libupnpp/control/devicehealth.hxx"
+#include "libupnpp/control/subscriptions.hxx"
 #include "libupnpp/ixmlwrap.hxx"
 #include "libupnpp/log.hxx"             // for LOGDEB1, LOGINF, LOGERR, etc
 #include "libupnpp/upnpp_p.hxx"         // for caturl
@@ -35,11 +48,11 @@ using namespace std;
 using namespace std::placeholders;
 using namespace UPnPP;
 
-#if UPNP_VERSION_MINOR < 8 && !defined(UpnpEvent_get_SID_cstr)
-typedef struct Upnp_Event UpnpEvent;
-#define UpnpEvent_get_SID_cstr(x) ((x)->Sid)
-#define UpnpEvent_get_EventKey(x) ((x)->EventKey)
-#define UpnpEvent_get_ChangedVariables(x) ((x)->ChangedVariables)
+#if UPNP_VERSION_MINOR < 8 && !defined(UpnpActionComplete_get_ErrCode)
+typedef struct Upnp_Action_Complete UpnpActionComplete;
+#define UpnpActionComplete_get_ErrCode(x) ((x)->ErrCode)
+#define UpnpActionComplete_get_ActionRequest(x) ((x)->ActionRequest)
+#define UpnpActionComplete_get_ActionResult(x) ((x)->ActionResult)
 #endif
 
 #if UPNP_VERSION_MAJOR > 1 || (UPNP_VERSION_MAJOR==1 && UPNP_VERSION_MINOR >= 8)
@@ -49,8 +62,6 @@ typedef struct Upnp_Event UpnpEvent;
 #endif
 
 namespace UPnPClient {
-static bool initEvents();
-static int srvCB(Upnp_EventType et, CBCONST void* vevp, void*);
 
 // A small helper class for the functions which perform
 // UpnpSendAction calls: get rid of IXML docs when done.
@@ -78,7 +89,44 @@ public:
     std::string friendlyName;
     std::string manufacturer;
     std::string modelName;
-    Upnp_SID    SID{0}; /* Subscription Id */
+    // Registered with the subscription manager. Read by the mirror
+    // accessors from the getter and event threads.
+    std::atomic<bool> registered{false};
+    // Event rate limits, see setEventRateLimit()
+    std::unordered_map<string, int> eventrates;
+    // Default action time limit (ms). 0 for none.
+    int actiontimeoutms{0};
+
+    // Optional state variables mirror
+    class MirrorEntry {
+    public:
+        string value;
+        std::chrono::steady_clock::time_point when;
+    };
+    // Derived class event callback, as passed to registerCallback()
+    evtCBFunc evtcb;
+    bool mirroron{false};
+    int mirrormaxagems{0};
+    std::mutex mirrormutex;
+    std::unordered_map<string, MirrorEntry> mirror;
+
+    void mirrorFeed(const std::unordered_map<string, string>& props) {
+        std::unique_lock<std::mutex> lock(mirrormutex);
+        if (!mirroron)
+            return;
+        auto now = std::chrono::steady_clock::now();
+        for (const auto& prop : props) {
+            if (prop.first == "LastChange")
+                continue;
+            MirrorEntry& ent = mirror[prop.first];
+            ent.value = prop.second;
+            ent.when = now;
+        }
+    }
+    void mirrorClear() {
+        std::unique_lock<std::mutex> lock(mirrormutex);
+        mirror.clear();
+    }
 
     void initFromDeviceAndService(const UPnPDeviceDesc& devdesc,
                                   const UPnPServiceDesc& servdesc) {
@@ -90,20 +138,9 @@ public:
         manufacturer = devdesc.manufacturer;
         modelName = devdesc.modelName;
     }
-    /* Tell the UPnP device (through libupnp) that we want to receive
-       its events. This is called by registerCallback() and sets m_SID */
-    bool subscribe();
-    bool unSubscribe();
 };
 
-/** Registered callbacks for all the service objects. The map is
- * indexed by SID, the subscription id which was obtained by
- * each object when subscribing to receive the events for its
- * device. The map allows the static function registered with
- * libupnp to call the appropriate object method when it receives
- * an event. */
-static std::unordered_map<std::string, evtCBFunc> o_calls;
-
+typedef std::unordered_map<string, string> EventProps;
 
 Service::Service(const UPnPDeviceDesc& devdesc,
                  const UPnPServiceDesc& servdesc)
@@ -115,7 +152,7 @@ Service::Service(const UPnPDeviceDesc& devdesc,
 
     m->initFromDeviceAndService(devdesc, servdesc);
     // Only does anything the first time
-    initEvents();
+    SubscriptionManager::init();
     // serviceInit() will be called from the derived class constructor
     // if needed
 }
@@ -130,7 +167,7 @@ bool Service::initFromDescription(const UPnPDeviceDesc& devdesc)
         if (serviceTypeMatch(servdesc.serviceType)) {
             m->initFromDeviceAndService(devdesc, servdesc);
             // Only does anything the first time
-            initEvents();
+            SubscriptionManager::init();
             return serviceInit(devdesc, servdesc);
         }
     }
@@ -147,7 +184,7 @@ Service::Service()
 
 Service::~Service()
 {
-    LOGDEB1("Service::~Service: " << m->eventURL << " SID " << m->SID << endl);
+    LOGDEB1("Service::~Service: " << m->eventURL << endl);
     unregisterCallback();
     delete m;
     m = 0;
@@ -183,8 +220,280 @@ const string& Service::getManufacturer() const
     return m->manufacturer;
 }
 
+// State shared by a caller waiting for an asynchronous action and
+// the libupnp completion callback. Both hold a reference, so that
+// the caller can return on timeout or cancellation without waiting
+// for the request to complete.
+class AsyncActionState {
+public:
+    std::mutex mutex;
+    std::condition_variable cond;
+    // Set by the callback
+    bool done{false};
+    int ret{UPNP_E_SUCCESS};
+    SoapIncoming data;
+    // Set by the cancellation token
+    bool cancelreq{false};
+    // Set by the caller when it stops waiting: the result is not wanted
+    bool orphaned{false};
+    std::string actname;
+};
+
+class ActionCancel::Internal {
+public:
+    std::mutex mutex;
+    bool cancelled{false};
+    // Callers currently waiting with this token
+    vector<AsyncActionState*> waiters;
+
+    bool isCancelled() {
+        std::unique_lock<std::mutex> lock(mutex);
+        return cancelled;
+    }
+    void addWaiter(AsyncActionState *st) {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiters.push_back(st);
+    }
+    void removeWaiter(AsyncActionState *st) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (auto it = waiters.begin(); it != waiters.end(); it++) {
+            if (*it == st) {
+                waiters.erase(it);
+                break;
+            }
+        }
+    }
+};
+
+ActionCancel::ActionCancel()
+{
+    if ((m = new Internal()) == 0) {
+        LOGERR("ActionCancel::ActionCancel: out of memory" << endl);
+        return;
+    }
+}
+
+ActionCancel::~ActionCancel()
+{
+    delete m;
+    m = 0;
+}
+
+void ActionCancel::cancel()
+{
+    std::unique_lock<std::mutex> lock(m->mutex);
+    m->cancelled = true;
+    for (auto st : m->waiters) {
+        std::unique_lock<std::mutex> slock(st->mutex);
+        st->cancelreq = true;
+        st->cond.notify_all();
+    }
+}
+
+bool ActionCancel::cancelled() const
+{
+    return m->isCancelled();
+}
+
+// Current thread settings, managed by ActionScope
+static thread_local int tl_scopetimeoutms;
+static thread_local ActionCancel *tl_scopecancel;
+
+ActionScope::ActionScope(int timeoutms, ActionCancel *cancel)
+    : m_prevtimeout(tl_scopetimeoutms), m_prevcancel(tl_scopecancel)
+{
+    if (timeoutms > 0)
+        tl_scopetimeoutms = timeoutms;
+    if (cancel)
+        tl_scopecancel = cancel;
+}
+
+ActionScope::~ActionScope()
+{
+    tl_scopetimeoutms = m_prevtimeout;
+    tl_scopecancel = m_prevcancel;
+}
+
+int ActionScope::currentTimeout()
+{
+    return tl_scopetimeoutms;
+}
+
+ActionCancel *ActionScope::currentCancel()
+{
+    return tl_scopecancel;
+}
+
+void Service::setActionTimeout(int timeoutms)
+{
+    m->actiontimeoutms = timeoutms > 0 ? timeoutms : 0;
+}
+
+int Service::getActionTimeout() const
+{
+    return m->actiontimeoutms;
+}
+
+// Log the details of a failed action call
+static void logActionError(int ret, IXML_Document *request,
+                           IXML_Document *response)
+{
+    if (ret < 0) {
+        LOGINF("Service::runAction: UpnpSendAction failed: " << ret <<
+               " : " << UpnpGetErrorMessage(ret) << " for " <<
+               ixmlwPrintDoc(request) << endl);
+    } else {
+        // A remote error then
+        SoapIncoming error;
+        error.decode("UPnPError", response);
+        int code = -1;
+        string desc;
+        error.get("errorCode", &code);
+        error.get("errorDescription", &desc);
+        LOGINF("Service::runAction: failed: errcode: " << code << " : \""
+               << desc << "\" for request: " << 
+               ixmlwPrintDoc(request) << endl);
+    }
+}
+
+// Completion callback for UpnpSendActionAsync(). The response
+// document belongs to libupnp and is freed when we return, so it is
+// decoded here.
+static int asyncActionCB(Upnp_EventType et, CBCONST void *vevp, void *cookie)
+{
+    std::shared_ptr<AsyncActionState> *spp =
+        (std::shared_ptr<AsyncActionState> *)cookie;
+    std::shared_ptr<AsyncActionState> st(*spp);
+    delete spp;
+
+    std::unique_lock<std::mutex> lock(st->mutex);
+    if (st->orphaned) {
+        LOGDEB("Service::asyncActionCB: " << st->actname <<
+               " completed after caller gave up" << endl);
+        return UPNP_E_SUCCESS;
+    }
+    if (et != UPNP_CONTROL_ACTION_COMPLETE) {
+        LOGERR("Service::asyncActionCB: unexpected event " <<
+               LibUPnP::evTypeAsString(et) << endl);
+        st->ret = UPNP_E_BAD_RESPONSE;
+    } else {
+        UpnpActionComplete *acp = (UpnpActionComplete *)vevp;
+        IXML_Document *response = UpnpActionComplete_get_ActionResult(acp);
+        st->ret = UpnpActionComplete_get_ErrCode(acp);
+        if (st->ret != UPNP_E_SUCCESS) {
+            logActionError(st->ret, 
+                           UpnpActionComplete_get_ActionRequest(acp), response);
+        } else {
+            LOGDEB1("Service::runAction: rslt: [" <<
+                    ixmlwPrintDoc(response) << "]" << endl);
+            if (!st->data.decode(st->actname.c_str(), response)) {
+                LOGERR("Service::runAction: Could not decode response: " <<
+                       ixmlwPrintDoc(response) << endl);
+                st->ret = UPNP_E_BAD_RESPONSE;
+            }
+        }
+    }
+    st->done = true;
+    st->cond.notify_all();
+    return UPNP_E_SUCCESS;
+}
+
+// Send the request asynchronously and wait for the result, the
+// deadline, or cancellation. *expired is set if we return
+// UPNP_E_TIMEDOUT because of our deadline (not a libupnp timeout).
+static int sendActionAndWait(UpnpClient_Handle hdl, const string& url,
+                             const string& st, const string& actname,
+                             IXML_Document *request, SoapIncoming& data,
+                             int timeoutms, ActionCancel::Internal *cancel,
+                             bool *expired)
+{
+    *expired = false;
+    auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(timeoutms);
+    std::shared_ptr<AsyncActionState> state =
+        std::make_shared<AsyncActionState>();
+    state->actname = actname;
+
+    // libupnp makes its own copy of the request document.
+    std::shared_ptr<AsyncActionState> *cookie =
+        new std::shared_ptr<AsyncActionState>(state);
+    int ret = UpnpSendActionAsync(hdl, url.c_str(), st.c_str(),
+                                  0 /*devUDN*/, request, asyncActionCB, cookie);
+    if (ret != UPNP_E_SUCCESS) {
+        // The callback will not be called
+        delete cookie;
+        logActionError(ret, request, nullptr);
+        return ret;
+    }
+
+    // Register before checking the flag so that a concurrent cancel()
+    // can't be missed. Don't call cancelled() with the state locked:
+    // cancel() locks the token, then the state.
+    bool precancelled = false;
+    if (cancel) {
+        cancel->addWaiter(state.get());
+        precancelled = cancel->isCancelled();
+    }
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (precancelled)
+            state->cancelreq = true;
+        while (!state->done && !state->cancelreq) {
+            if (timeoutms > 0) {
+                if (state->cond.wait_until(lock, deadline) ==
+                    std::cv_status::timeout) {
+                    break;
+                }
+            } else {
+                state->cond.wait(lock);
+            }
+        }
+        if (state->done) {
+            ret = state->ret;
+            data.swap(state->data);
+        } else {
+            state->orphaned = true;
+            ret = state->cancelreq ? UPNP_E_CANCELED : UPNP_E_TIMEDOUT;
+            *expired = ret == UPNP_E_TIMEDOUT;
+            LOGINF("Service::runAction: " << actname << " on " << url <<
+                   (ret == UPNP_E_CANCELED ? " cancelled" : " timed out")
+                   << endl);
+        }
+    }
+    if (cancel)
+        cancel->removeWaiter(state.get());
+    return ret;
+}
+
+static size_t argsSize(const vector<pair<string, string> >& args)
+{
+    size_t sz = 0;
+    for (const auto& arg : args) {
+        sz += arg.first.size() + arg.second.size();
+    }
+    return sz;
+}
+
+static inline int64_t usecsBetween(std::chrono::steady_clock::time_point t0,
+                                   std::chrono::steady_clock::time_point t1)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        t1 - t0).count();
+}
+
 int Service::runAction(const SoapOutgoing& args, SoapIncoming& data)
 {
+    int timeoutms = tl_scopetimeoutms > 0 ? tl_scopetimeoutms :
+        m->actiontimeoutms;
+    return runAction(args, data, timeoutms, tl_scopecancel);
+}
+
+int Service::runAction(const SoapOutgoing& args, SoapIncoming& data,
+                       int timeoutms, ActionCancel *cancel)
+{
+    if (cancel && cancel->cancelled()) {
+        return UPNP_E_CANCELED;
+    }
     LibUPnP* lib = LibUPnP::getLibUPnP();
     if (lib == 0) {
         LOGINF("Service::runAction: no lib" << endl);
@@ -192,12 +501,55 @@ int Service::runAction(const SoapOutgoing& args, SoapIncoming& data)
     }
     UpnpClient_Handle hdl = lib->getclh();
 
+    // Fail fast if the device is known not to respond.
+    bool isprobe;
+    if (!DeviceHealth::callAllowed(m->deviceId, &isprobe)) {
+        LOGDEB("Service::runAction: " << args.getName() << ": device " <<
+               m->friendlyName << " not responding" << endl);
+        return UPNP_E_NETWORK_ERROR;
+    }
+
     IXML_Document *request(0);
     IXML_Document *response(0);
     IxmlCleaner cleaner(&request, &response);
 
+    // Timing/size data for ActionStats. The trace is only built if
+    // someone is interested.
+    bool tracing = ActionStats::active();
+    std::chrono::steady_clock::time_point tstart, tsent, tdone;
+    if (tracing) {
+        tstart = std::chrono::steady_clock::now();
+    }
+    // Set if the call timed out because of the caller's deadline,
+    // which tells nothing about the device.
+    bool expired = false;
+    // Called on every return path from here: report the result to the
+    // device health tracker, and possibly to ActionStats
+    auto trace = [&](int err) {
+        DeviceHealth::callDone(m->deviceId, err, isprobe, expired);
+        if (!tracing)
+            return;
+        auto tend = std::chrono::steady_clock::now();
+        if (tsent == std::chrono::steady_clock::time_point())
+            tsent = tend;
+        if (tdone == std::chrono::steady_clock::time_point())
+            tdone = tend;
+        ActionTrace tr;
+        tr.serviceType = m->serviceType;
+        tr.actionName = args.getName();
+        tr.deviceId = m->deviceId;
+        tr.requestSize = argsSize(args.getArgs());
+        tr.responseSize = argsSize(data.getArgs());
+        tr.errcode = err;
+        tr.buildUs = usecsBetween(tstart, tsent);
+        tr.networkUs = usecsBetween(tsent, tdone);
+        tr.decodeUs = usecsBetween(tdone, tend);
+        ActionStats::record(tr);
+    };
+
     if ((request = args.buildSoapBody(false)) == 0) {
         LOGINF("Service::runAction: buildSoapBody failed" << endl);
+        trace(UPNP_E_OUTOF_MEMORY);
         return  UPNP_E_OUTOF_MEMORY;
     }
 
@@ -205,36 +557,47 @@ int Service::runAction(const SoapOutgoing& args, SoapIncoming& data)
            " serviceType " << m->serviceType <<
            " rqst: [" << ixmlwPrintDoc(request) << "]" << endl);
 
-    int ret = UpnpSendAction(hdl, m->actionURL.c_str(), m->serviceType.c_str(),
-                             0 /*devUDN*/, request, &response);
-
-    if (ret != UPNP_E_SUCCESS) {
-        if (ret < 0) {
-            LOGINF("Service::runAction: UpnpSendAction failed: " << ret <<
-                   " : " << UpnpGetErrorMessage(ret) << " for " <<
-                   ixmlwPrintDoc(request) << endl);
-        } else {
-            // A remote error then
-            SoapIncoming error;
-            error.decode("UPnPError", response);
-            int code = -1;
-            string desc;
-            error.get("errorCode", &code);
-            error.get("errorDescription", &desc);
-            LOGINF("Service::runAction: failed: errcode: " << code << " : \""
-                   << desc << "\" for request: " << 
-                   ixmlwPrintDoc(request) << endl);
-        }
-        return ret;
+    if (tracing) {
+        tsent = std::chrono::steady_clock::now();
     }
-    LOGDEB1("Service::runAction: rslt: [" <<
-            ixmlwPrintDoc(response) << "]" << endl);
+    int ret;
+    if (timeoutms <= 0 && cancel == nullptr) {
+        ret = UpnpSendAction(hdl, m->actionURL.c_str(),
+                             m->serviceType.c_str(), 0 /*devUDN*/,
+                             request, &response);
+        if (tracing) {
+            tdone = std::chrono::steady_clock::now();
+        }
+        if (ret != UPNP_E_SUCCESS) {
+            logActionError(ret, request, response);
+            trace(ret);
+            return ret;
+        }
+        LOGDEB1("Service::runAction: rslt: [" <<
+                ixmlwPrintDoc(response) << "]" << endl);
 
-    if (!data.decode(args.getName().c_str(), response)) {
-        LOGERR("Service::runAction: Could not decode response: " <<
-               ixmlwPrintDoc(response) << endl);
-        return UPNP_E_BAD_RESPONSE;
+        if (!data.decode(args.getName().c_str(), response)) {
+            LOGERR("Service::runAction: Could not decode response: " <<
+                   ixmlwPrintDoc(response) << endl);
+            trace(UPNP_E_BAD_RESPONSE);
+            return UPNP_E_BAD_RESPONSE;
+        }
+    } else {
+        // The response is decoded in the completion callback, so the
+        // decode time is included in the network time in this case.
+        ret = sendActionAndWait(hdl, m->actionURL, m->serviceType,
+                                args.getName(), request, data,
+                                timeoutms, cancel ? cancel->m : nullptr,
+                                &expired);
+        if (tracing) {
+            tdone = std::chrono::steady_clock::now();
+        }
+        if (ret != UPNP_E_SUCCESS) {
+            trace(ret);
+            return ret;
+        }
     }
+    trace(UPNP_E_SUCCESS);
     return UPNP_E_SUCCESS;
 }
 
@@ -263,199 +626,227 @@ template <class T> int Service::runSimpleGet(const std::string& actnm,
     return 0;
 }
 
+static bool mirrorConvert(const string& in, string *out)
+{
+    *out = in;
+    return true;
+}
+static bool mirrorConvert(const string& in, int *out)
+{
+    if (in.empty())
+        return false;
+    *out = atoi(in.c_str());
+    return true;
+}
+static bool mirrorConvert(const string& in, bool *out)
+{
+    return stringToBool(in, out);
+}
+
+template <class T> int Service::runMirroredGet(const std::string& actnm,
+                                               const std::string& valnm,
+                                               const std::string& varnm,
+                                               T *valuep, bool fromnet)
+{
+    string svalue;
+    if (!fromnet && mirrorGet(varnm, &svalue) &&
+        mirrorConvert(svalue, valuep)) {
+        LOGDEB1("Service::runMirroredGet: " << varnm << " from mirror\n");
+        return 0;
+    }
+    SoapOutgoing args(m->serviceType, actnm);
+    SoapIncoming data;
+    int ret = runAction(args, data);
+    if (ret != UPNP_E_SUCCESS) {
+        return ret;
+    }
+    if (!data.get(valnm.c_str(), &svalue) ||
+        !mirrorConvert(svalue, valuep)) {
+        LOGERR("Service::runMirroredGet: " << actnm <<
+               " missing " << valnm << " in response" << std::endl);
+        return UPNP_E_BAD_RESPONSE;
+    }
+    mirrorSet(varnm, svalue);
+    return 0;
+}
+
 template <class T> int Service::runSimpleAction(const std::string& actnm,
         const std::string& valnm,
         T value)
 {
     SoapOutgoing args(m->serviceType, actnm);
-    args(valnm, SoapHelp::val2s(value));
+    args(valnm, std::move(value));
     SoapIncoming data;
     return runAction(args, data);
 }
 
-static std::mutex cblock;
-// The static event callback given to libupnp
-static int srvCB(Upnp_EventType et, CBCONST void* vevp, void*)
+void Service::registerCallback(evtCBFunc c)
 {
-    std::unique_lock<std::mutex> lock(cblock);
-
-    LOGDEB0("Service:srvCB: " << LibUPnP::evTypeAsString(et) << endl);
-
-    switch (et) {
-    case UPNP_EVENT_RENEWAL_COMPLETE:
-    case UPNP_EVENT_SUBSCRIBE_COMPLETE:
-    case UPNP_EVENT_UNSUBSCRIBE_COMPLETE:
-    case UPNP_EVENT_AUTORENEWAL_FAILED:
-    {
-        const char *ff = (const char *)vevp;
-        (void)ff;
-        LOGDEB1("Service:srvCB: subs event: " << ff << endl);
-        break;
+    if (!m)
+        return;
+    if (m->registered) {
+        unregisterCallback();
     }
-
-    case UPNP_EVENT_RECEIVED:
-    {
-        UpnpEvent *evp = (UpnpEvent *)vevp;
-        LOGDEB1("Service:srvCB: var change event: SID " <<
-                UpnpEvent_get_SID_cstr(evp) << " EventKey " <<
-                UpnpEvent_get_EventKey(evp) << " changed " <<
-                ixmlwPrintDoc(UpnpEvent_get_ChangedVariables(evp)) << endl);
-
-        std::unordered_map<string, string> props;
-        if (!decodePropertySet(UpnpEvent_get_ChangedVariables(evp), props)) {
-            LOGERR("Service::srvCB: could not decode EVENT propertyset" <<endl);
-            return UPNP_E_BAD_RESPONSE;
-        }
-        //for (auto& entry: props) {
-        //LOGDEB("srvCB: " << entry.first << " -> " << entry.second << endl);
-        //}
-
-        auto it = o_calls.find(UpnpEvent_get_SID_cstr(evp));
-        if (it != o_calls.end()) {
-            (it->second)(props);
-        } else {
-            LOGINF("Service::srvCB: no callback found for sid " <<
-                   UpnpEvent_get_SID_cstr(evp) << endl);
-        }
-        break;
+    // Feed the state mirror before calling the derived class
+    // method. The listener is removed by unregisterCallback() before
+    // we go away.
+    m->evtcb = c;
+    Internal *mp = m;
+    evtCBFunc func = [mp, c] (const EventProps& p) {
+        mp->mirrorFeed(p);
+        c(p);
+    };
+    // The subscription itself is performed asynchronously by the
+    // manager, which also takes care of renewal failures.
+    SubscriptionManager::addListener(m->eventURL, m->deviceId, m, func);
+    m->registered = true;
+    if (!m->eventrates.empty()) {
+        SubscriptionManager::setRateLimits(m->eventURL, m, m->eventrates);
     }
+}
 
-    default:
-        // Ignore other events for now
-        LOGDEB("Service:srvCB: unprocessed evt type: [" <<
-               LibUPnP::evTypeAsString(et) << "]"  << endl);
-        break;
+void Service::unregisterCallback()
+{
+    LOGDEB1("Service::unregisterCallback: " << m->eventURL << endl);
+    if (m->registered) {
+        // This waits for a running callback to return.
+        SubscriptionManager::removeListener(m->eventURL, m);
+        m->registered = false;
     }
+    // Without a subscription, we can't know if the values change
+    m->mirrorClear();
+}
 
-    return UPNP_E_SUCCESS;
+bool Service::callbackRegistered() const
+{
+    return m && m->registered;
 }
 
-// Only actually does something on the first call, to register our
-// (static) library callback
-static bool initEvents()
+bool Service::eventsActive() const
 {
-    LOGDEB1("Service::initEvents" << endl);
+    return m && m->registered && SubscriptionManager::isActive(m->eventURL);
+}
 
-    std::unique_lock<std::mutex> lock(cblock);
-    
-    static bool eventinit(false);
-    if (eventinit)
-        return true;
-    eventinit = true;
+VarEventReporter *Service::getReporter()
+{
+    if (m)
+        return m->reporter;
+    return nullptr;
+}
 
-    LibUPnP *lib = LibUPnP::getLibUPnP();
-    if (lib == 0) {
-        LOGERR("Service::initEvents: Can't get lib" << endl);
-        return false;
+void Service::installReporter(VarEventReporter* reporter)
+{
+    if (reporter) {
+        // Get a fresh initial event for the new reporter
+        if (!m->registered)
+            registerCallback();
+        else
+            reSubscribe();
+    } else if (!m->mirroron && !keepEvents()) {
+        unregisterCallback();
     }
-    lib->registerHandler(UPNP_EVENT_RENEWAL_COMPLETE, srvCB, 0);
-    lib->registerHandler(UPNP_EVENT_SUBSCRIBE_COMPLETE, srvCB, 0);
-    lib->registerHandler(UPNP_EVENT_UNSUBSCRIBE_COMPLETE, srvCB, 0);
-    lib->registerHandler(UPNP_EVENT_AUTORENEWAL_FAILED, srvCB, 0);
-    lib->registerHandler(UPNP_EVENT_RECEIVED, srvCB, 0);
-    return true;
+    m->reporter = reporter;
 }
 
-bool Service::Internal::subscribe()
+void Service::setStateMirror(bool onoff, int maxagems)
 {
-    LOGDEB1("Service::subscribe: " << eventURL << endl);
-    LibUPnP* lib = LibUPnP::getLibUPnP();
-    if (lib == 0) {
-        LOGINF("Service::subscribe: no lib" << endl);
-        return false;
+    {
+        std::unique_lock<std::mutex> lock(m->mirrormutex);
+        m->mirroron = onoff;
+        m->mirrormaxagems = maxagems > 0 ? maxagems : 0;
+        m->mirror.clear();
     }
-    int timeout = 1800;
-    int ret = UpnpSubscribe(lib->getclh(), eventURL.c_str(),
-                            &timeout, SID);
-    if (ret != UPNP_E_SUCCESS) {
-        LOGERR("Service:subscribe: failed: " << ret << " : " <<
-               UpnpGetErrorMessage(ret) << endl);
-        return false;
+    if (onoff) {
+        // Subscribing gets us the initial values in the first event.
+        if (!m->registered)
+            registerCallback();
+    } else if (m->reporter == nullptr && !keepEvents()) {
+        unregisterCallback();
     }
-    LOGDEB1("Service::subs:   " << eventURL << " SID " << SID << endl);
-    return true;
 }
 
-bool Service::Internal::unSubscribe()
+bool Service::stateMirrorEnabled() const
 {
-    LOGDEB1("Service::unSubs: " << m->eventURL << " SID " << m->SID << endl);
-    LibUPnP* lib = LibUPnP::getLibUPnP();
-    if (lib == 0) {
-        LOGINF("Service::unSubscribe: no lib" << endl);
+    return m->mirroron;
+}
+
+bool Service::startNativeEvents(const std::string& ip, int port)
+{
+    return SubscriptionManager::startNativeEvents(ip, port);
+}
+
+// The variables which describe discrete changes: all values must be
+// seen.
+static const std::unordered_set<string> o_discretevars {
+    "TransportState", "TransportStatus", "CurrentPlayMode",
+    "CurrentTransportActions", "CurrentTrack", "NumberOfTracks",
+    "CurrentTrackURI", "CurrentTrackMetaData", "AVTransportURI",
+    "AVTransportURIMetaData", "NextAVTransportURI",
+    "NextAVTransportURIMetaData", "Id", "IdArray", "Metadata", "Uri",
+    "SourceIndex", "Standby", "Mute", "LastChange"
+};
+
+bool Service::setEventRateLimit(const std::string& varname, int minintervalms)
+{
+    if (o_discretevars.find(varname) != o_discretevars.end()) {
+        LOGINF("Service::setEventRateLimit: can't limit " << varname << endl);
         return false;
     }
-    if (SID[0]) {
-        int ret = UpnpUnSubscribe(lib->getclh(), SID);
-        if (ret != UPNP_E_SUCCESS) {
-            LOGERR("Service:unSubscribe: failed: " << ret << " : " <<
-                   UpnpGetErrorMessage(ret) << endl);
-            return false;
-        }
-        // Let the caller erase m->SID[] because there may be other
-        // cleanup to do, based on its value
+    if (minintervalms > 0) {
+        m->eventrates[varname] = minintervalms;
+    } else {
+        m->eventrates.erase(varname);
+    }
+    if (m->registered) {
+        SubscriptionManager::setRateLimits(m->eventURL, m, m->eventrates);
     }
     return true;
 }
 
-void Service::registerCallback(evtCBFunc c)
-{
-    if (!m || !m->subscribe())
-        return;
-    std::unique_lock<std::mutex> lock(cblock);
-    LOGDEB1("Service::registerCallback: " << m->eventURL << " SID " <<
-            m->SID << endl);
-    o_calls[m->SID] = c;
-}
-
-void Service::unregisterCallback()
+bool Service::mirrorGet(const std::string& nm, std::string *value)
 {
-    LOGDEB1("Service::unregisterCallback: " << m->eventURL << " SID " <<
-            m->SID << endl);
-    if (m->SID[0]) {
-        m->unSubscribe();
-        std::unique_lock<std::mutex> lock(cblock);
-        o_calls.erase(m->SID);
-        m->SID[0] = 0;
+    std::unique_lock<std::mutex> lock(m->mirrormutex);
+    if (!m->mirroron || !m->registered ||
+        !SubscriptionManager::isActive(m->eventURL))
+        return false;
+    auto it = m->mirror.find(nm);
+    if (it == m->mirror.end())
+        return false;
+    if (m->mirrormaxagems > 0 && std::chrono::steady_clock::now() - 
+        it->second.when > std::chrono::milliseconds(m->mirrormaxagems)) {
+        m->mirror.erase(it);
+        return false;
     }
+    *value = it->second.value;
+    return true;
 }
 
-VarEventReporter *Service::getReporter()
+void Service::mirrorSet(const std::string& nm, const std::string& value)
 {
-    if (m)
-        return m->reporter;
-    return nullptr;
+    std::unique_lock<std::mutex> lock(m->mirrormutex);
+    if (!m->mirroron || !m->registered ||
+        !SubscriptionManager::isActive(m->eventURL))
+        return;
+    Internal::MirrorEntry& ent = m->mirror[nm];
+    ent.value = value;
+    ent.when = std::chrono::steady_clock::now();
 }
 
-void Service::installReporter(VarEventReporter* reporter)
+void Service::mirrorInvalidate(const std::string& nm)
 {
-    if (reporter) {
-        registerCallback();
-    } else {
-        unregisterCallback();
-    }
-    m->reporter = reporter;
+    std::unique_lock<std::mutex> lock(m->mirrormutex);
+    m->mirror.erase(nm);
 }
 
 void Service::reSubscribe()
 {
     LOGDEB("Service::reSubscribe()\n");
-    if (m->SID[0] == 0) {
-        LOGINF("Service::reSubscribe: no subscription (null SID)\n");
+    if (!m->registered || !m->evtcb) {
+        LOGINF("Service::reSubscribe: no callback registered\n");
         return;
     }
-    evtCBFunc c;
-    {
-        std::unique_lock<std::mutex> lock(cblock);
-        auto it = o_calls.find(m->SID);
-        if (it == o_calls.end()) {
-            LOGINF("Service::reSubscribe: no callback found for m->SID " <<
-                   m->SID << endl);
-            return;
-        }
-        c = it->second;
-    }
-    unregisterCallback();
-    registerCallback(c);
+    // Send the known values, or get a new initial event.
+    SubscriptionManager::refresh(m->eventURL, m);
 }
 
 template int Service::runSimpleAction<int>(string const&, string const&, int);
@@ -465,5 +856,11 @@ template int Service::runSimpleGet<int>(string const&, string const&, int*);
 template int Service::runSimpleGet<bool>(string const&, string const&, bool*);
 template int Service::runSimpleAction<bool>(string const&, string const&, bool);
 template int Service::runSimpleGet<string>(string const&,string const&,string*);
+template int Service::runMirroredGet<int>(string const&, string const&,
+                                          string const&, int*, bool);
+template int Service::runMirroredGet<bool>(string const&, string const&,
+                                           string const&, bool*, bool);
+template int Service::runMirroredGet<string>(string const&, string const&,
+                                             string const&, string*, bool);
 
 }
@@ -41,6 +41,9 @@ class Service;
  *
  * Runs in an event thread. This could for example be
  * implemented by a Qt Object to generate events for the GUI.
+ * The calls for a given service are serialized and performed in
+ * event order, but the calls for different services may run in
+ * parallel in different threads.
  *
  * The Service class does a bit of parsing for common cases. 
  * The different methods cover all current types of audio UPnP
@@ -57,10 +60,75 @@ public:
     /** Report change to track metadata (parsed as as Content
      * Directory entry). Not always needed */
     virtual void changed(const char * /*nm*/, UPnPDirObject /*meta*/) {}
+    /** Report change to track metadata, not yet parsed. This is
+     * called only when the value actually changed. The default
+     * implementation parses the data and calls the UPnPDirObject
+     * version. Override to avoid the parsing if it is not always
+     * needed. */
+    virtual void changed(const char *nm, const UPnPDirMeta& meta) {
+        if (meta.ok())
+            changed(nm, meta.item());
+    }
     /** Special for  ohplaylist. Not always needed */
     virtual void changed(const char * /*nm*/, std::vector<int> /*ids*/) {}
 };
 
+/** Cancellation token for action calls.
+ *
+ * Pass a pointer to Service::runAction(), or install it for the
+ * current thread with an ActionScope. Calling cancel() from any
+ * thread makes the pending and future calls using the token return
+ * UPNP_E_CANCELED at once. The underlying request is abandoned, its
+ * result will be discarded when it arrives. The object must outlive
+ * the calls which use it.
+ */
+class ActionCancel {
+public:
+    ActionCancel();
+    ~ActionCancel();
+    void cancel();
+    bool cancelled() const;
+
+    class Internal;
+private:
+    friend class Service;
+    ActionCancel(ActionCancel const&);
+    ActionCancel& operator=(ActionCancel const&);
+    Internal *m{nullptr};
+};
+
+/** Deadline and cancellation settings for the action calls performed by
+ * the current thread while the object exists.
+ *
+ * This lets the typed calls (e.g. AVTransport::play()) be bounded
+ * without changing their signatures:
+ *     {
+ *         ActionScope scope(2000, &token);
+ *         avt->play();
+ *     }
+ * Scopes can be nested, the previous values are restored by the
+ * destructor.
+ */
+class ActionScope {
+public:
+    /** @param timeoutms overall time limit for each call, in
+     *    milliseconds. 0 to use the per-service value.
+     *  @param cancel optional cancellation token.
+     */
+    ActionScope(int timeoutms, ActionCancel *cancel = nullptr);
+    ~ActionScope();
+
+    /** Values in effect for the current thread, e.g. for installing
+     *  them in a worker thread. */
+    static int currentTimeout();
+    static ActionCancel *currentCancel();
+private:
+    ActionScope(ActionScope const&);
+    ActionScope& operator=(ActionScope const&);
+    int m_prevtimeout;
+    ActionCancel *m_prevcancel;
+};
+
 /** Type of the event callbacks. 
  * If registered by a call to Service::registerCallBack(cbfunc), this will be
  * called with a map of state variable names and values when 
@@ -90,9 +158,10 @@ public:
      */
     bool initFromDescription(const UPnPDeviceDesc& description);
     
-    // Restart the subscription to get all the State variable values,
-    // in case we get the events before we are ready (e.g. before the
-    // connections are set in a qt app)
+    // Get all the State variable values again, in case we get the
+    // events before we are ready (e.g. before the connections are set
+    // in a qt app). The values are sent from the locally known state
+    // if possible, else the subscription is restarted.
     virtual void reSubscribe();
 
     const std::string& getFriendlyName() const;
@@ -111,6 +180,27 @@ public:
     virtual int runAction(const UPnPP::SoapOutgoing& args,
                           UPnPP::SoapIncoming& data);
 
+    /**
+     * Call Soap action with an explicit deadline and/or cancellation token.
+     * The values set by an ActionScope or setActionTimeout() are ignored.
+     *
+     * If the deadline expires or the token is cancelled before the
+     * device answers, this returns UPNP_E_TIMEDOUT or UPNP_E_CANCELED
+     * immediately, and the request is left to complete in the
+     * background.
+     * @param timeoutms overall time limit in milliseconds. 0 for none
+     *     (libupnp internal HTTP timeouts only).
+     * @param cancel cancellation token or nullptr.
+     */
+    int runAction(const UPnPP::SoapOutgoing& args, UPnPP::SoapIncoming& data,
+                  int timeoutms, ActionCancel *cancel);
+
+    /** Set the default time limit for the action calls on this service,
+     * in milliseconds. 0 (the default) means no limit beyond the libupnp
+     * internal HTTP timeouts. An ActionScope timeout takes precedence. */
+    void setActionTimeout(int timeoutms);
+    int getActionTimeout() const;
+
     /** Run trivial action where there are neither input parameters
        nor return data (beyond the status) */
     int runTrivialAction(const std::string& actionName);
@@ -126,6 +216,63 @@ public:
                                            const std::string& valnm,
                                            T value);
 
+    /** Enable or disable the local state mirror.
+     *
+     * When enabled, the service subscribes to events even if no
+     * reporter is installed, and the state variable values received
+     * are stored. Some typed getters (e.g. RenderingControl::getVolume(),
+     * OHVolume::volume()) then answer from the mirror without a SOAP
+     * call if the value is fresh, which means that:
+     *  - it came from an event or from a previous call, and we still
+     *    hold a subscription.
+     *  - it is not older than maxagems, if this is not 0.
+     *  - no action which could change it was performed since
+     *    (the setters invalidate or update the values they affect).
+     * Else the getter performs the call and updates the mirror. The
+     * getters have a 'fromnet' parameter to force a network call.
+     *
+     * @param maxagems maximum value age in milliseconds. 0 for no
+     *   limit: the devices only send events for changes, so an old
+     *   value is not necessarily stale.
+     */
+    void setStateMirror(bool onoff, int maxagems = 0);
+    bool stateMirrorEnabled() const;
+
+    /** Use a built-in GENA listener for the events.
+     *
+     * By default, the events are received and parsed by libupnp. With
+     * many subscriptions (e.g. monitoring many devices), this
+     * costs a lot of CPU. After this call, the new subscriptions are
+     * performed by libupnpp itself, with its own lightweight HTTP
+     * listener as callback. The existing subscriptions are not
+     * changed. Not available on Windows.
+     *
+     * @param ip local address for the listener. Empty to use the
+     *   libupnp address.
+     * @param port listener port, 0 to let the system choose.
+     * @return false if the listener could not be started.
+     */
+    static bool startNativeEvents(const std::string& ip = std::string(),
+                                  int port = 0);
+
+    /** Limit the event delivery rate for a state variable.
+     *
+     * Some devices send position updates (e.g. RelativeTimePosition
+     * inside LastChange, or OHTime Seconds) several times per
+     * second. When a limit is set, the values which arrive less than
+     * minintervalms after the previous delivery are held back, and
+     * only the last one is delivered when the interval has
+     * elapsed. Other variables are not affected. The state variables
+     * which describe discrete changes (transport state, track, etc.)
+     * can't be limited.
+     *
+     * @param varname state variable name.
+     * @param minintervalms minimum interval between deliveries. 0
+     *   removes the limit.
+     * @return false if the variable can't be limited.
+     */
+    bool setEventRateLimit(const std::string& varname, int minintervalms);
+
     /** Get pointer to installed event reporter
      *
      * This is used by a derived class event handling method and
@@ -160,9 +307,12 @@ protected:
         return true;
     }
 
-    /** Used by a derived class to register its callback method. This
-     * creates an entry in the static map, using m_SID, which was
-     * obtained by subscribe() during construction
+    /** Used by a derived class to register its callback method.
+     *
+     * All the Service objects for a given event URL share a single
+     * subscription to the device. The first one creates it, the
+     * following ones are added as listeners, and receive the last
+     * known values of all variables at once.
      */
     void registerCallback(evtCBFunc c);
 
@@ -178,6 +328,39 @@ protected:
     /** Cancel subscription to the service events, forget installed callback */
     void unregisterCallback();
 
+    /** Is our callback registered ? */
+    bool callbackRegistered() const;
+    /** Is our callback registered, and do we currently hold a
+     * subscription (so that we will see the changes) ? */
+    bool eventsActive() const;
+
+    /** To be overridden by a derived class which uses the events for
+     * its own purposes even with no reporter installed: removing the
+     * reporter or disabling the mirror then keeps the subscription. */
+    virtual bool keepEvents() const {
+        return false;
+    }
+
+    /** State mirror access for the derived class getters and event
+     * callbacks. Values are stored as strings, as received in events. 
+     * mirrorGet() returns false if the mirror is disabled or the value
+     * is not fresh. The event values are stored automatically, except
+     * for LastChange, which the derived class should decode and
+     * store.
+     */
+    bool mirrorGet(const std::string& nm, std::string *value);
+    void mirrorSet(const std::string& nm, const std::string& value);
+    void mirrorInvalidate(const std::string& nm);
+
+    /** Like runSimpleGet(), but try the state mirror first (unless
+     * fromnet is set), and update it with the result.
+     * @param varnm the state variable name in the mirror.
+     */
+    template <class T> int runMirroredGet(const std::string& actnm,
+                                          const std::string& valnm,
+                                          const std::string& varnm,
+                                          T *valuep, bool fromnet = false);
+
 private:
     // Can't copy these because this does not make sense for the
     // member function callback.
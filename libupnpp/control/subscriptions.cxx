@@ -0,0 +1,1268 @@
+/* Copyright (C) 2006-2016 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+#include "libupnpp/config.h"
+
+#include "libupnpp/control/subscriptions.hxx"
+
+#include <string.h>
+
+#include <upnp/upnp.h>
+#include <upnp/upnptools.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "libupnpp/control/avlastchg.hxx"
+#include "libupnpp/control/description.hxx"
+#include "libupnpp/control/discovery.hxx"
+#include "libupnpp/control/gena.hxx"
+#include "libupnpp/ixmlwrap.hxx"
+#include "libupnpp/log.hxx"
+#include "libupnpp/upnpplib.hxx"
+
+using namespace std;
+using namespace UPnPP;
+
+#if UPNP_VERSION_MINOR < 8 && !defined(UpnpEvent_get_SID_cstr)
+typedef struct Upnp_Event UpnpEvent;
+#define UpnpEvent_get_SID_cstr(x) ((x)->Sid)
+#define UpnpEvent_get_EventKey(x) ((x)->EventKey)
+#define UpnpEvent_get_ChangedVariables(x) ((x)->ChangedVariables)
+#endif
+
+#if UPNP_VERSION_MINOR < 8 && !defined(UpnpEventSubscribe_get_SID_cstr)
+typedef struct Upnp_Event_Subscribe UpnpEventSubscribe;
+#define UpnpEventSubscribe_get_SID_cstr(x) ((x)->Sid)
+#define UpnpEventSubscribe_get_ErrCode(x) ((x)->ErrCode)
+#define UpnpEventSubscribe_get_TimeOut(x) ((x)->TimeOut)
+#endif
+
+#if UPNP_VERSION_MAJOR > 1 || (UPNP_VERSION_MAJOR==1 && UPNP_VERSION_MINOR >= 8)
+#define CBCONST const
+#else
+#define CBCONST 
+#endif
+
+namespace UPnPClient {
+
+typedef std::unordered_map<string, string> EventProps;
+typedef std::chrono::steady_clock::time_point TimePoint;
+
+// Requested subscription duration (seconds)
+static const int subsTimeoutS = 1800;
+// Delay after the expected expiry before we decide that the renewal
+// was lost
+static const int expiryGraceS = 30;
+// Resubscribe delays after failures (milliseconds)
+static const int retryMinMs = 1000;
+static const int retryMaxMs = 60000;
+
+// Merge decoded LastChange values into an accumulated state.
+static void mergeLastChange(const AVLastChange& from, AVLastChange& to)
+{
+    for (size_t i = 0; i < from.size(); i++) {
+        const AVLastChange::Var& var = from[i];
+        to.set(var.name(), var.instance, var.channel(), var.value);
+    }
+}
+
+/** One event listener (Service object) for a subscription. */
+class Listener {
+public:
+    Listener(const void *_id, evtCBFunc _func)
+        : id(_id), func(_func) {}
+    // Opaque listener identifier
+    const void *id;
+    evtCBFunc func;
+    // Optional rate limits: minimum interval between deliveries (ms)
+    // per variable, and the state for coalescing the values.
+    std::unordered_map<string, int> rates;
+    std::unordered_map<string, TimePoint> lastsent;
+    // Values held back, plain and from LastChange.
+    EventProps pending;
+    AVLastChange lcpending;
+    bool flushscheduled{false};
+
+    // Compute what should be delivered now out of props. The values of
+    // rate-limited variables which come too early are held back. The
+    // time for flushing them is returned in flushat if a new flush is
+    // needed. Returns false if there is nothing to deliver now.
+    bool filter(const EventProps& props, TimePoint now, EventProps& out,
+                TimePoint *flushat);
+    // Take the held back values.
+    bool takePending(TimePoint now, EventProps& out);
+
+private:
+    bool due(const string& nm, TimePoint now, bool *limited) {
+        auto rit = rates.find(nm);
+        *limited = rit != rates.end();
+        if (!*limited)
+            return true;
+        auto lit = lastsent.find(nm);
+        return lit == lastsent.end() ||
+            now - lit->second >= std::chrono::milliseconds(rit->second);
+    }
+};
+
+bool Listener::filter(const EventProps& props, TimePoint now, EventProps& out,
+                      TimePoint *flushat)
+{
+    bool held = false;
+    bool limited;
+    for (const auto& prop : props) {
+        if (prop.first != "LastChange") {
+            if (due(prop.first, now, &limited)) {
+                out.insert(prop);
+                if (limited)
+                    lastsent[prop.first] = now;
+                pending.erase(prop.first);
+            } else {
+                pending[prop.first] = prop.second;
+                held = true;
+            }
+            continue;
+        }
+        // LastChange: deliver the whole value if it holds anything
+        // which is not limited or due, else keep the values for later.
+        AVLastChange vals;
+        if (!decodeAVLastChange(prop.second, vals)) {
+            out.insert(prop);
+            continue;
+        }
+        bool deliver = false;
+        for (size_t i = 0; i < vals.size(); i++) {
+            if (due(vals[i].name(), now, &limited)) {
+                deliver = true;
+                break;
+            }
+        }
+        if (deliver) {
+            out.insert(prop);
+            for (size_t i = 0; i < vals.size(); i++) {
+                if (rates.find(vals[i].name()) != rates.end())
+                    lastsent[vals[i].name()] = now;
+            }
+            // Drop the held back values which this one supersedes
+            if (lcpending.size()) {
+                AVLastChange remain;
+                for (size_t i = 0; i < lcpending.size(); i++) {
+                    const AVLastChange::Var& var = lcpending[i];
+                    if (!vals.find(var.name(), var.instance, var.channel()))
+                        remain.set(var.name(), var.instance, var.channel(),
+                                   var.value);
+                }
+                lcpending = std::move(remain);
+            }
+        } else {
+            mergeLastChange(vals, lcpending);
+            held = true;
+        }
+    }
+    if (held && !flushscheduled) {
+        // Flush when the first held back variable becomes due.
+        TimePoint when = TimePoint::max();
+        vector<const string*> names;
+        for (const auto& ent : pending) {
+            names.push_back(&ent.first);
+        }
+        for (size_t i = 0; i < lcpending.size(); i++) {
+            names.push_back(&lcpending[i].name());
+        }
+        for (const auto nm : names) {
+            auto rit = rates.find(*nm);
+            if (rit == rates.end())
+                continue;
+            TimePoint t = lastsent[*nm] +
+                std::chrono::milliseconds(rit->second);
+            if (t < when)
+                when = t;
+        }
+        if (when == TimePoint::max())
+            when = now;
+        *flushat = when;
+        flushscheduled = true;
+    }
+    return !out.empty();
+}
+
+bool Listener::takePending(TimePoint now, EventProps& out)
+{
+    flushscheduled = false;
+    out = std::move(pending);
+    pending.clear();
+    for (const auto& ent : out) {
+        lastsent[ent.first] = now;
+    }
+    if (lcpending.size()) {
+        for (size_t i = 0; i < lcpending.size(); i++) {
+            lastsent[lcpending[i].name()] = now;
+        }
+        out["LastChange"] = lcpending.toXML();
+        lcpending.clear();
+    }
+    return !out.empty();
+}
+
+/** Shared event subscription for one event URL. */
+class Subscription {
+public:
+    string eventURL;
+    string deviceId;
+    // Current SID, empty if we have no subscription
+    string sid;
+    // Subscription needed: initial, or after failure/expiry
+    bool needsub{true};
+    // A worker is performing the exchange
+    bool subscribing{false};
+    // No more listeners, entry erased from the maps
+    bool removed{false};
+    // Consecutive failed attempts
+    int retries{0};
+    TimePoint expires;
+    // Using our own GENA listener instead of libupnp. We then perform
+    // the renewals, at renewat.
+    bool native{false};
+    TimePoint renewat;
+    vector<Listener> listeners;
+
+    // Last values of the plain state variables
+    EventProps state;
+    // LastChange is a list of changes: we merge them. The deltas
+    // are only decoded when needed.
+    vector<string> lcdeltas;
+    AVLastChange lcstate;
+
+    bool hasState() const {
+        return !state.empty() || !lcdeltas.empty() || lcstate.size();
+    }
+    void merge(const EventProps& props) {
+        for (const auto& prop : props) {
+            if (prop.first == "LastChange") {
+                lcdeltas.push_back(prop.second);
+                if (lcdeltas.size() > 16)
+                    compactLastChange();
+            } else {
+                state[prop.first] = prop.second;
+            }
+        }
+    }
+    void compactLastChange() {
+        AVLastChange delta;
+        for (const auto& xml : lcdeltas) {
+            if (decodeAVLastChange(xml, delta))
+                mergeLastChange(delta, lcstate);
+        }
+        lcdeltas.clear();
+    }
+    // Build an event holding all the values we know
+    void fullState(EventProps& out) {
+        out = state;
+        compactLastChange();
+        if (lcstate.size()) {
+            out["LastChange"] = lcstate.toXML();
+        }
+    }
+    int retryDelayMs() const {
+        int ms = retryMinMs;
+        for (int i = 1; i < retries && ms < retryMaxMs; i++)
+            ms *= 2;
+        return std::min(ms, retryMaxMs);
+    }
+};
+
+// Protects the subscriptions maps and their contents
+static std::mutex o_mutex;
+// Subscriptions indexed by event URL and by SID
+static std::unordered_map<string, std::shared_ptr<Subscription> > o_subsbyurl;
+static std::unordered_map<string, std::shared_ptr<Subscription> > o_subsbysid;
+// Events which arrived before their subscription was registered (the
+// initial event can come before UpnpSubscribe() returns). Bounded.
+static std::unordered_map<string, vector<EventProps> > o_earlyevents;
+// Count of subscriptions with a SUBSCRIBE or renewal in progress
+// (subscribing flag set), so that a NOTIFY for an unknown SID can be
+// rejected without walking the table.
+static int o_subscribing{0};
+
+// Join the pool threads. Shutting down from one of them (e.g. from
+// an event callback) must not join itself: detach it instead.
+static void joinAll(vector<std::thread>& threads)
+{
+    for (auto& thr : threads) {
+        if (thr.get_id() == std::this_thread::get_id()) {
+            thr.detach();
+        } else if (thr.joinable()) {
+            thr.join();
+        }
+    }
+    threads.clear();
+}
+
+// Event dispatching. srvCB() runs in a libupnp thread: it decodes the
+// property set and queues the result on a per-subscription (event
+// URL) queue. A small pool of threads drains the queues, so that the
+// events for a given subscription are delivered in order, while
+// different subscriptions are processed in parallel. A queue holding
+// a transport state change goes to a priority lane, ahead of the
+// others (e.g. OHTime seconds ticks). Delayed flushes of coalesced
+// values (rate limiting) go through the same queues, so that the
+// order is preserved.
+class EventDispatcher {
+public:
+    // Number of delivery threads
+    static const int nworkers = 4;
+    // Max events delivered in a row for one subscription, before
+    // letting the others go.
+    static const int batchsize = 8;
+
+    ~EventDispatcher() {
+        shutdown();
+    }
+
+    // Stop the workers after their current delivery. The events not
+    // yet delivered are dropped, and post() does nothing afterwards.
+    void shutdown() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop = true;
+            wcond.notify_all();
+        }
+        joinAll(threads);
+    }
+
+    // EVT_CHANGE: values changed. EVT_INITIAL: initial event for a
+    // new subscription. EVT_REPLAY: the props are ignored and the
+    // full state is sent to the target listener, or all listeners if
+    // target is null. EVT_FLUSH: internal, see postFlush().
+    enum EvtKind {EVT_CHANGE, EVT_INITIAL, EVT_REPLAY, EVT_FLUSH};
+
+    void post(const string& url, EventProps&& props, bool prio,
+              EvtKind kind = EVT_CHANGE, const void *target = nullptr) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (stop)
+            return;
+        startWorkers();
+        enqueue(url, std::move(props), prio, kind, target);
+    }
+
+    // Deliver the values held back for the listener at the given time.
+    void postFlush(const string& url, const void *target, TimePoint when) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (stop)
+            return;
+        startWorkers();
+        timers.insert(make_pair(when, make_pair(url, target)));
+        wcond.notify_one();
+    }
+
+    // Wait for a running callback to return, so that the caller can
+    // get rid of the object it references. Does not wait if called
+    // from the callback itself.
+    void waitRunning(const string& url) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            auto it = queues.find(url);
+            if (it == queues.end() || !it->second.running ||
+                it->second.runner == std::this_thread::get_id())
+                return;
+            fcond.wait(lock);
+        }
+    }
+
+private:
+    class Event {
+    public:
+        EventProps props;
+        bool prio;
+        EvtKind kind;
+        const void *target;
+    };
+    class UrlQueue {
+    public:
+        std::deque<Event> events;
+        // Count of priority events in the queue
+        int nprio{0};
+        // Listed in a ready lane
+        bool scheduled{false};
+        // A worker is delivering an event
+        bool running{false};
+        std::thread::id runner;
+    };
+
+    void worker();
+    void startWorkers() {
+        if (threads.empty()) {
+            for (int i = 0; i < nworkers; i++) {
+                threads.push_back(std::thread(&EventDispatcher::worker, this));
+            }
+        }
+    }
+    // Move the due flushes to their queues. Returns the next
+    // expiration time, or max if there is none.
+    TimePoint runTimers() {
+        TimePoint now = std::chrono::steady_clock::now();
+        while (!timers.empty() && timers.begin()->first <= now) {
+            auto tit = timers.begin();
+            enqueue(tit->second.first, EventProps(), false, EVT_FLUSH,
+                    tit->second.second);
+            timers.erase(tit);
+        }
+        return timers.empty() ? TimePoint::max() : timers.begin()->first;
+    }
+    // Call with the lock held
+    void enqueue(const string& url, EventProps&& props, bool prio,
+                 EvtKind kind, const void *target) {
+        UrlQueue& q = queues[url];
+        q.events.push_back(Event());
+        q.events.back().props = std::move(props);
+        q.events.back().prio = prio;
+        q.events.back().kind = kind;
+        q.events.back().target = target;
+        if (prio)
+            q.nprio++;
+        if (!q.scheduled) {
+            q.scheduled = true;
+            (prio ? prioready : ready).push_back(url);
+            wcond.notify_one();
+        } else if (prio && !q.running) {
+            // Move up to the priority lane. The old entry is skipped
+            // by the workers when they find the queue empty or running.
+            prioready.push_back(url);
+            wcond.notify_one();
+        }
+    }
+
+    std::mutex mutex;
+    // Workers wait for ready queues on this
+    std::condition_variable wcond;
+    // waitRunning() waits for the end of a running callback on this
+    std::condition_variable fcond;
+    std::unordered_map<string, UrlQueue> queues;
+    // URLs of the queues which have events to deliver
+    std::deque<string> prioready;
+    std::deque<string> ready;
+    // Pending flushes: time -> (url, listener)
+    std::multimap<TimePoint, pair<string, const void*> > timers;
+    vector<std::thread> threads;
+    bool stop{false};
+};
+static EventDispatcher o_dispatcher;
+
+// Set while the callbacks run for an initial event or a replay of the
+// known state, see SubscriptionManager::isFullState()
+static thread_local bool o_fullstate{false};
+
+// Call the listener callbacks for one event, or send the full state,
+// or the values held back for rate limiting.
+static void deliverEvent(const string& url, const EventProps& props,
+                         EventDispatcher::EvtKind kind, const void *target)
+{
+    vector<pair<evtCBFunc, const EventProps*> > calls;
+    // Per-listener values when rate limiting is used
+    std::deque<EventProps> filtered;
+    vector<pair<const void*, TimePoint> > flushes;
+    EventProps full;
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        auto it = o_subsbyurl.find(url);
+        if (it == o_subsbyurl.end()) {
+            return;
+        }
+        Subscription& sub = *(it->second);
+        TimePoint now = std::chrono::steady_clock::now();
+        switch (kind) {
+        case EventDispatcher::EVT_CHANGE:
+        case EventDispatcher::EVT_INITIAL:
+            sub.merge(props);
+            break;
+        case EventDispatcher::EVT_REPLAY:
+            sub.fullState(full);
+            break;
+        case EventDispatcher::EVT_FLUSH:
+            break;
+        }
+        for (auto& listener : sub.listeners) {
+            if (target != nullptr && listener.id != target) {
+                continue;
+            }
+            if (kind == EventDispatcher::EVT_FLUSH) {
+                filtered.push_back(EventProps());
+                if (listener.takePending(now, filtered.back())) {
+                    calls.push_back(make_pair(listener.func, &filtered.back()));
+                }
+            } else if (kind == EventDispatcher::EVT_REPLAY) {
+                // The full state supersedes anything held back.
+                listener.pending.clear();
+                listener.lcpending.clear();
+                calls.push_back(make_pair(listener.func, &full));
+            } else if (listener.rates.empty()) {
+                calls.push_back(make_pair(listener.func, &props));
+            } else {
+                filtered.push_back(EventProps());
+                TimePoint flushat;
+                bool flush = listener.flushscheduled;
+                if (listener.filter(props, now, filtered.back(), &flushat)) {
+                    calls.push_back(make_pair(listener.func, &filtered.back()));
+                }
+                if (!flush && listener.flushscheduled) {
+                    flushes.push_back(make_pair(listener.id, flushat));
+                }
+            }
+        }
+    }
+    for (const auto& flush : flushes) {
+        o_dispatcher.postFlush(url, flush.first, flush.second);
+    }
+    // The listeners can't go away while we run: removeListener() calls
+    // waitRunning().
+    o_fullstate = kind == EventDispatcher::EVT_INITIAL ||
+        kind == EventDispatcher::EVT_REPLAY;
+    for (auto& call : calls) {
+        call.first(*call.second);
+    }
+    o_fullstate = false;
+}
+
+void EventDispatcher::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        TimePoint next = runTimers();
+        while (!stop && prioready.empty() && ready.empty()) {
+            if (next == TimePoint::max()) {
+                wcond.wait(lock);
+            } else {
+                wcond.wait_until(lock, next);
+            }
+            next = runTimers();
+        }
+        if (stop)
+            return;
+        std::deque<string>& lane = prioready.empty() ? ready : prioready;
+        string url(std::move(lane.front()));
+        lane.pop_front();
+
+        auto it = queues.find(url);
+        // Stale entry: already handled, or being delivered by
+        // another worker, which will reschedule if needed.
+        if (it == queues.end() || it->second.events.empty() ||
+            it->second.running) {
+            continue;
+        }
+        // The reference stays valid while running is set: only the
+        // runner erases a running queue.
+        UrlQueue& q = it->second;
+        q.running = true;
+        q.runner = std::this_thread::get_id();
+        for (int i = 0; i < batchsize && !q.events.empty(); i++) {
+            Event ev(std::move(q.events.front()));
+            q.events.pop_front();
+            if (ev.prio)
+                q.nprio--;
+            lock.unlock();
+            deliverEvent(url, ev.props, ev.kind, ev.target);
+            lock.lock();
+        }
+        q.running = false;
+        q.runner = std::thread::id();
+        if (q.events.empty()) {
+            queues.erase(url);
+        } else {
+            // Let the others go before continuing.
+            (q.nprio ? prioready : ready).push_back(url);
+            wcond.notify_one();
+        }
+        fcond.notify_all();
+    }
+}
+
+// Subscription work: a pool of threads performing the subscription
+// exchanges, possibly delayed (retries, expiry checks). Tasks are just
+// event URLs: the worker looks at the Subscription state to decide
+// what to do.
+class SubscriptionWorkers {
+public:
+    static const int nworkers = 4;
+
+    ~SubscriptionWorkers() {
+        shutdown();
+    }
+
+    // Stop the workers. A worker inside a subscription exchange
+    // finishes it first. The pending tasks are dropped.
+    void shutdown() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop = true;
+            cond.notify_all();
+        }
+        joinAll(threads);
+    }
+
+    void schedule(const string& url, int delayms) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (stop)
+            return;
+        if (threads.empty()) {
+            for (int i = 0; i < nworkers; i++) {
+                threads.push_back(
+                    std::thread(&SubscriptionWorkers::worker, this));
+            }
+        }
+        tasks.insert(make_pair(std::chrono::steady_clock::now() +
+                               std::chrono::milliseconds(delayms), url));
+        cond.notify_one();
+    }
+
+private:
+    void worker();
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::multimap<TimePoint, string> tasks;
+    vector<std::thread> threads;
+    bool stop{false};
+};
+static SubscriptionWorkers o_subsworkers;
+
+// Native GENA listener, if enabled, and the matching CALLBACK URL.
+static std::unique_ptr<GenaListener> o_native;
+static string o_nativecallback;
+
+// The statics of this file are destroyed in reverse order, but the
+// worker threads use all of them: stop the threads first. Defined
+// after the objects which the shutdown uses.
+class ShutdownGuard {
+public:
+    ~ShutdownGuard() {
+        SubscriptionManager::shutdown();
+    }
+};
+static ShutdownGuard o_shutdownguard;
+
+static bool doSubscribe(const string& url, const string& callback,
+                        string& sid, int *timeoutp)
+{
+    *timeoutp = subsTimeoutS;
+    if (!callback.empty()) {
+        if (!genaSubscribe(url, callback, sid, timeoutp)) {
+            return false;
+        }
+        LOGDEB1("Service::subs:   " << url << " SID " << sid << endl);
+        return true;
+    }
+    LibUPnP* lib = LibUPnP::getLibUPnP();
+    if (lib == 0) {
+        LOGINF("Service::subscribe: no lib" << endl);
+        return false;
+    }
+    Upnp_SID usid;
+    int ret = UpnpSubscribe(lib->getclh(), url.c_str(), timeoutp, usid);
+    if (ret != UPNP_E_SUCCESS) {
+        LOGERR("Service:subscribe: failed: " << ret << " : " <<
+               UpnpGetErrorMessage(ret) << " for " << url << endl);
+        return false;
+    }
+    sid = usid;
+    LOGDEB1("Service::subs:   " << url << " SID " << sid << endl);
+    return true;
+}
+
+static bool doUnSubscribe(const string& url, const string& sid, bool native)
+{
+    LOGDEB1("Service::unSubs: SID " << sid << endl);
+    if (native) {
+        return genaUnSubscribe(url, sid);
+    }
+    LibUPnP* lib = LibUPnP::getLibUPnP();
+    if (lib == 0) {
+        LOGINF("Service::unSubscribe: no lib" << endl);
+        return false;
+    }
+    Upnp_SID usid;
+    strncpy(usid, sid.c_str(), sizeof(Upnp_SID));
+    usid[sizeof(Upnp_SID)-1] = 0;
+    int ret = UpnpUnSubscribe(lib->getclh(), usid);
+    if (ret != UPNP_E_SUCCESS) {
+        LOGERR("Service:unSubscribe: failed: " << ret << " : " <<
+               UpnpGetErrorMessage(ret) << endl);
+        return false;
+    }
+    return true;
+}
+
+// Renew a native subscription. libupnp does this by itself for the
+// others.
+static void renewSubscription(std::shared_ptr<Subscription> sub,
+                              const string& sid)
+{
+    const string& url = sub->eventURL;
+    int timeout = subsTimeoutS;
+    bool ok = genaRenew(url, sid, &timeout);
+    int delayms = 0;
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        sub->subscribing = false;
+        o_subscribing--;
+        if (sub->removed) {
+            lock.unlock();
+            genaUnSubscribe(url, sid);
+            return;
+        }
+        if (ok) {
+            TimePoint now = std::chrono::steady_clock::now();
+            sub->expires = now + std::chrono::seconds(timeout);
+            sub->renewat = now + std::chrono::seconds(timeout / 2);
+            delayms = timeout / 2 * 1000;
+        } else {
+            // Subscribe again now.
+            sub->needsub = true;
+        }
+    }
+    o_subsworkers.schedule(url, delayms);
+}
+
+// Process a task for the URL: check the subscription state, and
+// subscribe if needed.
+static void processSubscription(const string& url)
+{
+    std::shared_ptr<Subscription> sub;
+    string oldsid;
+    string callback;
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        auto it = o_subsbyurl.find(url);
+        if (it == o_subsbyurl.end())
+            return;
+        sub = it->second;
+        if (sub->subscribing)
+            return;
+        TimePoint now = std::chrono::steady_clock::now();
+        if (!sub->needsub && !sub->sid.empty() && now > sub->expires) {
+            LOGINF("Service: subscription for " << url <<
+                   " expired without renewal" << endl);
+            sub->needsub = true;
+        }
+        if (!sub->needsub) {
+            if (!sub->native || now < sub->renewat)
+                return;
+            sub->subscribing = true;
+            o_subscribing++;
+            oldsid = sub->sid;
+            lock.unlock();
+            renewSubscription(sub, oldsid);
+            return;
+        }
+        sub->subscribing = true;
+        o_subscribing++;
+        oldsid = sub->sid;
+        if (sub->native)
+            callback = o_nativecallback;
+    }
+
+    if (!oldsid.empty()) {
+        // May fail if the device already dropped it, no matter.
+        doUnSubscribe(url, oldsid, sub->native);
+    }
+    string sid;
+    int timeout;
+    bool ok = doSubscribe(url, callback, sid, &timeout);
+
+    bool replay = false;
+    int delayms = 0;
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        sub->subscribing = false;
+        o_subscribing--;
+        if (sub->removed) {
+            lock.unlock();
+            if (ok)
+                doUnSubscribe(url, sid, sub->native);
+            return;
+        }
+        if (!oldsid.empty()) {
+            o_subsbysid.erase(oldsid);
+            sub->sid.clear();
+        }
+        if (ok) {
+            sub->sid = sid;
+            sub->needsub = false;
+            sub->retries = 0;
+            if (timeout <= 0)
+                timeout = subsTimeoutS;
+            sub->expires = std::chrono::steady_clock::now() +
+                std::chrono::seconds(timeout);
+            o_subsbysid[sid] = sub;
+            auto eit = o_earlyevents.find(sid);
+            if (eit != o_earlyevents.end()) {
+                for (const auto& props : eit->second) {
+                    sub->merge(props);
+                }
+                o_earlyevents.erase(eit);
+                replay = true;
+            }
+            if (sub->native) {
+                // We renew at half time
+                sub->renewat = std::chrono::steady_clock::now() +
+                    std::chrono::seconds(timeout / 2);
+                delayms = timeout / 2 * 1000;
+            } else {
+                // Check that the renewals happen.
+                delayms = (timeout + expiryGraceS) * 1000;
+            }
+        } else {
+            sub->retries++;
+            delayms = sub->retryDelayMs();
+            LOGINF("Service: will retry subscription for " << url <<
+                   " in " << delayms << " mS" << endl);
+        }
+    }
+    if (replay) {
+        o_dispatcher.post(url, EventProps(), false,
+                          EventDispatcher::EVT_REPLAY);
+    }
+    o_subsworkers.schedule(url, delayms);
+}
+
+void SubscriptionWorkers::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        while (!stop && (tasks.empty() || tasks.begin()->first >
+                         std::chrono::steady_clock::now())) {
+            if (tasks.empty()) {
+                cond.wait(lock);
+            } else {
+                cond.wait_until(lock, tasks.begin()->first);
+            }
+        }
+        if (stop)
+            return;
+        string url(std::move(tasks.begin()->second));
+        tasks.erase(tasks.begin());
+        lock.unlock();
+        processSubscription(url);
+        lock.lock();
+    }
+}
+
+// The subscription for this SID is lost: schedule a new one.
+static void subscriptionLost(const string& sid, int errcode)
+{
+    string url;
+    int delayms;
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        auto it = o_subsbysid.find(sid);
+        if (it == o_subsbysid.end())
+            return;
+        Subscription& sub = *(it->second);
+        url = sub.eventURL;
+        LOGINF("Service: subscription lost for " << url << " error " <<
+               errcode << endl);
+        sub.needsub = true;
+        sub.retries++;
+        delayms = sub.retryDelayMs();
+    }
+    o_subsworkers.schedule(url, delayms);
+}
+
+static void subscriptionRenewed(const string& sid, int timeout)
+{
+    std::unique_lock<std::mutex> lock(o_mutex);
+    auto it = o_subsbysid.find(sid);
+    if (it == o_subsbysid.end())
+        return;
+    if (timeout <= 0)
+        timeout = subsTimeoutS;
+    it->second->expires = std::chrono::steady_clock::now() +
+        std::chrono::seconds(timeout);
+    string url(it->second->eventURL);
+    lock.unlock();
+    o_subsworkers.schedule(url, (timeout + expiryGraceS) * 1000);
+}
+
+// Discovery: a device appeared or announced itself. If one of its
+// subscriptions is broken, don't wait for the next retry.
+static bool deviceSeen(const UPnPDeviceDesc& dev, const UPnPServiceDesc&)
+{
+    vector<string> urls;
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        for (auto& ent : o_subsbyurl) {
+            Subscription& sub = *(ent.second);
+            if (sub.needsub && !sub.subscribing && sub.retries > 0 &&
+                sub.deviceId == dev.UDN) {
+                sub.retries = 0;
+                urls.push_back(ent.first);
+            }
+        }
+    }
+    for (const auto& url : urls) {
+        LOGDEB("Service: device back, subscribing to " << url << endl);
+        o_subsworkers.schedule(url, 0);
+    }
+    return true;
+}
+
+// Discovery: the device went away. The subscriptions are dead on its
+// side. Try again later, or when it comes back.
+static void deviceLost(const string& udn)
+{
+    vector<string> urls;
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        for (auto& ent : o_subsbyurl) {
+            Subscription& sub = *(ent.second);
+            if (sub.deviceId == udn && !sub.needsub) {
+                sub.needsub = true;
+                sub.retries = 1;
+                urls.push_back(ent.first);
+            }
+        }
+    }
+    for (const auto& url : urls) {
+        o_subsworkers.schedule(url, retryMaxMs);
+    }
+}
+
+// Transport state changes go to the priority lane. They come either
+// as a plain variable (OpenHome) or inside LastChange (AVTransport).
+static bool isPriorityEvent(const EventProps& props)
+{
+    if (props.find("TransportState") != props.end())
+        return true;
+    auto it = props.find("LastChange");
+    return it != props.end() &&
+        it->second.find("TransportState") != string::npos;
+}
+
+// Queue event data for delivery, from libupnp or from our
+// listener. initial is set for the first event of a subscription
+// (sequence number 0). Returns false if the SID is unknown and can't
+// belong to a subscription being set up.
+static bool eventReceived(const string& sid, bool initial,
+                          EventProps&& props)
+{
+    string url;
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        auto it = o_subsbysid.find(sid);
+        if (it == o_subsbysid.end()) {
+            // The initial event can arrive before the SUBSCRIBE
+            // response: keep it if a request is in progress.
+            bool pending = o_subscribing > 0 ||
+                o_earlyevents.find(sid) != o_earlyevents.end();
+            if (!pending) {
+                LOGDEB("Service::srvCB: unknown sid " << sid << endl);
+                return false;
+            }
+            LOGDEB("Service::srvCB: no subscription (yet?) for sid " <<
+                   sid << endl);
+            if (o_earlyevents.size() > 20)
+                o_earlyevents.clear();
+            vector<EventProps>& early = o_earlyevents[sid];
+            if (early.size() < 10)
+                early.push_back(std::move(props));
+            return true;
+        }
+        url = it->second->eventURL;
+    }
+    bool prio = isPriorityEvent(props);
+    o_dispatcher.post(url, std::move(props), prio, initial ?
+                      EventDispatcher::EVT_INITIAL :
+                      EventDispatcher::EVT_CHANGE);
+    return true;
+}
+
+// The static event callback given to libupnp
+static int srvCB(Upnp_EventType et, CBCONST void* vevp, void*)
+{
+    LOGDEB0("Service:srvCB: " << LibUPnP::evTypeAsString(et) << endl);
+
+    switch (et) {
+    case UPNP_EVENT_RENEWAL_COMPLETE:
+    {
+        UpnpEventSubscribe *esp = (UpnpEventSubscribe *)vevp;
+        if (UpnpEventSubscribe_get_ErrCode(esp) == UPNP_E_SUCCESS) {
+            subscriptionRenewed(UpnpEventSubscribe_get_SID_cstr(esp),
+                                UpnpEventSubscribe_get_TimeOut(esp));
+        } else {
+            subscriptionLost(UpnpEventSubscribe_get_SID_cstr(esp),
+                             UpnpEventSubscribe_get_ErrCode(esp));
+        }
+        break;
+    }
+    case UPNP_EVENT_AUTORENEWAL_FAILED:
+    case UPNP_EVENT_SUBSCRIPTION_EXPIRED:
+    {
+        UpnpEventSubscribe *esp = (UpnpEventSubscribe *)vevp;
+        subscriptionLost(UpnpEventSubscribe_get_SID_cstr(esp),
+                         UpnpEventSubscribe_get_ErrCode(esp));
+        break;
+    }
+    case UPNP_EVENT_SUBSCRIBE_COMPLETE:
+    case UPNP_EVENT_UNSUBSCRIBE_COMPLETE:
+        break;
+
+    case UPNP_EVENT_RECEIVED:
+    {
+        UpnpEvent *evp = (UpnpEvent *)vevp;
+        LOGDEB1("Service:srvCB: var change event: SID " <<
+                UpnpEvent_get_SID_cstr(evp) << " EventKey " <<
+                UpnpEvent_get_EventKey(evp) << " changed " <<
+                ixmlwPrintDoc(UpnpEvent_get_ChangedVariables(evp)) << endl);
+
+        EventProps props;
+        if (!decodePropertySet(UpnpEvent_get_ChangedVariables(evp), props)) {
+            LOGERR("Service::srvCB: could not decode EVENT propertyset" <<endl);
+            return UPNP_E_BAD_RESPONSE;
+        }
+
+        eventReceived(UpnpEvent_get_SID_cstr(evp),
+                      UpnpEvent_get_EventKey(evp) == 0, std::move(props));
+        break;
+    }
+
+    default:
+        // Ignore other events for now
+        LOGDEB("Service:srvCB: unprocessed evt type: [" <<
+               LibUPnP::evTypeAsString(et) << "]"  << endl);
+        break;
+    }
+
+    return UPNP_E_SUCCESS;
+}
+
+bool SubscriptionManager::init()
+{
+    static std::mutex initlock;
+    static bool eventinit(false);
+
+    std::unique_lock<std::mutex> lock(initlock);
+    if (eventinit)
+        return true;
+    eventinit = true;
+
+    LibUPnP *lib = LibUPnP::getLibUPnP();
+    if (lib == 0) {
+        LOGERR("Service::initEvents: Can't get lib" << endl);
+        return false;
+    }
+    lib->registerHandler(UPNP_EVENT_RENEWAL_COMPLETE, srvCB, 0);
+    lib->registerHandler(UPNP_EVENT_SUBSCRIBE_COMPLETE, srvCB, 0);
+    lib->registerHandler(UPNP_EVENT_UNSUBSCRIBE_COMPLETE, srvCB, 0);
+    lib->registerHandler(UPNP_EVENT_AUTORENEWAL_FAILED, srvCB, 0);
+    lib->registerHandler(UPNP_EVENT_SUBSCRIPTION_EXPIRED, srvCB, 0);
+    lib->registerHandler(UPNP_EVENT_RECEIVED, srvCB, 0);
+
+    // This does not start the discovery if the application does not
+    // use it.
+    UPnPDeviceDirectory::addCallback(deviceSeen);
+    UPnPDeviceDirectory::addLostCallback(deviceLost);
+    return true;
+}
+
+void SubscriptionManager::addListener(const string& url, const string& udn,
+                                      const void *listener, evtCBFunc func)
+{
+    bool newsub = false;
+    bool replay = false;
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        auto it = o_subsbyurl.find(url);
+        if (it == o_subsbyurl.end()) {
+            std::shared_ptr<Subscription> sub =
+                std::make_shared<Subscription>();
+            sub->eventURL = url;
+            sub->deviceId = udn;
+            sub->native = o_native != nullptr;
+            it = o_subsbyurl.insert(make_pair(url, sub)).first;
+            newsub = true;
+        }
+        Subscription& sub = *(it->second);
+        sub.listeners.push_back(Listener(listener, func));
+        // If we know something, send it now. Else the listener will
+        // get the initial event when it arrives.
+        replay = sub.hasState();
+        LOGDEB1("Service::addListener: " << url << " listeners " <<
+                sub.listeners.size() << endl);
+    }
+    if (newsub) {
+        o_subsworkers.schedule(url, 0);
+    }
+    if (replay) {
+        o_dispatcher.post(url, EventProps(), false, EventDispatcher::EVT_REPLAY,
+                      listener);
+    }
+}
+
+void SubscriptionManager::removeListener(const string& url,
+                                         const void *listener)
+{
+    string sid;
+    bool native = false;
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        auto it = o_subsbyurl.find(url);
+        if (it == o_subsbyurl.end())
+            return;
+        std::shared_ptr<Subscription> sub = it->second;
+        native = sub->native;
+        for (auto lit = sub->listeners.begin(); lit != sub->listeners.end();
+             lit++) {
+            if (lit->id == listener) {
+                sub->listeners.erase(lit);
+                break;
+            }
+        }
+        if (sub->listeners.empty()) {
+            sub->removed = true;
+            o_subsbyurl.erase(it);
+            if (!sub->sid.empty()) {
+                o_subsbysid.erase(sub->sid);
+                // If a worker is subscribing, it will clean up.
+                if (!sub->subscribing)
+                    sid = sub->sid;
+            }
+        }
+    }
+    if (!sid.empty()) {
+        doUnSubscribe(url, sid, native);
+    }
+    o_dispatcher.waitRunning(url);
+}
+
+void SubscriptionManager::refresh(const string& url, const void *listener)
+{
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        auto it = o_subsbyurl.find(url);
+        if (it == o_subsbyurl.end())
+            return;
+        Subscription& sub = *(it->second);
+        if (!sub.hasState()) {
+            // Nothing known. If we are subscribed, do it again to get
+            // an initial event, else it is coming anyway.
+            if (!sub.needsub && !sub.subscribing) {
+                sub.needsub = true;
+                lock.unlock();
+                o_subsworkers.schedule(url, 0);
+            }
+            return;
+        }
+    }
+    // No need to bother the device, we have the values.
+    o_dispatcher.post(url, EventProps(), false, EventDispatcher::EVT_REPLAY,
+                      listener);
+}
+
+void SubscriptionManager::setRateLimits(
+    const string& url, const void *listener,
+    const std::unordered_map<string, int>& rates)
+{
+    TimePoint now = std::chrono::steady_clock::now();
+    bool flush = false;
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        auto it = o_subsbyurl.find(url);
+        if (it == o_subsbyurl.end())
+            return;
+        for (auto& lst : it->second->listeners) {
+            if (lst.id == listener) {
+                lst.rates = rates;
+                // Release what we may be holding for removed limits.
+                flush = !lst.pending.empty() || lst.lcpending.size();
+                break;
+            }
+        }
+    }
+    if (flush) {
+        o_dispatcher.postFlush(url, listener, now);
+    }
+}
+
+bool SubscriptionManager::startNativeEvents(const string& ip, int port)
+{
+    std::unique_lock<std::mutex> lock(o_mutex);
+    if (o_native) {
+        return true;
+    }
+    string host(ip);
+    if (host.empty()) {
+        LibUPnP *lib = LibUPnP::getLibUPnP();
+        if (lib)
+            host = lib->host();
+        if (host.empty()) {
+            LOGERR("Service::startNativeEvents: no local address" << endl);
+            return false;
+        }
+    }
+    std::unique_ptr<GenaListener> listener(new GenaListener(
+        [] (const string& sid, int seq, EventProps&& props) {
+            return eventReceived(sid, seq == 0, std::move(props));
+        }));
+    if (!listener->start(host, port)) {
+        return false;
+    }
+    o_nativecallback = "http://" + host + ":" +
+        std::to_string(listener->port()) + "/gena";
+    o_native = std::move(listener);
+    LOGINF("Service: native events, callback " << o_nativecallback << endl);
+    return true;
+}
+
+void SubscriptionManager::shutdown()
+{
+    // Subscription workers first: they use the callback URL and the
+    // libupnp handle. Then the native listener, which posts to the
+    // dispatcher. Not holding o_mutex, which the threads may need to
+    // finish.
+    o_subsworkers.shutdown();
+    std::unique_ptr<GenaListener> native;
+    {
+        std::unique_lock<std::mutex> lock(o_mutex);
+        native = std::move(o_native);
+    }
+    native.reset();
+    o_dispatcher.shutdown();
+}
+
+bool SubscriptionManager::isFullState()
+{
+    return o_fullstate;
+}
+
+bool SubscriptionManager::isActive(const string& url)
+{
+    std::unique_lock<std::mutex> lock(o_mutex);
+    auto it = o_subsbyurl.find(url);
+    return it != o_subsbyurl.end() && !it->second->sid.empty() &&
+        !it->second->needsub;
+}
+
+} // namespace UPnPClient
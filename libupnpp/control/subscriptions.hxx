@@ -0,0 +1,106 @@
+/* Copyright (C) 2006-2016 J.F.Dockes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *   02110-1301 USA
+ */
+#ifndef _SUBSCRIPTIONS_HXX_INCLUDED_
+#define _SUBSCRIPTIONS_HXX_INCLUDED_
+
+#include "libupnpp/config.h"
+
+#include <string>
+#include <unordered_map>
+
+#include "libupnpp/control/service.hxx"
+
+namespace UPnPClient {
+
+/** Private: event subscriptions management for the Service objects.
+ *
+ * There is a single GENA subscription per event URL, shared by all the
+ * local Service objects (listeners) for the URL. The subscription
+ * exchanges are performed by a pool of threads, so that opening a
+ * device with many services does not wait for them one by one, and
+ * the caller never waits for the network.
+ *
+ * The expiry and renewals (performed by libupnp) are tracked. After
+ * a renewal failure or expiry, the manager subscribes again, with
+ * increasing delays in case of failure. A device which goes away and
+ * comes back (as seen by the discovery module) is subscribed again at
+ * once. The listeners just see the new initial event.
+ *
+ * Events are delivered by a separate pool of threads, in order for a
+ * given subscription, in parallel for different ones.
+ */
+class SubscriptionManager {
+public:
+    /** Register our libupnp event handlers. Only does something on
+     * the first call */
+    static bool init();
+
+    /** Add a listener for the event URL. This returns immediately, the
+     * subscription is performed in the background if needed. If
+     * values are already known for the URL, they are sent to the new
+     * listener at once, as a single event.
+     * @param listener opaque listener identifier, used for removal.
+     */
+    static void addListener(const std::string& eventURL,
+                            const std::string& deviceId,
+                            const void *listener, evtCBFunc func);
+
+    /** Remove listener. The subscription is cancelled if this was the
+     * last one. Waits for a running callback for this URL to return,
+     * unless called from the callback itself. */
+    static void removeListener(const std::string& eventURL,
+                               const void *listener);
+
+    /** Send all the known state values to the listener. If nothing is
+     * known yet and we have an active subscription, subscribe again to
+     * get a new initial event. */
+    static void refresh(const std::string& eventURL, const void *listener);
+
+    /** Set the rate limits for the listener: minimum interval in
+     * milliseconds between deliveries, per variable name. The values
+     * of the limited variables which come too early are held back and
+     * delivered when the interval has elapsed, keeping only the last
+     * one. Variables inside LastChange can be limited too: the
+     * LastChange value is held back if it only contains limited
+     * variables which are not due. */
+    static void setRateLimits(const std::string& eventURL,
+                              const void *listener,
+                              const std::unordered_map<std::string, int>&);
+
+    /** Receive the events with our own GENA listener instead of
+     * libupnp. Only affects the subscriptions created afterwards. */
+    static bool startNativeEvents(const std::string& ip, int port);
+
+    /** Stop and join the subscription and event delivery threads,
+     * and the native listener. Called by the LibUPnP destructor,
+     * before UpnpFinish(), and at exit. No events are delivered and no
+     * subscriptions are performed afterwards. */
+    static void shutdown();
+
+    /** Do we currently hold a subscription for the URL ? */
+    static bool isActive(const std::string& eventURL);
+
+    /** Called from a listener callback: does the event hold the full
+     * state (initial event of a subscription, or replay of the known
+     * values for a new listener or a refresh), rather than changes ? */
+    static bool isFullState();
+};
+
+} // namespace UPnPClient
+
+#endif /* _SUBSCRIPTIONS_HXX_INCLUDED_ */
@@ -114,9 +114,10 @@ int TypedService::runAction(const string& actnm, vector<string> args,
     if (ret != 0) {
         return ret;
     }
-    unordered_map<string,string> retdata;
-    sdata.getMap(retdata);
-    data = map<string,string>(retdata.begin(), retdata.end());
+    data.clear();
+    for (const auto& arg : sdata.getArgs()) {
+        data[arg.first] = arg.second;
+    }
     return UPNP_E_SUCCESS;
 }
 
@@ -105,6 +105,38 @@ public:
         return false;
     }
 
+    /*
+      Push interface, for data which arrives in pieces: call with
+      each chunk in order, and isfinal set for the last one (which may
+      be empty).
+    */
+    virtual bool ParseChunk(const char *data, size_t len, bool isfinal) {
+        if(!Ready())
+            return false;
+        XML_Status local_status =
+            XML_Parse(expat_parser, data, int(len),
+                      isfinal ? XML_TRUE : XML_FALSE);
+        if(local_status != XML_STATUS_OK) {
+            set_status(local_status);
+            return false;
+        }
+        return true;
+    }
+
+    /* Get ready to parse a new document, reusing the expat parser */
+    virtual bool Reset(void) {
+        if(expat_parser == NULL || !XML_ParserReset(expat_parser, NULL))
+            return false;
+        status = XML_STATUS_OK;
+        last_error = XML_ERROR_NONE;
+        last_error_message.clear();
+        /* The handlers and user data are cleared by XML_ParserReset */
+        XML_SetUserData(expat_parser, (void*)this);
+        register_default_handlers();
+        valid_parser = true;
+        return true;
+    }
+
     /* Expose status, error, and control codes to users */
     virtual bool Ready(void) const {
         return valid_parser;
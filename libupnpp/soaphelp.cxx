@@ -21,8 +21,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <iostream>
+#include <utility>
 #include <vector>
 
 #include "libupnpp/log.hxx"
@@ -32,10 +34,22 @@ using namespace std;
 
 namespace UPnPP {
 
+// The argument lists are short (a handful of entries), so a vector
+// searched linearly is both faster and lighter than a map, and the
+// lookups need not build a temporary string from the char* key.
 class SoapIncoming::Internal {
 public:
     string name;
-    unordered_map<string, string> args;
+    vector<pair<string, string> > args;
+
+    string *find(const char *nm) {
+        for (auto& arg : args) {
+            if (!strcmp(arg.first.c_str(), nm)) {
+                return &arg.second;
+            }
+        }
+        return nullptr;
+    }
 };
 
 SoapIncoming::SoapIncoming()
@@ -55,10 +69,24 @@ SoapIncoming::~SoapIncoming()
 void SoapIncoming::getMap(unordered_map<string, string>& out)
 {
     if (m) {
-        out = m->args;
+        out.clear();
+        out.reserve(m->args.size());
+        for (const auto& arg : m->args) {
+            out[arg.first] = arg.second;
+        }
     }
 }
 
+void SoapIncoming::swap(SoapIncoming& other)
+{
+    std::swap(m, other.m);
+}
+
+const vector<pair<string, string> >& SoapIncoming::getArgs() const
+{
+    return m->args;
+}
+
 /* Example Soap XML doc passed by libupnp is like:
    <ns0:SetMute>
      <InstanceID>0</InstanceID>
@@ -93,7 +121,9 @@ bool SoapIncoming::decode(const char *callnm, IXML_Document *actReq)
     //LOGDEB("SoapIncoming: childnodes list length: " << ixmlNodeList_length(nl)
     // << endl);
     bool ret = false;
-    for (unsigned long i = 0; i <  ixmlNodeList_length(nl); i++) {
+    unsigned long cnt = ixmlNodeList_length(nl);
+    m->args.reserve(cnt);
+    for (unsigned long i = 0; i < cnt; i++) {
         IXML_Node *cld = ixmlNodeList_item(nl, i);
         if (cld == 0) {
             //LOGDEB1("SoapIncoming: got null node  from nodelist at index " <<
@@ -121,7 +151,12 @@ bool SoapIncoming::decode(const char *callnm, IXML_Document *actReq)
         if (value == 0) {
             value = "";
         }
-        m->args[name] = value;
+        string *prev = m->find(name);
+        if (prev) {
+            *prev = value;
+        } else {
+            m->args.emplace_back(name, value);
+        }
     }
     m->name = callnm;
     ret = true;
@@ -140,30 +175,41 @@ const string& SoapIncoming::getName() const
 
 bool SoapIncoming::get(const char *nm, bool *value) const
 {
-    auto it = m->args.find(nm);
-    if (it == m->args.end() || it->second.empty()) {
+    const string *vp = m->find(nm);
+    if (vp == nullptr || vp->empty()) {
         return false;
     }
-    return stringToBool(it->second, value);
+    return stringToBool(*vp, value);
 }
 
 bool SoapIncoming::get(const char *nm, int *value) const
 {
-    auto it = m->args.find(nm);
-    if (it == m->args.end() || it->second.empty()) {
+    const string *vp = m->find(nm);
+    if (vp == nullptr || vp->empty()) {
         return false;
     }
-    *value = atoi(it->second.c_str());
+    *value = atoi(vp->c_str());
     return true;
 }
 
 bool SoapIncoming::get(const char *nm, string *value) const
 {
-    auto it = m->args.find(nm);
-    if (it == m->args.end()) {
+    const string *vp = m->find(nm);
+    if (vp == nullptr) {
+        return false;
+    }
+    *value = *vp;
+    return true;
+}
+
+bool SoapIncoming::take(const char *nm, string *value)
+{
+    string *vp = m->find(nm);
+    if (vp == nullptr) {
         return false;
     }
-    *value = it->second;
+    *value = std::move(*vp);
+    vp->clear();
     return true;
 }
 
@@ -232,12 +278,29 @@ string SoapHelp::xmlUnquote(const string& in)
     return out;
 }
 
-// Yes inefficient. whatever...
+// Format an integer at the end of the buffer, return the start
+// position. The buffer must be at least 12 bytes long.
+static char *formatint(int val, char *end)
+{
+    char *cp = end;
+    // Use unsigned arithmetic so that INT_MIN does not overflow
+    unsigned int uval = val < 0 ? 0U - (unsigned int)val : (unsigned int)val;
+    do {
+        *--cp = '0' + uval % 10;
+        uval /= 10;
+    } while (uval);
+    if (val < 0) {
+        *--cp = '-';
+    }
+    return cp;
+}
+
 string SoapHelp::i2s(int val)
 {
-    char cbuf[30];
-    sprintf(cbuf, "%d", val);
-    return string(cbuf);
+    char cbuf[12];
+    char *end = cbuf + sizeof(cbuf);
+    char *start = formatint(val, end);
+    return string(start, end - start);
 }
 
 class SoapOutgoing::Internal {
@@ -245,6 +308,17 @@ public:
     string serviceType;
     string name;
     vector<pair<string, string> > data;
+
+    // Add an entry with an empty value, which the caller will set.
+    string& newarg(const string& k) {
+        // Most actions have a handful of arguments: reserve once
+        // instead of growing the vector by steps.
+        if (data.capacity() == 0) {
+            data.reserve(8);
+        }
+        data.emplace_back(k, string());
+        return data.back().second;
+    }
 };
 
 SoapOutgoing::SoapOutgoing()
@@ -276,15 +350,47 @@ const string& SoapOutgoing::getName() const
     return m->name;
 }
 
+const vector<pair<string, string> >& SoapOutgoing::getArgs() const
+{
+    return m->data;
+}
+
 SoapOutgoing& SoapOutgoing::addarg(const string& k, const string& v)
 {
-    m->data.push_back(pair<string, string>(k, v));
+    m->newarg(k) = v;
     return *this;
 }
 
-SoapOutgoing& SoapOutgoing::operator()(const string& k, const string& v)
+SoapOutgoing& SoapOutgoing::addarg(const string& k, string&& v)
 {
-    m->data.push_back(pair<string, string>(k, v));
+    m->newarg(k) = std::move(v);
+    return *this;
+}
+
+SoapOutgoing& SoapOutgoing::addarg(const string& k, const char *v)
+{
+    m->newarg(k) = v;
+    return *this;
+}
+
+SoapOutgoing& SoapOutgoing::addarg(const string& k, int v)
+{
+    char cbuf[12];
+    char *end = cbuf + sizeof(cbuf);
+    char *start = formatint(v, end);
+    m->newarg(k).assign(start, end - start);
+    return *this;
+}
+
+SoapOutgoing& SoapOutgoing::addarg(const string& k, bool v)
+{
+    m->newarg(k) = v ? "1" : "0";
+    return *this;
+}
+
+SoapOutgoing& SoapOutgoing::reserve(size_t cnt)
+{
+    m->data.reserve(cnt);
     return *this;
 }
 
@@ -329,52 +435,25 @@ IXML_Document *SoapOutgoing::buildSoapBody(bool isResponse) const
 //       <!-- Other variable names and values (if any) go here. -->
 //     </e:propertyset>
 
-bool decodePropertySet(IXML_Document *doc,
-                       unordered_map<string, string>& out)
+// Walk the propertyset, calling emit(name, value) for each
+// variable. We follow the sibling pointers instead of asking ixml for
+// node lists, which would be allocated for each level.
+template <class F> static bool walkPropertySet(IXML_Document *doc, F emit)
 {
-    bool ret = false;
     IXML_Node* topNode = ixmlNode_getFirstChild((IXML_Node *)doc);
     if (topNode == 0) {
         LOGERR("decodePropertySet: (no topNode) ??" << endl);
         return false;
     }
 
-    // Top node is <e:propertyset>
-    //LOGDEB("decodePropertySet: topnode name: " <<
-    //ixmlNode_getNodeName(topNode) << endl);
-
-    // Get the children. These are normally <e:property> elements
-    IXML_NodeList* nl = ixmlNode_getChildNodes(topNode);
-    if (nl == 0) {
-        LOGDEB("decodePropertySet: empty list" << endl);
-        return true;
-    }
-    // Walk the <e:property> elements
-    for (unsigned long i = 0; i <  ixmlNodeList_length(nl); i++) {
-        IXML_Node *cld = ixmlNodeList_item(nl, i);
-        if (cld == 0) {
-            LOGDEB("decodePropertySet: got null node  from nlist at index " <<
-                   i << " ??" << endl);
-            // Seems to happen with empty arg list?? This looks like a bug,
-            // should we not get an empty node instead?
-            if (i == 0) {
-                ret = true;
-            }
-            goto out;
-        }
-
-        // We should compare to e:property in case there is other stuff in there
-        const char *name = ixmlNode_getNodeName(cld);
-        //LOGDEB("decodePropertySet: got node name:     " <<
-        //ixmlNode_getNodeName(cld) << endl);
-        if (cld == 0) {
-            DOMString pnode = ixmlPrintNode(cld);
-            LOGDEB("decodePropertySet: got null name ??:" << pnode << endl);
-            ixmlFreeDOMString(pnode);
-            goto out;
-        }
+    // Top node is <e:propertyset>. Its children are normally
+    // <e:property> elements
+    for (IXML_Node *cld = ixmlNode_getFirstChild(topNode); cld != 0;
+         cld = ixmlNode_getNextSibling(cld)) {
+        if (ixmlNode_getNodeType(cld) != eELEMENT_NODE)
+            continue;
 
-        // Get the child nodes. These should all be like
+        // The children should all be like
         // <varname>value</varname>. Note that libupnpp versions up to
         // 0.14.1 considered that there could only be one varname
         // element under each <e:property> element. Most devices work
@@ -384,22 +463,16 @@ bool decodePropertySet(IXML_Document *doc,
         // point, and, for example, MediaTomb, sends multiple variables
         // per property, and upnp-inspector groks it. So let's grok it
         // too.
-        IXML_NodeList* nl1 = ixmlNode_getChildNodes(cld);
-        if (nl1 == 0) {
-            LOGDEB("decodePropertySet: empty sublist" << endl);
-            continue;
-        }
-        for (unsigned long i1 = 0; i1 <  ixmlNodeList_length(nl1); i1++) {
-            IXML_Node *subnode1 = ixmlNodeList_item(nl1, i1);
-            name = ixmlNode_getNodeName(subnode1);
-            //LOGDEB("decodePropertySet: got var node name:         " <<
-            // name << endl);
+        for (IXML_Node *subnode1 = ixmlNode_getFirstChild(cld); subnode1 != 0;
+             subnode1 = ixmlNode_getNextSibling(subnode1)) {
+            if (ixmlNode_getNodeType(subnode1) != eELEMENT_NODE)
+                continue;
+            const char *name = ixmlNode_getNodeName(subnode1);
+            if (name == 0)
+                continue;
 
             // Get the value text: <varname>valuetext</varname>
             IXML_Node *txtnode = ixmlNode_getFirstChild(subnode1);
-            //LOGDEB("decodePropertySet: got txtnode name:             " <<
-            //     ixmlNode_getNodeName(txtnode) << endl);
-
             const char *value = "";
             if (txtnode != 0) {
                 value = ixmlNode_getNodeValue(txtnode);
@@ -410,17 +483,18 @@ bool decodePropertySet(IXML_Document *doc,
             }
             // ixml does the unquoting. Don't call xmlUnquote here
             //LOGDEB("decodePropertySet: " << name << " -> " << value << endl);
-            out[name] = value;
+            emit(name, value);
         }
-        ixmlNodeList_free(nl1);
     }
+    return true;
+}
 
-    ret = true;
-out:
-    if (nl) {
-        ixmlNodeList_free(nl);
-    }
-    return ret;
+bool decodePropertySet(IXML_Document *doc,
+                       unordered_map<string, string>& out)
+{
+    return walkPropertySet(doc, [&out](const char *nm, const char *value) {
+            out[nm] = value;
+        });
 }
 
 } // namespace
@@ -23,6 +23,8 @@
 #include <unordered_map>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <upnp/ixml.h>
 
@@ -54,7 +56,22 @@ public:
     /** Get string parameter value */
     bool get(const char *nm, std::string *value) const;
 
+    /** Get string parameter value, moving it out of the object.
+     *
+     * Use this for big values like a ContentDirectory DIDL Result
+     * which will not be needed again: the stored value is left empty
+     * and a further get() or take() will return an empty string.
+     */
+    bool take(const char *nm, std::string *value);
+
+    /** Access the arguments in document order, without copying. */
+    const std::vector<std::pair<std::string, std::string> >& getArgs() const;
+
+    /** Copy the arguments to a map. Better use getArgs() if possible. */
     void getMap(std::unordered_map<std::string, std::string>& out);
+
+    /** Exchange contents with other object, without copying */
+    void swap(SoapIncoming& other);
 private:
     class Internal;
     Internal *m;
@@ -91,9 +108,39 @@ public:
     SoapOutgoing(const std::string& st, const std::string& nm);
     ~SoapOutgoing();
 
+    /** Add a named value to the list.
+     *
+     * The rvalue version moves the value into the list instead of
+     * copying it. The numeric and boolean versions format the value
+     * directly into the stored string, there is no need to call
+     * SoapHelp::i2s() or val2s(). The const char* version is needed
+     * so that string literals do not end up converted to bool.
+     */
     SoapOutgoing& addarg(const std::string& k, const std::string& v);
-
-    SoapOutgoing& operator()(const std::string& k, const std::string& v);
+    SoapOutgoing& addarg(const std::string& k, std::string&& v);
+    SoapOutgoing& addarg(const std::string& k, const char *v);
+    SoapOutgoing& addarg(const std::string& k, int v);
+    SoapOutgoing& addarg(const std::string& k, bool v);
+
+    SoapOutgoing& operator()(const std::string& k, const std::string& v) {
+        return addarg(k, v);
+    }
+    SoapOutgoing& operator()(const std::string& k, std::string&& v) {
+        return addarg(k, std::move(v));
+    }
+    SoapOutgoing& operator()(const std::string& k, const char *v) {
+        return addarg(k, v);
+    }
+    SoapOutgoing& operator()(const std::string& k, int v) {
+        return addarg(k, v);
+    }
+    SoapOutgoing& operator()(const std::string& k, bool v) {
+        return addarg(k, v);
+    }
+
+    /** Reserve storage for the arguments. Not needed for less than 8
+     * arguments, for which space is reserved on the first addarg(). */
+    SoapOutgoing& reserve(size_t cnt);
 
     /** Build the SOAP call or response data XML document from the
        vector of named values */
@@ -101,6 +148,9 @@ public:
 
     const std::string& getName() const;
 
+    /** Access the arguments in insertion order */
+    const std::vector<std::pair<std::string, std::string> >& getArgs() const;
+
 private:
     class Internal;
     Internal *m;
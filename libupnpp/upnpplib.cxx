@@ -39,6 +39,7 @@
 #include <utility>
 #include <vector>
 
+#include "libupnpp/control/subscriptions.hxx"
 #include "libupnpp/getsyshwaddr.h"
 #include "libupnpp/log.hxx"
 #include "libupnpp/md5.hxx"
@@ -318,6 +319,8 @@ int LibUPnP::o_callback(Upnp_EventType et, CBCONST void* evp, void* cookie)
 
 LibUPnP::~LibUPnP()
 {
+    // The subscription threads use the client handle.
+    UPnPClient::SubscriptionManager::shutdown();
     int error = UpnpFinish();
     if (error != UPNP_E_SUCCESS) {
         LOGINF("LibUPnP::~LibUPnP: " << errAsString("UpnpFinish", error)
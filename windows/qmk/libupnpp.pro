@@ -40,13 +40,16 @@ contains(QMAKE_CC, cl){
 
 SOURCES += \
 ../../libupnpp/base64.cxx \
+../../libupnpp/control/actionstats.cxx \
 ../../libupnpp/control/avlastchg.cxx \
 ../../libupnpp/control/avtransport.cxx \
 ../../libupnpp/control/cdircontent.cxx \
 ../../libupnpp/control/cdirectory.cxx \
 ../../libupnpp/control/description.cxx \
 ../../libupnpp/control/device.cxx \
+../../libupnpp/control/devicehealth.cxx \
 ../../libupnpp/control/discovery.cxx \
+../../libupnpp/control/gena.cxx \
 ../../libupnpp/control/httpdownload.cxx \
 ../../libupnpp/control/linnsongcast.cxx \
 ../../libupnpp/control/mediarenderer.cxx \
@@ -55,12 +58,14 @@ SOURCES += \
 ../../libupnpp/control/ohplaylist.cxx \
 ../../libupnpp/control/ohproduct.cxx \
 ../../libupnpp/control/ohradio.cxx \
+../../libupnpp/control/ohtracklist.cxx \
 ../../libupnpp/control/ohreceiver.cxx \
 ../../libupnpp/control/ohsender.cxx \
 ../../libupnpp/control/ohtime.cxx \
 ../../libupnpp/control/ohvolume.cxx \
 ../../libupnpp/control/renderingcontrol.cxx \
 ../../libupnpp/control/service.cxx \
+../../libupnpp/control/subscriptions.cxx \
 ../../libupnpp/device/device.cxx \
 ../../libupnpp/device/vdir.cxx \
 ../../libupnpp/getsyshwaddr.c \